@@ -14,21 +14,98 @@
 #include <linux/kernel.h>
 #include <linux/slab.h>
 #include <linux/uaccess.h>
+#include <linux/rcupdate.h>
 #include <linux/workqueue.h>
+#include <linux/list.h>
+#include <linux/ktime.h>
 #include <linux/device.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
 #include "svc_msg.h"
 #include "greybus_manifest.h"
 #include "greybus.h"
 
+/* The message itself always comes right after this, see ap_msg_of() */
 struct ap_msg {
 	u8 *data;
 	size_t size;
 	struct greybus_host_device *hd;
-	struct work_struct event;
+	struct list_head list;
+	int slot;		/* -1 if not one of ap_msg_slots */
+	bool hotplug;		/* a module is being added */
+	ktime_t received;	/* only for hotplug */
 };
 
 static struct workqueue_struct *ap_workqueue;
 
+/*
+ * Messages for different modules are handled in parallel, each module gets
+ * a "lane" that hands its messages to the workqueue one at a time, so they
+ * are still handled in the order they came in.  Anything that isn't about a
+ * single module goes down the control lane.
+ */
+struct ap_lane {
+	spinlock_t lock;
+	struct list_head msgs;
+	struct work_struct work;
+};
+
+#define AP_LANE_CONTROL		256
+#define AP_LANES		(AP_LANE_CONTROL + 1)
+
+static struct ap_lane ap_lanes[AP_LANES];
+
+/*
+ * SVC messages come in from interrupt context, so rather than allocating
+ * memory for every one of them, they get copied into one of these slots,
+ * and are handled (manifests and all) straight out of it.  Only if a burst
+ * of messages uses up all of the slots, or a message is bigger than any host
+ * controller sends today, do we fall back to kmalloc().  The slots are
+ * shared by all host devices, so a hotplug gives its slot back as soon as
+ * the manifest has been looked up, not once the module has been probed.
+ */
+#define AP_MSG_SLOTS		32
+#define AP_MSG_SLOT_SIZE	2048
+
+static struct ap_msg *ap_msg_slots[AP_MSG_SLOTS];
+static unsigned long ap_msg_slots_busy[BITS_TO_LONGS(AP_MSG_SLOTS)];
+
+static struct ap_msg *ap_msg_get(size_t size)
+{
+	struct ap_msg *ap_msg;
+	int slot;
+
+	if (size <= AP_MSG_SLOT_SIZE) {
+		do {
+			slot = find_first_zero_bit(ap_msg_slots_busy,
+						   AP_MSG_SLOTS);
+		} while (slot < AP_MSG_SLOTS &&
+			 test_and_set_bit_lock(slot, ap_msg_slots_busy));
+		if (slot < AP_MSG_SLOTS)
+			return ap_msg_slots[slot];
+	}
+
+	ap_msg = kmalloc(sizeof(*ap_msg) + size, GFP_ATOMIC);
+	if (!ap_msg)
+		return NULL;
+	ap_msg->data = (u8 *)(ap_msg + 1);
+	ap_msg->slot = -1;
+	return ap_msg;
+}
+
+static void ap_msg_put(struct ap_msg *ap_msg)
+{
+	if (ap_msg->slot < 0)
+		kfree(ap_msg);
+	else
+		clear_bit_unlock(ap_msg->slot, ap_msg_slots_busy);
+}
+
+static struct ap_msg *ap_msg_of(struct svc_msg *svc_msg)
+{
+	return (struct ap_msg *)svc_msg - 1;
+}
+
 static struct svc_msg *svc_msg_alloc(enum svc_function_id id)
 {
 	struct svc_msg *svc_msg;
@@ -54,24 +131,21 @@ static int svc_msg_send(struct svc_msg *svc_msg, struct greybus_host_device *hd)
 	// FIXME - Do we need to do more than just pass it to the hd and then
 	// free it?
 	retval = hd->driver->send_svc_msg(svc_msg, hd);
+	gb_capture(hd, 0, GB_CAPTURE_OUT, GB_CAPTURE_SVC, svc_msg,
+		   sizeof(svc_msg->header) +
+		   le16_to_cpu(svc_msg->header.payload_length), retval);
 
 	svc_msg_free(svc_msg);
 	return retval;
 }
 
 
-static void svc_handshake(struct svc_function_handshake *handshake,
-			  int payload_length, struct greybus_host_device *hd)
+static void svc_handshake(struct svc_msg *msg, int payload_length,
+			  struct greybus_host_device *hd)
 {
+	struct svc_function_handshake *handshake = &msg->handshake;
 	struct svc_msg *svc_msg;
 
-	if (payload_length != sizeof(struct svc_function_handshake)) {
-		dev_err(hd->parent,
-			"Illegal size of svc handshake message %d\n",
-			payload_length);
-		return;
-	}
-
 	/* A new SVC communication channel, let's verify a supported version */
 	if ((handshake->version_major != GREYBUS_VERSION_MAJOR) &&
 	    (handshake->version_minor != GREYBUS_VERSION_MINOR)) {
@@ -103,44 +177,49 @@ static void svc_handshake(struct svc_function_handshake *handshake,
 	svc_msg_send(svc_msg, hd);
 }
 
-static void svc_management(struct svc_function_unipro_management *management,
-			   int payload_length, struct greybus_host_device *hd)
+static void svc_management(struct svc_msg *msg, int payload_length,
+			   struct greybus_host_device *hd)
 {
-	if (payload_length != sizeof(struct svc_function_unipro_management)) {
-		dev_err(hd->parent,
-			"Illegal size of svc management message %d\n",
-			payload_length);
-		return;
-	}
-
 	/* What?  An AP should not get this message */
 	dev_err(hd->parent, "Got an svc management message???\n");
 }
 
-static void svc_hotplug(struct svc_function_hotplug *hotplug,
-			int payload_length, struct greybus_host_device *hd)
+static void svc_hotplug(struct svc_msg *msg, int payload_length,
+			struct greybus_host_device *hd)
 {
+	struct greybus_descriptor_serial_number serial_number = { };
+	struct svc_function_hotplug *hotplug = &msg->hotplug;
 	u8 module_id = hotplug->module_id;
+	int data_length = payload_length - sizeof(*hotplug);
+	struct gb_manifest *manifest;
 
 	switch (hotplug->hotplug_event) {
 	case SVC_HOTPLUG_EVENT:
-		/* Add a new module to the system */
-		if (payload_length < 0x03) {
-			/* Hotplug message is at lest 3 bytes big */
+		/*
+		 * Add a new module to the system, it has to have a manifest.
+		 * Nothing needs the message once that has been looked up, so
+		 * it's given back here, see ap_process_msg().
+		 */
+		if (!data_length) {
 			dev_err(hd->parent,
 				"Illegal size of svc hotplug message %d\n",
 				payload_length);
+			ap_msg_put(ap_msg_of(msg));
 			return;
 		}
 		dev_dbg(hd->parent, "module id %d added\n", module_id);
-		gb_add_module(hd, module_id, hotplug->data,
-			      payload_length - 0x02);
+
+		/* Identical modules share one copy of what it says */
+		manifest = gb_manifest_get(hd->parent, hotplug->data,
+					   data_length, &serial_number);
+		ap_msg_put(ap_msg_of(msg));
+		if (manifest)
+			gb_add_module(hd, module_id, manifest, &serial_number);
 		break;
 
 	case SVC_HOTUNPLUG_EVENT:
-		/* Remove a module from the system */
-		if (payload_length != 0x02) {
-			/* Hotunplug message is only 2 bytes big */
+		/* Remove a module from the system, nothing comes with that */
+		if (data_length) {
 			dev_err(hd->parent,
 				"Illegal size of svc hotunplug message %d\n",
 				payload_length);
@@ -158,22 +237,18 @@ static void svc_hotplug(struct svc_function_hotplug *hotplug,
 	}
 }
 
-static void svc_ddb(struct svc_function_ddb *ddb,
-		    int payload_length, struct greybus_host_device *hd)
+static void svc_ddb(struct svc_msg *msg, int payload_length,
+		    struct greybus_host_device *hd)
 {
-	/*
-	 * Need to properly validate payload_length once we start
-	 * to handle ddb messages, but for now, we don't, so no need to check
-	 * anything.
-	 */
-
 	/* What?  An AP should not get this message */
 	dev_err(hd->parent, "Got an svc DDB message???\n");
 }
 
-static void svc_power(struct svc_function_power *power,
-		      int payload_length, struct greybus_host_device *hd)
+static void svc_power(struct svc_msg *msg, int payload_length,
+		      struct greybus_host_device *hd)
 {
+	struct svc_function_power *power = &msg->power;
+	struct greybus_module *gmod;
 	u8 module_id = power->module_id;
 
 	/*
@@ -186,160 +261,312 @@ static void svc_power(struct svc_function_power *power,
 		return;
 	}
 
-	/*
-	 * As struct struct svc_function_power_battery_status_request is 0 bytes
-	 * big, we can just check the union of the whole structure to validate
-	 * the size of this message.
-	 */
-	if (payload_length != sizeof(struct svc_function_power)) {
-		dev_err(hd->parent,
-			"Illegal size of svc power message %d\n",
-			payload_length);
+	dev_dbg(hd->parent, "power status for module id %d is %d\n",
+		module_id, power->status.status);
+
+	gmod = gb_module_find(hd, module_id);
+	if (!gmod) {
+		dev_err(hd->parent, "power status for unknown module id %d\n",
+			module_id);
 		return;
 	}
+	gb_battery_status(gmod, &power->status);
+	put_device(&gmod->dev);
+}
 
-	dev_dbg(hd->parent, "power status for module id %d is %d\n",
-		module_id, power->status.status);
+/* Ask the SVC to have a module send us its battery status */
+int gb_svc_battery_status_request(struct greybus_host_device *hd,
+				  u8 module_id)
+{
+	struct svc_msg *svc_msg;
 
-	// FIXME - do something with the power information, like update our
-	// battery information...
+	svc_msg = svc_msg_alloc(SVC_FUNCTION_POWER);
+	if (!svc_msg)
+		return -ENOMEM;
+
+	svc_msg->header.message_type = SVC_MSG_DATA;
+	svc_msg->header.payload_length =
+		cpu_to_le16(offsetof(struct svc_function_power, request));
+	svc_msg->power.power_type = SVC_POWER_BATTERY_STATUS_REQUEST;
+	svc_msg->power.module_id = module_id;
+	return svc_msg_send(svc_msg, hd);
 }
 
-static void svc_epm(struct svc_function_epm *epm,
-		    int payload_length, struct greybus_host_device *hd)
+static void svc_epm(struct svc_msg *msg, int payload_length,
+		    struct greybus_host_device *hd)
 {
 	/* What?  An AP should not get this message */
 	dev_err(hd->parent, "Got an EPM message???\n");
 }
 
-static void svc_suspend(struct svc_function_suspend *suspend,
-			int payload_length, struct greybus_host_device *hd)
+static void svc_suspend(struct svc_msg *msg, int payload_length,
+			struct greybus_host_device *hd)
 {
 	/* What?  An AP should not get this message */
 	dev_err(hd->parent, "Got an suspend message???\n");
 }
 
-static struct svc_msg *convert_ap_message(struct ap_msg *ap_msg,
-					  struct greybus_host_device *hd)
-{
-	struct svc_msg *svc_msg;
-	struct svc_msg_header *header;
+/* Messages have been through gb_svc_msg_check() by the time they get here */
+typedef void (*svc_handler_t)(struct svc_msg *svc_msg, int payload_length,
+			      struct greybus_host_device *hd);
+
+static const svc_handler_t svc_handlers[] = {
+	[SVC_FUNCTION_HANDSHAKE]		= svc_handshake,
+	[SVC_FUNCTION_UNIPRO_NETWORK_MANAGEMENT] = svc_management,
+	[SVC_FUNCTION_HOTPLUG]			= svc_hotplug,
+	[SVC_FUNCTION_DDB]			= svc_ddb,
+	[SVC_FUNCTION_POWER]			= svc_power,
+	[SVC_FUNCTION_EPM]			= svc_epm,
+	[SVC_FUNCTION_SUSPEND]			= svc_suspend,
+};
 
-	svc_msg = (struct svc_msg *)ap_msg->data;
-	header = &svc_msg->header;
+static struct {
+	atomic_t received;
+	atomic_t rejected;
+} svc_function_stats[GB_SVC_FUNCTIONS];
 
-	/* Validate the message type */
-	if (header->message_type != SVC_MSG_DATA) {
-		dev_err(hd->parent, "message type %d received?\n",
-			header->message_type);
-		return NULL;
-	}
+static atomic_t svc_function_unknown;
 
-	/*
-	 * The validation of the size of the message buffer happens in each
-	 * svc_* function, due to the different types of messages, keeping the
-	 * logic for each message only in one place.
-	 */
+static void svc_functions_check(void)
+{
+	/* Every function id needs a handler */
+	BUILD_BUG_ON(ARRAY_SIZE(svc_handlers) != GB_SVC_FUNCTIONS);
 
-	return svc_msg;
+	/* ap_msg_lane() finds the module id of all of these the same way */
+	BUILD_BUG_ON(offsetof(struct svc_function_hotplug, module_id) != 1);
+	BUILD_BUG_ON(offsetof(struct svc_function_power, module_id) != 1);
+	BUILD_BUG_ON(offsetof(struct svc_function_epm, module_id) != 1);
+	BUILD_BUG_ON(offsetof(struct svc_function_suspend, module_id) != 1);
+
+	/* A slot has to hold any message that is not variable sized */
+	BUILD_BUG_ON(sizeof(struct svc_msg) > AP_MSG_SLOT_SIZE);
 }
 
-static void ap_process_event(struct work_struct *work)
+static void ap_process_msg(struct ap_msg *ap_msg)
 {
 	struct svc_msg *svc_msg;
 	struct greybus_host_device *hd;
-	struct ap_msg *ap_msg;
+	bool hotplug = ap_msg->hotplug;
 	int payload_length;
+	u8 id;
 
-	ap_msg = container_of(work, struct ap_msg, event);
 	hd = ap_msg->hd;
 
-	/* Turn the "raw" data into a real message */
-	svc_msg = convert_ap_message(ap_msg, hd);
-	if (!svc_msg)
-		return;
+	/* Make sure the "raw" data is a real message */
+	svc_msg = (struct svc_msg *)ap_msg->data;
+	payload_length = gb_svc_msg_check(hd->parent, ap_msg->data,
+					  ap_msg->size);
+	if (payload_length == -ENOENT)
+		atomic_inc(&svc_function_unknown);
+	else if (payload_length == -EMSGSIZE)
+		atomic_inc(&svc_function_stats[svc_msg->header.function_id].rejected);
+	if (payload_length < 0) {
+		ap_msg_put(ap_msg);
+		goto exit;
+	}
+
+	id = svc_msg->header.function_id;
+	if (hotplug)
+		gb_hotplug_start(hd, svc_msg->hotplug.module_id,
+				 ap_msg->received);
+
+	atomic_inc(&svc_function_stats[id].received);
+	svc_handlers[id](svc_msg, payload_length, hd);
+
+	/* A module being added gave its message back already, in svc_hotplug() */
+	if (!hotplug)
+		ap_msg_put(ap_msg);
+exit:
+	/* Everything that was plugged in so far is there now, note the time */
+	if (hotplug && atomic_dec_and_test(&hd->hotplugs_pending))
+		hd->ready_ns = ktime_to_ns(ktime_sub(ktime_get(), hd->created));
+}
 
-	payload_length = le16_to_cpu(svc_msg->header.payload_length);
+static void ap_lane_work(struct work_struct *work)
+{
+	struct ap_lane *lane = container_of(work, struct ap_lane, work);
+	struct ap_msg *ap_msg;
+	unsigned long flags;
+
+	while (1) {
+		spin_lock_irqsave(&lane->lock, flags);
+		ap_msg = list_first_entry_or_null(&lane->msgs, struct ap_msg,
+						  list);
+		if (ap_msg)
+			list_del(&ap_msg->list);
+		spin_unlock_irqrestore(&lane->lock, flags);
+
+		if (!ap_msg)
+			break;
+		ap_process_msg(ap_msg);
+	}
+}
+
+/* Pick the lane for a message, it hasn't been validated yet */
+static struct ap_lane *ap_msg_lane(struct ap_msg *ap_msg)
+{
+	struct svc_msg *svc_msg = (struct svc_msg *)ap_msg->data;
+
+	if (ap_msg->size < sizeof(svc_msg->header) + 2)
+		return &ap_lanes[AP_LANE_CONTROL];
 
-	/* Look at the message to figure out what to do with it */
 	switch (svc_msg->header.function_id) {
-	case SVC_FUNCTION_HANDSHAKE:
-		svc_handshake(&svc_msg->handshake, payload_length, hd);
-		break;
-	case SVC_FUNCTION_UNIPRO_NETWORK_MANAGEMENT:
-		svc_management(&svc_msg->management, payload_length, hd);
-		break;
 	case SVC_FUNCTION_HOTPLUG:
-		svc_hotplug(&svc_msg->hotplug, payload_length, hd);
-		break;
-	case SVC_FUNCTION_DDB:
-		svc_ddb(&svc_msg->ddb, payload_length, hd);
-		break;
+		ap_msg->hotplug =
+			svc_msg->hotplug.hotplug_event == SVC_HOTPLUG_EVENT;
+		/* fall through */
 	case SVC_FUNCTION_POWER:
-		svc_power(&svc_msg->power, payload_length, hd);
-		break;
 	case SVC_FUNCTION_EPM:
-		svc_epm(&svc_msg->epm, payload_length, hd);
-		break;
 	case SVC_FUNCTION_SUSPEND:
-		svc_suspend(&svc_msg->suspend, payload_length, hd);
-		break;
+		/* These all have the module id in the same place */
+		return &ap_lanes[svc_msg->hotplug.module_id];
 	default:
-		dev_err(hd->parent, "received invalid SVC function ID %d\n",
-			svc_msg->header.function_id);
+		return &ap_lanes[AP_LANE_CONTROL];
 	}
+}
+
+static int svc_stats_show(struct seq_file *s, void *unused)
+{
+	int i;
+
+	for (i = 0; i < GB_SVC_FUNCTIONS; ++i)
+		seq_printf(s, "%-12s received %d rejected %d\n",
+			   gb_svc_function_name(i),
+			   atomic_read(&svc_function_stats[i].received),
+			   atomic_read(&svc_function_stats[i].rejected));
+	seq_printf(s, "%-12s %d\n", "unknown",
+		   atomic_read(&svc_function_unknown));
+	return 0;
+}
 
-	/* clean the message up */
-	kfree(ap_msg->data);
-	kfree(ap_msg);
+static int svc_stats_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, svc_stats_show, NULL);
 }
 
+static const struct file_operations svc_stats_fops = {
+	.open		= svc_stats_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
+static struct dentry *svc_stats_dentry;
+
 int gb_new_ap_msg(u8 *data, int size, struct greybus_host_device *hd)
 {
 	struct ap_msg *ap_msg;
+	struct ap_lane *lane;
+	unsigned long flags;
+	int retval = 0;
+
+	gb_capture(hd, 0, GB_CAPTURE_IN, GB_CAPTURE_SVC, data, size, 0);
+
+	/* Once the host device is going away, gb_ap_stop() waits for us */
+	rcu_read_lock();
+	if (ACCESS_ONCE(hd->removing)) {
+		retval = -ESHUTDOWN;
+		goto exit;
+	}
 
 	/*
-	 * Totally naive copy the message into a new structure that we slowly
-	 * create and add it to the list.  Let's get this working, the odds of
-	 * this being any "slow path" for AP messages is really low at this
-	 * point in time, but you never know, so this comment is here to point
-	 * out that maybe we should use a slab allocator, or even just not copy
-	 * the data, but use it directly and force the urbs to be "new" each
-	 * time.
+	 * Note - this can, and will, be called in interrupt context.  This is
+	 * the only copy of the message we make, the host controller gets its
+	 * buffer back as soon as we return.
 	 */
-
-	/* Note - this can, and will, be called in interrupt context. */
-	ap_msg = kmalloc(sizeof(*ap_msg), GFP_ATOMIC);
-	if (!ap_msg)
-		return -ENOMEM;
-	ap_msg->data = kmalloc(size, GFP_ATOMIC);
-	if (!ap_msg->data) {
-		kfree(ap_msg);
-		return -ENOMEM;
+	ap_msg = ap_msg_get(size);
+	if (!ap_msg) {
+		retval = -ENOMEM;
+		goto exit;
 	}
 	memcpy(ap_msg->data, data, size);
 	ap_msg->size = size;
 	ap_msg->hd = hd;
 
-	INIT_WORK(&ap_msg->event, ap_process_event);
-	queue_work(ap_workqueue, &ap_msg->event);
+	ap_msg->hotplug = false;
 
-	return 0;
+	lane = ap_msg_lane(ap_msg);
+	if (ap_msg->hotplug) {
+		ap_msg->received = ktime_get();
+		atomic_inc(&hd->hotplugs_pending);
+	}
+
+	spin_lock_irqsave(&lane->lock, flags);
+	list_add_tail(&ap_msg->list, &lane->msgs);
+	spin_unlock_irqrestore(&lane->lock, flags);
+
+	queue_work(ap_workqueue, &lane->work);
+exit:
+	rcu_read_unlock();
+	return retval;
 }
 EXPORT_SYMBOL_GPL(gb_new_ap_msg);
 
+/*
+ * Stop taking SVC messages for a host device that is going away, and wait
+ * for the ones it already sent to be handled, so nothing can add a module
+ * to it from here on.
+ */
+void gb_ap_stop(struct greybus_host_device *hd)
+{
+	hd->removing = true;
+	synchronize_rcu();
+	gb_ap_flush();
+}
+
+/* Wait for every SVC message that came in so far to be handled */
+void gb_ap_flush(void)
+{
+	flush_workqueue(ap_workqueue);
+}
+EXPORT_SYMBOL_GPL(gb_ap_flush);
+
 int gb_ap_init(void)
 {
-	ap_workqueue = alloc_workqueue("greybus_ap", 0, 1);
+	int i;
+
+	svc_functions_check();
+
+	for (i = 0; i < AP_LANES; ++i) {
+		spin_lock_init(&ap_lanes[i].lock);
+		INIT_LIST_HEAD(&ap_lanes[i].msgs);
+		INIT_WORK(&ap_lanes[i].work, ap_lane_work);
+	}
+
+	for (i = 0; i < AP_MSG_SLOTS; ++i) {
+		ap_msg_slots[i] = kmalloc(sizeof(struct ap_msg) +
+					  AP_MSG_SLOT_SIZE, GFP_KERNEL);
+		if (!ap_msg_slots[i])
+			goto error;
+		ap_msg_slots[i]->data = (u8 *)(ap_msg_slots[i] + 1);
+		ap_msg_slots[i]->slot = i;
+	}
+
+	ap_workqueue = alloc_workqueue("greybus_ap", WQ_UNBOUND, 0);
 	if (!ap_workqueue)
-		return -ENOMEM;
+		goto error;
+
+	svc_stats_dentry = debugfs_create_file("svc", S_IRUGO,
+					       gb_debugfs_get(), NULL,
+					       &svc_stats_fops);
 
 	return 0;
+
+error:
+	while (--i >= 0)
+		kfree(ap_msg_slots[i]);
+	return -ENOMEM;
 }
 
 void gb_ap_exit(void)
 {
+	int i;
+
+	debugfs_remove(svc_stats_dentry);
 	destroy_workqueue(ap_workqueue);
+
+	for (i = 0; i < AP_MSG_SLOTS; ++i)
+		kfree(ap_msg_slots[i]);
 }
 
 
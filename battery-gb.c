@@ -10,15 +10,41 @@
 #include <linux/module.h>
 #include <linux/slab.h>
 #include <linux/power_supply.h>
+#include <linux/spinlock.h>
+#include <linux/workqueue.h>
+#include <linux/jiffies.h>
 #include "greybus.h"
+#include "svc_msg.h"
+
+/*
+ * How old the battery status can get before we ask the module for a new one,
+ * how long we wait for it before asking again, and how often we tell the
+ * power supply core that something changed.
+ */
+#define GB_BATTERY_MAX_AGE		(5 * HZ)
+#define GB_BATTERY_REQUEST_TIMEOUT	(2 * HZ)
+#define GB_BATTERY_CHANGED_INTERVAL	(HZ)
 
 struct gb_battery {
 	struct power_supply bat;
-	// FIXME
-	// we will want to keep the battery stats in here as we will be getting
-	// updates from the SVC "on the fly" so we don't have to always go ask
-	// the battery for some information.  Hopefully...
 	struct greybus_module *gmod;
+
+	/*
+	 * The module sends its battery status through the SVC whenever it
+	 * feels like it, so we keep the last one around and answer from it,
+	 * rather than having to go ask the battery for every property.
+	 */
+	spinlock_t lock;
+	u16 charge_full;
+	u16 charge_now;
+	u8 status;			/* enum svc_function_battery_status */
+	unsigned long updated;		/* jiffies of the last status */
+	bool requested;			/* asked for a new one already */
+	unsigned long requested_at;	/* jiffies, when we asked */
+	struct work_struct request_work;
+
+	unsigned long last_changed;
+	struct delayed_work changed_work;
 };
 #define to_gb_battery(x) container_of(x, struct gb_battery, bat)
 
@@ -27,16 +53,76 @@ static const struct greybus_module_id id_table[] = {
 	{ },	/* terminating NULL entry */
 };
 
+/* Going through the SVC is a round trip to the bridge, so not from a read */
+static void battery_request_work(struct work_struct *work)
+{
+	struct gb_battery *gb = container_of(work, struct gb_battery,
+					     request_work);
+	struct greybus_module *gmod = gb->gmod;
+
+	if (gb_svc_battery_status_request(gmod->hd, gmod->module_number)) {
+		spin_lock_irq(&gb->lock);
+		gb->requested = false;
+		spin_unlock_irq(&gb->lock);
+	}
+}
+
+/*
+ * If what we have is too old, ask for a new one, but don't wait for it.  If
+ * the request, or what came back, got lost, ask again after a while.
+ */
+static void check_stale(struct gb_battery *gb)
+{
+	bool request = false;
+
+	spin_lock_irq(&gb->lock);
+	if ((!gb->requested ||
+	     time_after(jiffies, gb->requested_at + GB_BATTERY_REQUEST_TIMEOUT)) &&
+	    (!gb->updated ||
+	     time_after(jiffies, gb->updated + GB_BATTERY_MAX_AGE))) {
+		gb->requested = true;
+		gb->requested_at = jiffies;
+		request = true;
+	}
+	spin_unlock_irq(&gb->lock);
+
+	if (request)
+		schedule_work(&gb->request_work);
+}
+
 static int get_status(struct gb_battery *gb)
 {
-	// FIXME!!!
-	return 0;
+	u8 status;
+
+	spin_lock_irq(&gb->lock);
+	status = gb->status;
+	spin_unlock_irq(&gb->lock);
+
+	switch (status) {
+	case SVC_BATTERY_CHARGING:
+		return POWER_SUPPLY_STATUS_CHARGING;
+	case SVC_BATTERY_DISCHARGING:
+		return POWER_SUPPLY_STATUS_DISCHARGING;
+	case SVC_BATTERY_NOT_CHARGING:
+		return POWER_SUPPLY_STATUS_NOT_CHARGING;
+	case SVC_BATTERY_FULL:
+		return POWER_SUPPLY_STATUS_FULL;
+	case SVC_BATTERY_UNKNOWN:
+	default:
+		return POWER_SUPPLY_STATUS_UNKNOWN;
+	}
 }
 
 static int get_capacity(struct gb_battery *gb)
 {
-	// FIXME!!!
-	return 0;
+	int capacity = 0;
+
+	spin_lock_irq(&gb->lock);
+	if (gb->charge_full)
+		capacity = min(100U, gb->charge_now * 100U / gb->charge_full);
+	spin_unlock_irq(&gb->lock);
+
+	return capacity;
 }
 
 static int get_temp(struct gb_battery *gb)
@@ -57,6 +143,8 @@ static int get_property(struct power_supply *b,
 {
 	struct gb_battery *gb = to_gb_battery(b);
 
+	check_stale(gb);
+
 	switch (psp) {
 	case POWER_SUPPLY_PROP_TECHNOLOGY:
 		// FIXME - guess!
@@ -100,6 +188,72 @@ static enum power_supply_property battery_props[] = {
 	POWER_SUPPLY_PROP_VOLTAGE_NOW,
 };
 
+static void battery_changed_work(struct work_struct *work)
+{
+	struct gb_battery *gb = container_of(work, struct gb_battery,
+					     changed_work.work);
+
+	gb->last_changed = jiffies;
+	power_supply_changed(&gb->bat);
+}
+
+/**
+ * gb_battery_status - a module sent us the state of its battery
+ *
+ * @gmod: the module the status is for
+ * @status: what it sent, straight from the SVC message
+ *
+ * Userspace only hears about it if something actually changed, and then no
+ * more often than every GB_BATTERY_CHANGED_INTERVAL.
+ */
+void gb_battery_status(struct greybus_module *gmod,
+		       struct svc_function_power_battery_status *status)
+{
+	struct gb_battery *gb;
+	u16 charge_full = le16_to_cpu(status->charge_full);
+	u16 charge_now = le16_to_cpu(status->charge_now);
+	unsigned long delay;
+	bool changed;
+
+	/* Removing the module waits for us, and then we don't touch it */
+	mutex_lock(&gmod->battery_lock);
+	if (gmod->removing)
+		goto exit;
+
+	/*
+	 * There is no function class for a battery, so we only find out a
+	 * module has one when it tells us about it.
+	 */
+	gb = gmod->gb_battery;
+	if (!gb) {
+		if (gb_battery_probe(gmod, NULL))
+			goto exit;
+		gb = gmod->gb_battery;
+	}
+
+	spin_lock_irq(&gb->lock);
+	changed = gb->charge_full != charge_full ||
+		  gb->charge_now != charge_now ||
+		  gb->status != status->status;
+	gb->charge_full = charge_full;
+	gb->charge_now = charge_now;
+	gb->status = status->status;
+	gb->updated = jiffies;
+	gb->requested = false;
+	spin_unlock_irq(&gb->lock);
+
+	if (changed) {
+		delay = 0;
+		if (time_before(jiffies,
+				gb->last_changed + GB_BATTERY_CHANGED_INTERVAL))
+			delay = gb->last_changed +
+				GB_BATTERY_CHANGED_INTERVAL - jiffies;
+		schedule_delayed_work(&gb->changed_work, delay);
+	}
+exit:
+	mutex_unlock(&gmod->battery_lock);
+}
+
 int gb_battery_probe(struct greybus_module *gmod,
 		     const struct greybus_module_id *id)
 {
@@ -111,6 +265,13 @@ int gb_battery_probe(struct greybus_module *gmod,
 	if (!gb)
 		return -ENOMEM;
 
+	gb->gmod = gmod;
+	spin_lock_init(&gb->lock);
+	gb->status = SVC_BATTERY_UNKNOWN;
+	gb->last_changed = jiffies - GB_BATTERY_CHANGED_INTERVAL;
+	INIT_DELAYED_WORK(&gb->changed_work, battery_changed_work);
+	INIT_WORK(&gb->request_work, battery_request_work);
+
 	b = &gb->bat;
 	// FIXME - get a better (i.e. unique) name
 	// FIXME - anything else needs to be set?
@@ -135,8 +296,15 @@ void gb_battery_disconnect(struct greybus_module *gmod)
 	struct gb_battery *gb;
 
 	gb = gmod->gb_battery;
+	if (!gb)
+		return;
+
+	gmod->gb_battery = NULL;
 
+	/* Reads can still ask for a status until it's unregistered */
+	cancel_delayed_work_sync(&gb->changed_work);
 	power_supply_unregister(&gb->bat);
+	cancel_work_sync(&gb->request_work);
 
 	kfree(gb);
 }
@@ -0,0 +1,297 @@
+/*
+ * Greybus traffic capture
+ *
+ * Every host device keeps a "flight recorder" of the last messages that went
+ * over its link, so that when something goes wrong there is a record of what
+ * happened right before.  It's cheap enough to leave on all of the time:
+ * recording a message is an atomic increment, a timestamp, and a handful of
+ * stores, with no locks taken.
+ *
+ * The recorder is read out of debugfs, greybus/hd<N>/capture.pcap, as a pcap
+ * file that wireshark and friends can open.  By default only the headers are
+ * recorded, set the capture_payload module parameter to also keep that many
+ * bytes of every message.
+ *
+ * Copyright 2026 The Greybus Authors
+ *
+ * Released under the GPLv2 only.
+ */
+
+#define pr_fmt(fmt) KBUILD_MODNAME ": " fmt
+
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/moduleparam.h>
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
+#include <linux/atomic.h>
+#include <linux/ktime.h>
+#include <linux/log2.h>
+#include <linux/debugfs.h>
+#include <linux/fs.h>
+#include <linux/uaccess.h>
+
+#include "greybus.h"
+
+static unsigned int capture_records = 1024;
+module_param(capture_records, uint, 0444);
+MODULE_PARM_DESC(capture_records, "messages remembered per host device");
+
+static unsigned int capture_payload;
+module_param(capture_payload, uint, 0444);
+MODULE_PARM_DESC(capture_payload, "bytes of each message to record, 0 for headers only");
+
+#define GB_CAPTURE_PAYLOAD_MAX	4096
+
+/*
+ * There is no pcap link type for greybus yet, so use one of the ones set
+ * aside for private use.  Every packet starts with a struct
+ * gb_capture_pcap_header, followed by the payload, if we have it.
+ */
+#define LINKTYPE_USER0		147
+
+struct pcap_file_header {
+	__u32	magic;
+	__u16	version_major;
+	__u16	version_minor;
+	__s32	thiszone;
+	__u32	sigfigs;
+	__u32	snaplen;
+	__u32	linktype;
+};
+
+struct pcap_record_header {
+	__u32	ts_sec;
+	__u32	ts_usec;
+	__u32	incl_len;
+	__u32	orig_len;
+};
+
+#pragma pack(push, 1)
+struct gb_capture_pcap_header {
+	__le16	cport;
+	__u8	direction;	/* GB_CAPTURE_IN or GB_CAPTURE_OUT */
+	__u8	type;		/* GB_CAPTURE_CPORT, _SVC or _DONE */
+	__le32	status;
+	__le32	size;		/* of the whole message */
+};
+#pragma pack(pop)
+
+/*
+ * A slot in the ring.  @seq is 0 while the slot is being written, and the
+ * position in the ring plus one once it is done, so a reader can tell both a
+ * half written record and one that got overwritten while it was looking.
+ */
+struct gb_capture_record {
+	u32 seq;
+	u16 cport;
+	u8 direction;
+	u8 type;
+	u32 size;
+	s32 status;
+	s64 timestamp;
+};
+
+struct gb_capture {
+	atomic_t head;
+	unsigned int nr_records;
+	unsigned int payload_size;
+	struct gb_capture_record *records;
+	u8 *payload;			/* payload_size bytes per record */
+	struct dentry *dentry;
+};
+
+void gb_capture(struct greybus_host_device *hd, u16 cport, u8 direction,
+		u8 type, const void *data, size_t size, int status)
+{
+	struct gb_capture *capture = hd->capture;
+	struct gb_capture_record *record;
+	u32 pos;
+	u32 slot;
+
+	if (!capture)
+		return;
+
+	pos = atomic_inc_return(&capture->head) - 1;
+	slot = pos & (capture->nr_records - 1);
+	record = &capture->records[slot];
+
+	record->seq = 0;
+	smp_wmb();
+
+	record->cport = cport;
+	record->direction = direction;
+	record->type = type;
+	record->size = size;
+	record->status = status;
+	record->timestamp = ktime_to_ns(ktime_get_real());
+	if (capture->payload_size && data)
+		memcpy(&capture->payload[slot * capture->payload_size], data,
+		       min_t(size_t, size, capture->payload_size));
+
+	smp_wmb();
+	record->seq = pos + 1;
+}
+EXPORT_SYMBOL_GPL(gb_capture);
+
+struct capture_snapshot {
+	size_t length;
+	u8 data[0];
+};
+
+/* Copy a record out, returning false if a writer got in the way */
+static bool read_record(struct gb_capture *capture, u32 pos,
+			struct gb_capture_record *record, u8 *payload)
+{
+	struct gb_capture_record *slot;
+	u32 index = pos & (capture->nr_records - 1);
+
+	slot = &capture->records[index];
+	if (ACCESS_ONCE(slot->seq) != pos + 1)
+		return false;
+	smp_rmb();
+
+	*record = *slot;
+	if (capture->payload_size)
+		memcpy(payload, &capture->payload[index * capture->payload_size],
+		       min_t(size_t, record->size, capture->payload_size));
+
+	smp_rmb();
+	return ACCESS_ONCE(slot->seq) == pos + 1;
+}
+
+static int capture_open(struct inode *inode, struct file *file)
+{
+	struct gb_capture *capture = inode->i_private;
+	struct capture_snapshot *snapshot;
+	struct pcap_file_header *file_header;
+	struct pcap_record_header *pcap;
+	struct gb_capture_pcap_header *gb;
+	struct gb_capture_record record;
+	size_t packet_size;
+	size_t payload;
+	u32 head;
+	u32 pos;
+	s32 nsec;
+	u8 *p;
+
+	packet_size = sizeof(*pcap) + sizeof(*gb) + capture->payload_size;
+	snapshot = vmalloc(sizeof(*snapshot) + sizeof(*file_header) +
+			   capture->nr_records * packet_size);
+	if (!snapshot)
+		return -ENOMEM;
+
+	file_header = (struct pcap_file_header *)snapshot->data;
+	file_header->magic = 0xa1b2c3d4;
+	file_header->version_major = 2;
+	file_header->version_minor = 4;
+	file_header->thiszone = 0;
+	file_header->sigfigs = 0;
+	file_header->snaplen = sizeof(*gb) + capture->payload_size;
+	file_header->linktype = LINKTYPE_USER0;
+	p = (u8 *)(file_header + 1);
+
+	/* Oldest first, anything that changes under us is left out */
+	head = atomic_read(&capture->head);
+	pos = head > capture->nr_records ? head - capture->nr_records : 0;
+	for (; pos != head; pos++) {
+		pcap = (struct pcap_record_header *)p;
+		gb = (struct gb_capture_pcap_header *)(pcap + 1);
+
+		if (!read_record(capture, pos, &record, (u8 *)(gb + 1)))
+			continue;
+
+		payload = min_t(size_t, record.size, capture->payload_size);
+		pcap->ts_sec = div_s64_rem(record.timestamp, NSEC_PER_SEC,
+					   &nsec);
+		pcap->ts_usec = nsec / NSEC_PER_USEC;
+		pcap->incl_len = sizeof(*gb) + payload;
+		pcap->orig_len = sizeof(*gb) + record.size;
+		gb->cport = cpu_to_le16(record.cport);
+		gb->direction = record.direction;
+		gb->type = record.type;
+		gb->status = cpu_to_le32(record.status);
+		gb->size = cpu_to_le32(record.size);
+
+		p += sizeof(*pcap) + sizeof(*gb) + payload;
+	}
+	snapshot->length = p - snapshot->data;
+
+	file->private_data = snapshot;
+	return 0;
+}
+
+static ssize_t capture_read(struct file *file, char __user *buf, size_t count,
+			    loff_t *ppos)
+{
+	struct capture_snapshot *snapshot = file->private_data;
+
+	return simple_read_from_buffer(buf, count, ppos, snapshot->data,
+				       snapshot->length);
+}
+
+static int capture_release(struct inode *inode, struct file *file)
+{
+	vfree(file->private_data);
+	return 0;
+}
+
+static const struct file_operations capture_fops = {
+	.owner		= THIS_MODULE,
+	.open		= capture_open,
+	.read		= capture_read,
+	.llseek		= default_llseek,
+	.release	= capture_release,
+};
+
+int gb_capture_init(struct greybus_host_device *hd)
+{
+	struct gb_capture *capture;
+	unsigned int nr_records;
+
+	nr_records = roundup_pow_of_two(clamp(capture_records, 16U, 1U << 20));
+
+	capture = kzalloc(sizeof(*capture), GFP_KERNEL);
+	if (!capture)
+		return -ENOMEM;
+
+	atomic_set(&capture->head, 0);
+	capture->nr_records = nr_records;
+	capture->payload_size = min(capture_payload, GB_CAPTURE_PAYLOAD_MAX);
+
+	capture->records = vzalloc(nr_records * sizeof(*capture->records));
+	if (!capture->records)
+		goto error;
+
+	if (capture->payload_size) {
+		capture->payload = vmalloc(nr_records * capture->payload_size);
+		if (!capture->payload)
+			goto error;
+	}
+
+	capture->dentry = debugfs_create_file("capture.pcap", S_IRUSR,
+					      hd->dentry, capture,
+					      &capture_fops);
+
+	hd->capture = capture;
+	return 0;
+
+error:
+	vfree(capture->records);
+	kfree(capture);
+	return -ENOMEM;
+}
+
+void gb_capture_exit(struct greybus_host_device *hd)
+{
+	struct gb_capture *capture = hd->capture;
+
+	if (!capture)
+		return;
+
+	hd->capture = NULL;
+	debugfs_remove(capture->dentry);
+	vfree(capture->payload);
+	vfree(capture->records);
+	kfree(capture);
+}
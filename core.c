@@ -14,6 +14,11 @@
 #include <linux/kernel.h>
 #include <linux/slab.h>
 #include <linux/device.h>
+#include <linux/idr.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/ktime.h>
+#include <linux/async.h>
 
 #include "greybus.h"
 
@@ -30,44 +35,20 @@ int greybus_disabled(void)
 }
 EXPORT_SYMBOL_GPL(greybus_disabled);
 
-static int greybus_match_one_id(struct greybus_module *gmod,
-				const struct greybus_module_id *id)
+static const struct greybus_module_id *greybus_match_id(
+		struct greybus_module *gmod,
+		struct greybus_driver *driver)
 {
 	struct greybus_descriptor_module_id *module_id;
 	struct greybus_descriptor_serial_number *serial_num;
 
-	module_id = &gmod->module_id;
+	module_id = &gmod->manifest->module_id;
 	serial_num = &gmod->serial_number;
 
-	if ((id->match_flags & GREYBUS_DEVICE_ID_MATCH_VENDOR) &&
-	    (id->vendor != le16_to_cpu(module_id->vendor)))
-		return 0;
-
-	if ((id->match_flags & GREYBUS_DEVICE_ID_MATCH_PRODUCT) &&
-	    (id->product != le16_to_cpu(module_id->product)))
-		return 0;
-
-	if ((id->match_flags & GREYBUS_DEVICE_ID_MATCH_SERIAL) &&
-	    (id->serial_number != le64_to_cpu(serial_num->serial_number)))
-		return 0;
-
-	return 1;
-}
-
-static const struct greybus_module_id *greybus_match_id(
-		struct greybus_module *gmod,
-		const struct greybus_module_id *id)
-{
-	if (id == NULL)
-		return NULL;
-
-	for (; id->vendor || id->product || id->serial_number ||
-	       id->driver_info ; id++) {
-		if (greybus_match_one_id(gmod, id))
-			return id;
-	}
-
-	return NULL;
+	return greybus_id_index_match(driver->id_index,
+				      le16_to_cpu(module_id->vendor),
+				      le16_to_cpu(module_id->product),
+				      le64_to_cpu(serial_num->serial_number));
 }
 
 static int greybus_module_match(struct device *dev, struct device_driver *drv)
@@ -76,7 +57,7 @@ static int greybus_module_match(struct device *dev, struct device_driver *drv)
 	struct greybus_module *gmod = to_greybus_module(dev);
 	const struct greybus_module_id *id;
 
-	id = greybus_match_id(gmod, driver->id_table);
+	id = greybus_match_id(gmod, driver);
 	if (id)
 		return 1;
 	/* FIXME - Dyanmic ids? */
@@ -105,7 +86,7 @@ static int greybus_probe(struct device *dev)
 	int retval;
 
 	/* match id */
-	id = greybus_match_id(gmod, driver->id_table);
+	id = greybus_match_id(gmod, driver);
 	if (!id)
 		return -ENODEV;
 
@@ -139,9 +120,15 @@ int greybus_register_driver(struct greybus_driver *driver, struct module *owner,
 	driver->driver.owner = owner;
 	driver->driver.mod_name = mod_name;
 
+	driver->id_index = greybus_id_index_create(driver->id_table);
+	if (!driver->id_index)
+		return -ENOMEM;
+
 	retval = driver_register(&driver->driver);
-	if (retval)
+	if (retval) {
+		greybus_id_index_destroy(driver->id_index);
 		return retval;
+	}
 
 	pr_info("registered new driver %s\n", driver->name);
 	return 0;
@@ -151,6 +138,7 @@ EXPORT_SYMBOL_GPL(greybus_register_driver);
 void greybus_deregister(struct greybus_driver *driver)
 {
 	driver_unregister(&driver->driver);
+	greybus_id_index_destroy(driver->id_index);
 }
 EXPORT_SYMBOL_GPL(greybus_deregister);
 
@@ -158,29 +146,54 @@ EXPORT_SYMBOL_GPL(greybus_deregister);
 static void greybus_module_release(struct device *dev)
 {
 	struct greybus_module *gmod = to_greybus_module(dev);
-	int i;
 
-	for (i = 0; i < gmod->num_strings; ++i)
-		kfree(gmod->string[i]);
-	for (i = 0; i < gmod->num_cports; ++i)
-		kfree(gmod->cport[i]);
+	gb_manifest_put(gmod->manifest);
 	kfree(gmod);
 }
 
 
-const u8 *greybus_string(struct greybus_module *gmod, int id)
+/**
+ * greybus_string - find a string in a module's manifest
+ *
+ * @gmod: the module
+ * @id: the string id the manifest uses for it
+ * @length: if not NULL, where to put the length of the string
+ *
+ * Returns the string, which is also NUL terminated, or NULL if the module
+ * has no string with that id.
+ */
+const u8 *greybus_string(struct greybus_module *gmod, int id, size_t *length)
 {
-	int i;
 	struct gmod_string *string;
 
-	if (!gmod)
+	if (!gmod || id < 0 || id >= gmod->manifest->num_string_ids)
 		return NULL;
 
-	for (i = 0; i < gmod->num_strings; ++i) {
-		string = gmod->string[i];
-		if (string->id == id)
-			return &string->string[0];
-	}
+	string = gmod->manifest->string_by_id[id];
+	if (!string)
+		return NULL;
+
+	if (length)
+		*length = string->length;
+	return string->string;
+}
+
+/**
+ * greybus_cport - find a cport in a module's manifest
+ *
+ * @gmod: the module
+ * @number: the cport number the manifest uses for it
+ *
+ * Returns the cport, or NULL if the module has no cport with that number.
+ */
+struct gmod_cport *greybus_cport(struct greybus_module *gmod, u16 number)
+{
+	struct gb_manifest *manifest = gmod->manifest;
+	int i;
+
+	for (i = 0; i < manifest->num_cports; ++i)
+		if (manifest->cport[i].number == number)
+			return &manifest->cport[i];
 	return NULL;
 }
 
@@ -189,182 +202,272 @@ static struct device_type greybus_module_type = {
 	.release =	greybus_module_release,
 };
 
-static int gb_init_subdevs(struct greybus_module *gmod,
-			   const struct greybus_module_id *id)
-{
-	int retval;
-
-	/* Allocate all of the different "sub device types" for this device */
-	retval = gb_i2c_probe(gmod, id);
-	if (retval)
-		goto error_i2c;
-
-	retval = gb_gpio_probe(gmod, id);
-	if (retval)
-		goto error_gpio;
-
-	retval = gb_sdio_probe(gmod, id);
-	if (retval)
-		goto error_sdio;
-
-	retval = gb_tty_probe(gmod, id);
-	if (retval)
-		goto error_tty;
-
-	retval = gb_battery_probe(gmod, id);
-	if (retval)
-		goto error_battery;
-	return 0;
-
-error_battery:
-	gb_tty_disconnect(gmod);
+/*
+ * The "sub device types" a module can have, and the function class in its
+ * manifest that says it has one.  A battery isn't a function, a module only
+ * gets one when it first reports its battery status, see battery-gb.c.
+ */
+static const struct gb_subdev {
+	u8 class;
+	enum gb_hotplug_stage stage;	/* done probing */
+	int (*probe)(struct greybus_module *gmod,
+		     const struct greybus_module_id *id);
+	void (*disconnect)(struct greybus_module *gmod);
+	/* Optional, to stop submitting while the module is suspended */
+	int (*suspend)(struct greybus_module *gmod);
+	void (*resume)(struct greybus_module *gmod);
+} gb_subdevs[] = {
+	{ GREYBUS_FUNCTION_I2C,	GB_HOTPLUG_I2C,
+	  gb_i2c_probe,		gb_i2c_disconnect,
+	  gb_i2c_suspend,	gb_i2c_resume },
+	{ GREYBUS_FUNCTION_GPIO, GB_HOTPLUG_GPIO,
+	  gb_gpio_probe,	gb_gpio_disconnect },
+	{ GREYBUS_FUNCTION_SDIO, GB_HOTPLUG_SDIO,
+	  gb_sdio_probe,	gb_sdio_disconnect },
+	{ GREYBUS_FUNCTION_UART, GB_HOTPLUG_UART,
+	  gb_tty_probe,		gb_tty_disconnect,
+	  gb_tty_suspend,	gb_tty_resume },
+};
 
-error_tty:
-	gb_sdio_disconnect(gmod);
+/*
+ * Every module id keeps the timing of the last time it was plugged in, in
+ * hd->hotplug_timing.  Hotplug messages for a module id are handled one at
+ * a time, on its own lane, so nothing else writes to it at the same time.
+ */
+static void gb_hotplug_stage(struct greybus_host_device *hd, u8 module_id,
+			     enum gb_hotplug_stage stage)
+{
+	if (hd->hotplug_timing)
+		hd->hotplug_timing[module_id].stage_ns[stage] =
+			ktime_to_ns(ktime_get());
+}
 
-error_sdio:
-	gb_gpio_disconnect(gmod);
+/* A hotplug message for @module_id, that came in at @received, is up next */
+void gb_hotplug_start(struct greybus_host_device *hd, u8 module_id,
+		      ktime_t received)
+{
+	struct gb_hotplug_timing *timing;
 
-error_gpio:
-	gb_i2c_disconnect(gmod);
+	if (!hd->hotplug_timing)
+		return;
 
-error_i2c:
-	return retval;
+	timing = &hd->hotplug_timing[module_id];
+	memset(timing, 0, sizeof(*timing));
+	timing->stage_ns[GB_HOTPLUG_RECEIVED] = ktime_to_ns(received);
+	gb_hotplug_stage(hd, module_id, GB_HOTPLUG_PROCESSED);
 }
 
-static const struct greybus_module_id fake_gb_id = {
-	GREYBUS_DEVICE(0x42, 0x42)
-};
-
-static int create_function(struct greybus_module *gmod,
-			   struct greybus_descriptor_function *function,
-			   size_t desc_size)
+static void gb_latency_add(struct greybus_host_device *hd,
+			   struct gb_latency *latency, s64 ns)
 {
-	if (desc_size != sizeof(*function)) {
-		dev_err(gmod->dev.parent, "invalid function header size %zu\n",
-			desc_size);
-		return -EINVAL;
-	}
-	memcpy(&gmod->function, function, desc_size);
-	return 0;
+	u64 us = div_s64(ns, NSEC_PER_USEC);
+	int bucket = us ? fls64(us) : 0;
+	unsigned long flags;
+
+	bucket = min(bucket, GB_LATENCY_BUCKETS - 1);
+
+	spin_lock_irqsave(&hd->latency_lock, flags);
+	latency->count++;
+	latency->total_ns += ns;
+	latency->max_ns = max(latency->max_ns, ns);
+	latency->buckets[bucket]++;
+	spin_unlock_irqrestore(&hd->latency_lock, flags);
 }
 
-static int create_module_id(struct greybus_module *gmod,
-			    struct greybus_descriptor_module_id *module_id,
-			    size_t desc_size)
+
+void gb_latency_get(struct greybus_host_device *hd, struct gb_latency *plug,
+		    struct gb_latency *unplug)
 {
-	if (desc_size != sizeof(*module_id)) {
-		dev_err(gmod->dev.parent, "invalid module header size %zu\n",
-			desc_size);
-		return -EINVAL;
-	}
-	memcpy(&gmod->module_id, module_id, desc_size);
-	return 0;
+	unsigned long flags;
+
+	spin_lock_irqsave(&hd->latency_lock, flags);
+	*plug = hd->plug_latency;
+	*unplug = hd->unplug_latency;
+	spin_unlock_irqrestore(&hd->latency_lock, flags);
 }
+EXPORT_SYMBOL_GPL(gb_latency_get);
 
-static int create_serial_number(struct greybus_module *gmod,
-			        struct greybus_descriptor_serial_number *serial_num,
-			        size_t desc_size)
+/*
+ * What was added to @latency since @before was taken from it, so somebody
+ * measuring a stretch of time doesn't have to throw away what the host has
+ * gathered so far.  The largest latency of the stretch isn't kept apart, so
+ * if it didn't raise the overall one it's only known up to its bucket.
+ */
+void gb_latency_sub(struct gb_latency *latency,
+		    const struct gb_latency *before)
 {
-	if (desc_size != sizeof(*serial_num)) {
-		dev_err(gmod->dev.parent, "invalid serial number header size %zu\n",
-			desc_size);
-		return -EINVAL;
+	int top = -1;
+	int i;
+
+	latency->count -= before->count;
+	latency->total_ns -= before->total_ns;
+	for (i = 0; i < GB_LATENCY_BUCKETS; ++i) {
+		latency->buckets[i] -= before->buckets[i];
+		if (latency->buckets[i])
+			top = i;
 	}
-	memcpy(&gmod->serial_number, serial_num, desc_size);
-	return 0;
+
+	if (top < 0)
+		latency->max_ns = 0;
+	else if (latency->max_ns <= before->max_ns)
+		latency->max_ns = min_t(s64, latency->max_ns,
+					(1ULL << top) * NSEC_PER_USEC);
 }
+EXPORT_SYMBOL_GPL(gb_latency_sub);
 
-static int create_string(struct greybus_module *gmod,
-			 struct greybus_descriptor_string *string,
-			 size_t desc_size)
+/* The bucket @percent of the latencies fall in, as its upper bound in us */
+static u64 gb_latency_percentile(const struct gb_latency *latency,
+				 unsigned int percent)
 {
-	int string_size;
-	struct gmod_string *gmod_string;
+	unsigned long wanted = DIV_ROUND_UP(latency->count * percent, 100);
+	unsigned long seen = 0;
+	int i;
 
-	if (gmod->num_strings == MAX_STRINGS_PER_MODULE) {
-		dev_err(gmod->dev.parent,
-			"too many strings for this module!\n");
-		return -EINVAL;
+	for (i = 0; i < GB_LATENCY_BUCKETS; ++i) {
+		seen += latency->buckets[i];
+		if (seen >= wanted)
+			break;
 	}
+	return min_t(u64, 1ULL << i, div_s64(latency->max_ns, NSEC_PER_USEC));
+}
 
-	if (desc_size < sizeof(*string)) {
-		dev_err(gmod->dev.parent, "invalid string header size %zu\n",
-			desc_size);
-		return -EINVAL;
+void gb_latency_show(struct seq_file *s, const char *name,
+		     const struct gb_latency *latency)
+{
+	if (!latency->count) {
+		seq_printf(s, "%s: none\n", name);
+		return;
 	}
 
-	string_size = le16_to_cpu(string->length);
-	gmod_string = kzalloc(sizeof(*gmod_string) + string_size + 1, GFP_KERNEL);
-	if (!gmod_string)
-		return -ENOMEM;
-
-	gmod_string->length = string_size;
-	gmod_string->id = string->id;
-	memcpy(&gmod_string->string, &string->string, string_size);
+	seq_printf(s, "%s: count %lu avg_us %lld p50_us %llu p90_us %llu p99_us %llu max_us %lld\n",
+		   name, latency->count,
+		   div_s64(div64_u64(latency->total_ns, latency->count),
+			   NSEC_PER_USEC),
+		   gb_latency_percentile(latency, 50),
+		   gb_latency_percentile(latency, 90),
+		   gb_latency_percentile(latency, 99),
+		   div_s64(latency->max_ns, NSEC_PER_USEC));
+}
+EXPORT_SYMBOL_GPL(gb_latency_show);
 
-	gmod->string[gmod->num_strings] = gmod_string;
-	gmod->num_strings++;
+/*
+ * Nothing more comes in for the module, and everything it had in flight is
+ * cancelled, so its sub devices can go away.
+ */
+static void gb_module_stop(struct greybus_module *gmod)
+{
+	gb_deregister_cport_handlers(gmod);
+	if (greybus_kill_gbufs(gmod, HZ))
+		dev_err(gmod->hd->parent, "module %d gbufs still busy\n",
+			gmod->module_number);
 
-	return 0;
+	/* Its drivers can't go away while their callbacks are still queued */
+	gb_gbuf_flush();
 }
 
-static int create_cport(struct greybus_module *gmod,
-			struct greybus_descriptor_cport *cport,
-			size_t desc_size)
+static int gb_init_subdevs(struct greybus_module *gmod,
+			   const struct greybus_module_id *id)
 {
-	struct gmod_cport *gmod_cport;
+	u32 classes = gmod->manifest->function_classes;
+	int retval;
+	int i;
 
-	if (gmod->num_cports == MAX_CPORTS_PER_MODULE) {
-		dev_err(gmod->dev.parent, "too many cports for this module!\n");
-		return -EINVAL;
-	}
+	/* Only create what the manifest says the module really has */
+	for (i = 0; i < ARRAY_SIZE(gb_subdevs); ++i) {
+		if (!(classes & BIT(gb_subdevs[i].class)))
+			continue;
 
-	if (desc_size != sizeof(*cport)) {
-		dev_err(gmod->dev.parent,
-			"invalid serial number header size %zu\n", desc_size);
-		return -EINVAL;
+		retval = gb_subdevs[i].probe(gmod, id);
+		if (retval)
+			goto error;
+		gb_hotplug_stage(gmod->hd, gmod->module_number,
+				 gb_subdevs[i].stage);
 	}
+	return 0;
 
-	gmod_cport = kzalloc(sizeof(*gmod_cport), GFP_KERNEL);
-	if (!gmod_cport)
-		return -ENOMEM;
+error:
+	/* Taken down the same way gb_remove_module() does it */
+	gb_module_stop(gmod);
+	while (--i >= 0)
+		if (classes & BIT(gb_subdevs[i].class))
+			gb_subdevs[i].disconnect(gmod);
+	return retval;
+}
 
-	gmod_cport->number = le16_to_cpu(cport->number);
-	gmod_cport->size = le16_to_cpu(cport->size);
-	gmod_cport->speed = cport->speed;
+static const struct greybus_module_id fake_gb_id = {
+	GREYBUS_DEVICE(0x42, 0x42)
+};
 
-	gmod->cport[gmod->num_cports] = gmod_cport;
-	gmod->num_cports++;
+/**
+ * gb_module_find - find a module plugged into a host device
+ *
+ * @hd: host device the module is on
+ * @module_id: the id the SVC gave the module
+ *
+ * Returns the module with a reference held, call put_device() on it when
+ * done, or NULL if there is no such module.
+ */
+struct greybus_module *gb_module_find(struct greybus_host_device *hd,
+				      u8 module_id)
+{
+	struct greybus_module *gmod;
 
-	return 0;
+	mutex_lock(&hd->modules_lock);
+	gmod = idr_find(&hd->modules, module_id);
+	if (gmod)
+		get_device(&gmod->dev);
+	mutex_unlock(&hd->modules_lock);
+	return gmod;
 }
 
 /**
  * gb_add_module
  *
- * Pass in a buffer that _should_ contain a Greybus module manifest
- * and register a greybus device structure with the kernel core.
+ * Pass in what the module's manifest says, from gb_manifest_get(), and its
+ * serial number, and register a greybus device structure with the kernel
+ * core.  The module takes over the reference to @manifest.
  */
 void gb_add_module(struct greybus_host_device *hd, u8 module_id,
-		   u8 *data, int size)
+		   struct gb_manifest *manifest,
+		   struct greybus_descriptor_serial_number *serial_number)
 {
 	struct greybus_module *gmod;
-	struct greybus_manifest *manifest;
+	struct gb_hotplug_timing *timing;
 	int retval;
-	int overall_size;
-	u8 version_major;
-	u8 version_minor;
 
-	/* we have to have at _least_ the manifest header */
-	if (size <= sizeof(manifest->header))
+	/* The caller has looked the manifest up by now */
+	gb_hotplug_stage(hd, module_id, GB_HOTPLUG_MANIFEST);
+
+	/*
+	 * Hold on to the module id before doing anything else, so that a
+	 * second hotplug for it fails right away instead of probing another
+	 * set of sub devices.  Nobody finds the module until it's all set up.
+	 */
+	mutex_lock(&hd->modules_lock);
+	retval = idr_alloc(&hd->modules, NULL, module_id, module_id + 1,
+			   GFP_KERNEL);
+	mutex_unlock(&hd->modules_lock);
+	if (retval < 0) {
+		dev_err(hd->parent, "can't add module %d (%d)\n", module_id,
+			retval);
+		gb_manifest_put(manifest);
 		return;
+	}
 
 	gmod = kzalloc(sizeof(*gmod), GFP_KERNEL);
-	if (!gmod)
-		return;
+	if (!gmod) {
+		gb_manifest_put(manifest);
+		goto error_id;
+	}
 
+	gmod->manifest = manifest;
+	gmod->serial_number = *serial_number;
 	gmod->module_number = module_id;
+	gmod->hd = hd;
+	spin_lock_init(&gmod->gbufs_lock);
+	INIT_LIST_HEAD(&gmod->gbufs);
+	init_waitqueue_head(&gmod->gbufs_wait);
+	mutex_init(&gmod->battery_lock);
 	gmod->dev.parent = hd->parent;
 	gmod->dev.driver = NULL;
 	gmod->dev.bus = &greybus_bus_type;
@@ -374,116 +477,477 @@ void gb_add_module(struct greybus_host_device *hd, u8 module_id,
 	device_initialize(&gmod->dev);
 	dev_set_name(&gmod->dev, "%d", module_id);
 
-	manifest = (struct greybus_manifest *)data;
-	overall_size = le16_to_cpu(manifest->header.size);
-	if (overall_size != size) {
-		dev_err(hd->parent, "size != manifest header size, %d != %d\n",
-			size, overall_size);
+	retval = gb_init_subdevs(gmod, &fake_gb_id);
+	if (retval)
 		goto error;
+
+	// FIXME device_add(&gmod->dev);
+
+	mutex_lock(&hd->modules_lock);
+	idr_replace(&hd->modules, gmod, module_id);
+	mutex_unlock(&hd->modules_lock);
+
+	gb_hotplug_stage(hd, module_id, GB_HOTPLUG_READY);
+	if (hd->hotplug_timing) {
+		timing = &hd->hotplug_timing[module_id];
+		gb_latency_add(hd, &hd->plug_latency,
+			       timing->stage_ns[GB_HOTPLUG_READY] -
+			       timing->stage_ns[GB_HOTPLUG_RECEIVED]);
 	}
 
-	version_major = manifest->header.version_major;
-	version_minor = manifest->header.version_minor;
+	//return gmod;
+	return;
+error:
+	/* This frees the module, through greybus_module_release() */
+	put_device(&gmod->dev);
+error_id:
+	mutex_lock(&hd->modules_lock);
+	idr_remove(&hd->modules, module_id);
+	mutex_unlock(&hd->modules_lock);
+}
 
-	/* Validate major/minor number */
-	if ((version_major != GREYBUS_VERSION_MAJOR) ||
-	    (version_minor != GREYBUS_VERSION_MINOR)) {
-		dev_err(hd->parent,
-			"Invalid greybus versions, expected %d.%d, got %d.%d\n",
-			GREYBUS_VERSION_MAJOR, GREYBUS_VERSION_MINOR,
-			version_major, version_minor);
-		goto error;
+struct gb_subdev_remove {
+	struct greybus_module *gmod;
+	void (*disconnect)(struct greybus_module *gmod);
+};
+
+static void gb_subdev_remove(void *data, async_cookie_t cookie)
+{
+	struct gb_subdev_remove *remove = data;
+
+	remove->disconnect(remove->gmod);
+}
+
+void greybus_remove_device(struct greybus_module *gmod)
+{
+	struct gb_subdev_remove remove[ARRAY_SIZE(gb_subdevs) + 1];
+	u32 classes = gmod->manifest->function_classes;
+	ASYNC_DOMAIN_EXCLUSIVE(domain);
+	int count = 0;
+	int i;
+
+	/* A power message can't give it a battery once that's torn down */
+	mutex_lock(&gmod->battery_lock);
+	gmod->removing = true;
+	mutex_unlock(&gmod->battery_lock);
+
+	/*
+	 * The "sub device types" have nothing to do with each other, so tear
+	 * them all down at the same time, a slow one (like the tty waiting
+	 * for its users to go away) doesn't hold up the rest.
+	 */
+	for (i = 0; i < ARRAY_SIZE(gb_subdevs); ++i) {
+		if (!(classes & BIT(gb_subdevs[i].class)))
+			continue;
+		remove[count].gmod = gmod;
+		remove[count].disconnect = gb_subdevs[i].disconnect;
+		count++;
 	}
+	remove[count].gmod = gmod;
+	remove[count].disconnect = gb_battery_disconnect;
+	count++;
 
-	size -= sizeof(manifest->header);
-	data += sizeof(manifest->header);
-	while (size > 0) {
-		struct greybus_descriptor *desc;
-		u16 desc_size;
-		size_t data_size;
+	for (i = 0; i < count; ++i)
+		async_schedule_domain(gb_subdev_remove, &remove[i], &domain);
+	async_synchronize_full_domain(&domain);
 
-		if (size < sizeof(desc->header)) {
-			dev_err(hd->parent, "remaining size %d too small\n",
-				size);
-			goto error;
-		}
-		desc = (struct greybus_descriptor *)data;
-		desc_size = le16_to_cpu(desc->header.size);
-		if (size < desc_size) {
-			dev_err(hd->parent, "descriptor size %d too big\n",
-				desc_size);
-			goto error;
-		}
-		data_size = (size_t)desc_size - sizeof(desc->header);
+	// FIXME - device_remove(&gmod->dev);
+}
 
-		switch (le16_to_cpu(desc->header.type)) {
-		case GREYBUS_TYPE_FUNCTION:
-			retval = create_function(gmod, &desc->function,
-						 data_size);
-			break;
+/**
+ * gb_remove_module - get rid of a module that was unplugged
+ *
+ * @hd: host device the module was on
+ * @module_id: the id the SVC gave the module
+ *
+ * Nothing more comes in for the module from here on, and everything it had
+ * in flight is cancelled before its sub devices go away.
+ */
+void gb_remove_module(struct greybus_host_device *hd, u8 module_id)
+{
+	struct greybus_module *gmod;
+	ktime_t start = ktime_get();
+
+	mutex_lock(&hd->modules_lock);
+	gmod = idr_find(&hd->modules, module_id);
+	if (gmod)
+		idr_remove(&hd->modules, module_id);
+	mutex_unlock(&hd->modules_lock);
+	if (!gmod) {
+		dev_err(hd->parent, "removing unknown module %d\n", module_id);
+		return;
+	}
 
-		case GREYBUS_TYPE_MODULE_ID:
-			retval = create_module_id(gmod, &desc->module_id,
-						  data_size);
-			break;
+	gb_module_stop(gmod);
+	greybus_remove_device(gmod);
 
-		case GREYBUS_TYPE_SERIAL_NUMBER:
-			retval = create_serial_number(gmod,
-						      &desc->serial_number,
-						      data_size);
-			break;
+	/* Whatever gbufs are left still hold a reference to the module */
+	put_device(&gmod->dev);
 
-		case GREYBUS_TYPE_STRING:
-			retval = create_string(gmod, &desc->string, data_size);
-			break;
+	gb_latency_add(hd, &hd->unplug_latency,
+		       ktime_to_ns(ktime_sub(ktime_get(), start)));
+}
 
-		case GREYBUS_TYPE_CPORT:
-			retval = create_cport(gmod, &desc->cport, data_size);
-			break;
+/* How long a module gets to finish what it has in flight when suspending */
+static unsigned int suspend_drain_ms = 20;
+module_param(suspend_drain_ms, uint, 0644);
+MODULE_PARM_DESC(suspend_drain_ms,
+		 "ms to let gbufs complete before suspend cancels them");
 
-		case GREYBUS_TYPE_INVALID:
-		default:
-			dev_err(hd->parent, "invalid descriptor type %d\n",
-				desc->header.type);
-			goto error;
+static void gb_subdevs_resume(struct greybus_module *gmod, int count)
+{
+	u32 classes = gmod->manifest->function_classes;
+	int i;
+
+	for (i = 0; i < count; ++i)
+		if (classes & BIT(gb_subdevs[i].class) && gb_subdevs[i].resume)
+			gb_subdevs[i].resume(gmod);
+}
+
+/* Tell the sub devices to hold on to what they would send from here on */
+static int gb_subdevs_suspend(struct greybus_module *gmod)
+{
+	u32 classes = gmod->manifest->function_classes;
+	int retval;
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(gb_subdevs); ++i) {
+		if (!(classes & BIT(gb_subdevs[i].class)) ||
+		    !gb_subdevs[i].suspend)
+			continue;
+		retval = gb_subdevs[i].suspend(gmod);
+		if (retval) {
+			gb_subdevs_resume(gmod, i);
+			return retval;
 		}
-		if (retval)
-			goto error;
-		size -= desc_size;
-		data += desc_size;
 	}
+	return 0;
+}
 
-	retval = gb_init_subdevs(gmod, &fake_gb_id);
-	if (retval)
-		goto error;
+/*
+ * Suspending a module stops anything new from being submitted for it, and
+ * tells its sub devices to hold on to what they would send until it is
+ * resumed, then gives what it already has in flight suspend_drain_ms to
+ * finish before cancelling the rest.  Its cport handlers, manifest and sub
+ * devices all stay as they are, so resuming is just letting it submit
+ * again, and the sub devices send what they held on to, nothing has to be
+ * enumerated.
+ *
+ * Modules are never device_add()ed, so no greybus driver is ever bound to
+ * one and the PM core doesn't know about them; the host driver suspends
+ * and resumes them through greybus_suspend_hd() and greybus_resume_hd().
+ */
+static int gb_module_suspend(struct greybus_module *gmod)
+{
+	struct greybus_host_device *hd = gmod->hd;
+	ktime_t start = ktime_get();
+	unsigned long flags;
+	int retval;
 
-	// FIXME device_add(&gmod->dev);
+	/* greybus_submit_gbuf() looks at suspended under the same lock */
+	spin_lock_irqsave(&gmod->gbufs_lock, flags);
+	if (gmod->suspended) {
+		spin_unlock_irqrestore(&gmod->gbufs_lock, flags);
+		return 0;
+	}
+	gmod->suspended = true;
+	spin_unlock_irqrestore(&gmod->gbufs_lock, flags);
 
-	//return gmod;
-	return;
-error:
-	put_device(&gmod->dev);
-	greybus_module_release(&gmod->dev);
+	retval = gb_subdevs_suspend(gmod);
+	if (retval) {
+		spin_lock_irqsave(&gmod->gbufs_lock, flags);
+		gmod->suspended = false;
+		spin_unlock_irqrestore(&gmod->gbufs_lock, flags);
+		return retval;
+	}
+
+	if (!wait_event_timeout(gmod->gbufs_wait, list_empty(&gmod->gbufs),
+				msecs_to_jiffies(suspend_drain_ms)) &&
+	    greybus_kill_gbufs(gmod, HZ)) {
+		dev_err(hd->parent, "module %d gbufs still busy, not suspending\n",
+			gmod->module_number);
+		spin_lock_irqsave(&gmod->gbufs_lock, flags);
+		gmod->suspended = false;
+		spin_unlock_irqrestore(&gmod->gbufs_lock, flags);
+		gb_subdevs_resume(gmod, ARRAY_SIZE(gb_subdevs));
+		return -EBUSY;
+	}
+
+	gmod->suspend_ns = ktime_to_ns(ktime_sub(ktime_get(), start));
+	gb_latency_add(hd, &hd->suspend_latency, gmod->suspend_ns);
+	return 0;
 }
 
-void gb_remove_module(struct greybus_host_device *hd, u8 module_id)
+static int gb_module_resume(struct greybus_module *gmod)
+{
+	struct greybus_host_device *hd = gmod->hd;
+	ktime_t start = ktime_get();
+	unsigned long flags;
+
+	spin_lock_irqsave(&gmod->gbufs_lock, flags);
+	if (!gmod->suspended) {
+		spin_unlock_irqrestore(&gmod->gbufs_lock, flags);
+		return 0;
+	}
+	gmod->suspended = false;
+	spin_unlock_irqrestore(&gmod->gbufs_lock, flags);
+
+	gb_subdevs_resume(gmod, ARRAY_SIZE(gb_subdevs));
+
+	gmod->resume_ns = ktime_to_ns(ktime_sub(ktime_get(), start));
+	gb_latency_add(hd, &hd->resume_latency, gmod->resume_ns);
+	return 0;
+}
+
+static void gb_module_suspend_async(void *data, async_cookie_t cookie)
 {
-	// FIXME should be the remove_device call...
+	struct greybus_module *gmod = data;
+
+	gmod->pm_status = gb_module_suspend(gmod);
 }
 
-void greybus_remove_device(struct greybus_module *gmod)
+static void gb_module_resume_async(void *data, async_cookie_t cookie)
 {
-	/* tear down all of the "sub device types" for this device */
-	gb_i2c_disconnect(gmod);
-	gb_gpio_disconnect(gmod);
-	gb_sdio_disconnect(gmod);
-	gb_tty_disconnect(gmod);
-	gb_battery_disconnect(gmod);
+	struct greybus_module *gmod = data;
 
-	// FIXME - device_remove(&gmod->dev);
+	gmod->pm_status = gb_module_resume(gmod);
 }
 
+/*
+ * Modules have nothing to do with each other, so they are all suspended,
+ * or resumed, at the same time, and it takes as long as the slowest one.
+ * Returns the first error a module had, if any.
+ */
+static int gb_modules_pm(struct greybus_host_device *hd, async_func_t func)
+{
+	struct greybus_module **gmods;
+	struct greybus_module *gmod;
+	ASYNC_DOMAIN_EXCLUSIVE(domain);
+	int retval = 0;
+	int count = 0;
+	int id = 0;
+	int i;
+
+	/* Module ids are a u8, so that's as many as there can be */
+	gmods = kcalloc(U8_MAX + 1, sizeof(*gmods), GFP_KERNEL);
+	if (!gmods)
+		return -ENOMEM;
+
+	mutex_lock(&hd->modules_lock);
+	idr_for_each_entry(&hd->modules, gmod, id) {
+		get_device(&gmod->dev);
+		gmods[count++] = gmod;
+	}
+	mutex_unlock(&hd->modules_lock);
+
+	for (i = 0; i < count; ++i)
+		async_schedule_domain(func, gmods[i], &domain);
+	async_synchronize_full_domain(&domain);
+
+	for (i = 0; i < count; ++i) {
+		if (gmods[i]->pm_status && !retval)
+			retval = gmods[i]->pm_status;
+		put_device(&gmods[i]->dev);
+	}
+	kfree(gmods);
+	return retval;
+}
+
+/**
+ * greybus_suspend_hd - suspend every module on a host device
+ *
+ * @hd: the host device
+ *
+ * The host controller driver calls this from its own suspend, once no more
+ * hotplug messages can come in, and before it stops taking in cport data.
+ * If a module can't be suspended, the ones that were are resumed again.
+ */
+int greybus_suspend_hd(struct greybus_host_device *hd)
+{
+	ktime_t start = ktime_get();
+	int retval;
+
+	retval = gb_modules_pm(hd, gb_module_suspend_async);
+	if (retval) {
+		gb_modules_pm(hd, gb_module_resume_async);
+		return retval;
+	}
+
+	hd->suspend_ns = ktime_to_ns(ktime_sub(ktime_get(), start));
+	return 0;
+}
+EXPORT_SYMBOL_GPL(greybus_suspend_hd);
+
+/**
+ * greybus_resume_hd - resume every module on a host device
+ *
+ * @hd: the host device
+ *
+ * The host controller driver calls this from its own resume, once it takes
+ * in cport data again.
+ */
+int greybus_resume_hd(struct greybus_host_device *hd)
+{
+	ktime_t start = ktime_get();
+	int retval;
+
+	retval = gb_modules_pm(hd, gb_module_resume_async);
+	hd->resume_ns = ktime_to_ns(ktime_sub(ktime_get(), start));
+	return retval;
+}
+EXPORT_SYMBOL_GPL(greybus_resume_hd);
+
 static DEFINE_MUTEX(hd_mutex);
+static DEFINE_IDA(hd_ida);
+
+/*
+ * ready_us is the time from when the host device showed up until the last
+ * module that was hotplugged was done being added, so right after boot it's
+ * how long it took to bring up every module in the frame.  Hotplug times are
+ * from the hotplug message coming in until the module is ready, unplug times
+ * from when the core starts getting rid of a module until it is gone.
+ */
+static int enumeration_show(struct seq_file *s, void *unused)
+{
+	struct greybus_host_device *hd = s->private;
+	struct gb_latency plug;
+	struct gb_latency unplug;
+
+	seq_printf(s, "pending: %d\n", atomic_read(&hd->hotplugs_pending));
+	seq_printf(s, "ready_us: %lld\n", div_s64(hd->ready_ns, NSEC_PER_USEC));
+	gb_latency_get(hd, &plug, &unplug);
+	gb_latency_show(s, "hotplug", &plug);
+	gb_latency_show(s, "unplug", &unplug);
+	return 0;
+}
+
+static int enumeration_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, enumeration_show, inode->i_private);
+}
+
+static const struct file_operations enumeration_fops = {
+	.open		= enumeration_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
+static const char * const hotplug_stage_names[] = {
+	[GB_HOTPLUG_RECEIVED]	= "received",
+	[GB_HOTPLUG_PROCESSED]	= "processed",
+	[GB_HOTPLUG_MANIFEST]	= "manifest",
+	[GB_HOTPLUG_I2C]	= "i2c",
+	[GB_HOTPLUG_GPIO]	= "gpio",
+	[GB_HOTPLUG_SDIO]	= "sdio",
+	[GB_HOTPLUG_UART]	= "uart",
+	[GB_HOTPLUG_READY]	= "ready",
+};
+
+/*
+ * The last hotplug of every module id, one line each, with how far into
+ * it, in us from the message coming in, every stage was done.  A stage the
+ * module didn't go through is a "-", one that it didn't make it past is
+ * where the line stops making sense.
+ */
+static int hotplug_show(struct seq_file *s, void *unused)
+{
+	struct greybus_host_device *hd = s->private;
+	struct gb_hotplug_timing *timing;
+	s64 received;
+	int module_id;
+	int stage;
+
+	BUILD_BUG_ON(ARRAY_SIZE(hotplug_stage_names) != GB_HOTPLUG_STAGES);
+
+	if (!hd->hotplug_timing)
+		return 0;
+
+	seq_puts(s, "module");
+	for (stage = GB_HOTPLUG_PROCESSED; stage < GB_HOTPLUG_STAGES; ++stage)
+		seq_printf(s, " %9s", hotplug_stage_names[stage]);
+	seq_putc(s, '\n');
+
+	for (module_id = 0; module_id <= U8_MAX; ++module_id) {
+		timing = &hd->hotplug_timing[module_id];
+		received = timing->stage_ns[GB_HOTPLUG_RECEIVED];
+		if (!received)
+			continue;
+
+		seq_printf(s, "%6d", module_id);
+		for (stage = GB_HOTPLUG_PROCESSED; stage < GB_HOTPLUG_STAGES;
+		     ++stage) {
+			if (timing->stage_ns[stage])
+				seq_printf(s, " %9lld",
+					   div_s64(timing->stage_ns[stage] -
+						   received, NSEC_PER_USEC));
+			else
+				seq_printf(s, " %9s", "-");
+		}
+		seq_putc(s, '\n');
+	}
+	return 0;
+}
+
+static int hotplug_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, hotplug_show, inode->i_private);
+}
+
+static const struct file_operations hotplug_fops = {
+	.open		= hotplug_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
+/*
+ * How long the last suspend and resume of the host device took, all its
+ * modules together, then how long modules take on their own, and the last
+ * time for every module that is plugged in right now.
+ */
+static int pm_show(struct seq_file *s, void *unused)
+{
+	struct greybus_host_device *hd = s->private;
+	struct greybus_module *gmod;
+	struct gb_latency suspend;
+	struct gb_latency resume;
+	unsigned long flags;
+	int id;
+
+	seq_printf(s, "suspend_us: %lld\n",
+		   div_s64(hd->suspend_ns, NSEC_PER_USEC));
+	seq_printf(s, "resume_us: %lld\n",
+		   div_s64(hd->resume_ns, NSEC_PER_USEC));
+
+	spin_lock_irqsave(&hd->latency_lock, flags);
+	suspend = hd->suspend_latency;
+	resume = hd->resume_latency;
+	spin_unlock_irqrestore(&hd->latency_lock, flags);
+	gb_latency_show(s, "module suspend", &suspend);
+	gb_latency_show(s, "module resume", &resume);
+
+	seq_puts(s, "module suspended suspend_us resume_us\n");
+	mutex_lock(&hd->modules_lock);
+	idr_for_each_entry(&hd->modules, gmod, id)
+		seq_printf(s, "%6d %9d %10lld %9lld\n", id, gmod->suspended,
+			   div_s64(gmod->suspend_ns, NSEC_PER_USEC),
+			   div_s64(gmod->resume_ns, NSEC_PER_USEC));
+	mutex_unlock(&hd->modules_lock);
+	return 0;
+}
+
+static int pm_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, pm_show, inode->i_private);
+}
+
+static const struct file_operations pm_fops = {
+	.open		= pm_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
 
 static void free_hd(struct kref *kref)
 {
@@ -491,21 +955,66 @@ static void free_hd(struct kref *kref)
 
 	hd = container_of(kref, struct greybus_host_device, kref);
 
+	gb_capture_exit(hd);
+	gb_cport_handlers_exit(hd);
+	idr_destroy(&hd->modules);
+	debugfs_remove_recursive(hd->dentry);
+	kfree(hd->hotplug_timing);
+	ida_simple_remove(&hd_ida, hd->id);
 	kfree(hd);
+
+	mutex_unlock(&hd_mutex);
 }
 
 struct greybus_host_device *greybus_create_hd(struct greybus_host_driver *driver,
-					      struct device *parent)
+					      struct device *parent,
+					      size_t buffer_size_max)
 {
 	struct greybus_host_device *hd;
+	char name[16];
 
 	hd = kzalloc(sizeof(*hd) + driver->hd_priv_size, GFP_KERNEL);
 	if (!hd)
 		return NULL;
 
+	hd->id = ida_simple_get(&hd_ida, 0, 0, GFP_KERNEL);
+	if (hd->id < 0) {
+		kfree(hd);
+		return NULL;
+	}
+
 	kref_init(&hd->kref);
 	hd->parent = parent;
 	hd->driver = driver;
+	hd->buffer_size_max = buffer_size_max;
+	hd->created = ktime_get();
+	atomic_set(&hd->hotplugs_pending, 0);
+	idr_init(&hd->modules);
+	mutex_init(&hd->modules_lock);
+	spin_lock_init(&hd->latency_lock);
+
+	/* Module ids are a u8, so that's all the timings we'll ever need */
+	hd->hotplug_timing = kcalloc(U8_MAX + 1, sizeof(*hd->hotplug_timing),
+				     GFP_KERNEL);
+
+	snprintf(name, sizeof(name), "hd%d", hd->id);
+	hd->dentry = debugfs_create_dir(name, gb_debugfs_get());
+	debugfs_create_file("enumeration", S_IRUGO, hd->dentry, hd,
+			    &enumeration_fops);
+	debugfs_create_file("hotplug", S_IRUGO, hd->dentry, hd, &hotplug_fops);
+	debugfs_create_file("pm", S_IRUGO, hd->dentry, hd, &pm_fops);
+
+	if (gb_cport_handlers_init(hd)) {
+		debugfs_remove_recursive(hd->dentry);
+		kfree(hd->hotplug_timing);
+		ida_simple_remove(&hd_ida, hd->id);
+		kfree(hd);
+		return NULL;
+	}
+
+	/* The link still works without a recorder, so just warn about it */
+	if (gb_capture_init(hd))
+		dev_warn(parent, "no memory for the traffic capture\n");
 
 	return hd;
 }
@@ -513,6 +1022,22 @@ EXPORT_SYMBOL_GPL(greybus_create_hd);
 
 void greybus_remove_hd(struct greybus_host_device *hd)
 {
+	struct greybus_module *gmod;
+	int id = 0;
+
+	/* A hotplug that is still on its way would add a module to a dead hd */
+	gb_ap_stop(hd);
+
+	/* Modules can't outlive the host device they are plugged into */
+	for (;;) {
+		mutex_lock(&hd->modules_lock);
+		gmod = idr_get_next(&hd->modules, &id);
+		mutex_unlock(&hd->modules_lock);
+		if (!gmod)
+			break;
+		gb_remove_module(hd, id);
+	}
+
 	kref_put_mutex(&hd->kref, free_hd, &hd_mutex);
 }
 EXPORT_SYMBOL_GPL(greybus_remove_hd);
@@ -546,6 +1071,12 @@ static int __init gb_init(void)
 		goto error_gbuf;
 	}
 
+	retval = gb_manifest_init();
+	if (retval) {
+		pr_err("gb_manifest_init failed\n");
+		goto error_manifest;
+	}
+
 	retval = gb_tty_init();
 	if (retval) {
 		pr_err("gb_tty_init failed\n");
@@ -555,6 +1086,9 @@ static int __init gb_init(void)
 	return 0;
 
 error_tty:
+	gb_manifest_exit();
+
+error_manifest:
 	gb_gbuf_exit();
 
 error_gbuf:
@@ -572,6 +1106,7 @@ error_bus:
 static void __exit gb_exit(void)
 {
 	gb_tty_exit();
+	gb_manifest_exit();
 	gb_gbuf_exit();
 	gb_ap_exit();
 	bus_unregister(&greybus_bus_type);
@@ -27,3 +27,9 @@ void gb_debugfs_cleanup(void)
 {
 	debugfs_remove_recursive(gb_debug_root);
 }
+
+struct dentry *gb_debugfs_get(void)
+{
+	return gb_debug_root;
+}
+EXPORT_SYMBOL_GPL(gb_debugfs_get);
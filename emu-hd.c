@@ -0,0 +1,452 @@
+/*
+ * Greybus emulated host driver
+ *
+ * A host controller whose "wire" is /dev/gb_hd_emu.  Every open of the device
+ * creates a new host device, and the process that has it open plays the part
+ * of the SVC and all of the modules behind it: it answers the handshake,
+ * sends hotplug messages with manifests, and sends and receives cport data.
+ * See emu_msg.h for what goes over the file descriptor.
+ *
+ * Copyright 2026 The Greybus Authors
+ *
+ * Released under the GPLv2 only.
+ */
+#define pr_fmt(fmt) KBUILD_MODNAME ": " fmt
+
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/moduleparam.h>
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
+#include <linux/log2.h>
+#include <linux/errno.h>
+#include <linux/fs.h>
+#include <linux/mm.h>
+#include <linux/miscdevice.h>
+#include <linux/poll.h>
+#include <linux/wait.h>
+#include <linux/sched.h>
+#include <linux/uaccess.h>
+#include "greybus.h"
+#include "svc_msg.h"
+#include "emu_msg.h"
+
+#define EMU_SVC_MSG_SIZE	2048
+
+static unsigned int buffer_size = PAGE_SIZE;
+module_param(buffer_size, uint, 0444);
+MODULE_PARM_DESC(buffer_size, "largest transfer on the link (host mtu) in bytes");
+
+static unsigned int ring_size = 256 * 1024;
+module_param(ring_size, uint, 0444);
+MODULE_PARM_DESC(ring_size, "size of the ring of frames going to userspace");
+
+/*
+ * emu_hd - emulated host controller
+ * @hd: pointer to our greybus_host_device structure
+ * @ring_lock: serializes the producers of @ctrl->head
+ * @ctrl: ring control page, shared with userspace
+ * @ring: the frames themselves, right after @ctrl
+ * @ring_size: size of @ring
+ * @wait: woken up when there is something to read
+ * @read_mutex: serializes readers of the ring, they move @ctrl->tail
+ * @write_mutex: serializes writers of @buffer
+ * @buffer: where frames from userspace are put together
+ */
+struct emu_hd {
+	struct greybus_host_device *hd;
+
+	spinlock_t ring_lock;
+	struct emu_ring_ctrl *ctrl;
+	u8 *ring;
+	u32 ring_size;
+	wait_queue_head_t wait;
+
+	struct mutex read_mutex;
+	struct mutex write_mutex;
+	u8 *buffer;
+};
+
+static struct miscdevice emu_misc;
+
+static inline struct emu_hd *hd_to_emu(struct greybus_host_device *hd)
+{
+	return (struct emu_hd *)&hd->hd_priv;
+}
+
+/*
+ * Put a frame in the ring for userspace.  This can be called in interrupt
+ * context, so if there is no room it's dropped, and counted.
+ */
+static int emu_queue_frame(struct emu_hd *emu, u8 type, u16 cport,
+			   const void *data, size_t size)
+{
+	struct emu_ring_ctrl *ctrl = emu->ctrl;
+	struct emu_msg_header *header;
+	size_t frame_size = ALIGN(sizeof(*header) + size, EMU_MSG_ALIGN);
+	unsigned long flags;
+	u32 head;
+	u32 offset;
+	u32 left;
+
+	spin_lock_irqsave(&emu->ring_lock, flags);
+	head = ctrl->head;
+	offset = head & (emu->ring_size - 1);
+	left = emu->ring_size - offset;
+
+	/* Frames don't wrap, so we might need to pad out the end of the ring */
+	if (left < frame_size) {
+		if (head + left + frame_size - ACCESS_ONCE(ctrl->tail) >
+		    emu->ring_size)
+			goto full;
+		header = (struct emu_msg_header *)&emu->ring[offset];
+		memset(header, 0, sizeof(*header));
+		header->type = EMU_MSG_PAD;
+		header->size = cpu_to_le16(left - sizeof(*header));
+		head += left;
+		offset = 0;
+	} else if (head + frame_size - ACCESS_ONCE(ctrl->tail) >
+		   emu->ring_size) {
+		goto full;
+	}
+
+	header = (struct emu_msg_header *)&emu->ring[offset];
+	header->size = cpu_to_le16(size);
+	header->type = type;
+	header->reserved = 0;
+	header->cport = cpu_to_le16(cport);
+	header->reserved2 = 0;
+	memcpy(header + 1, data, size);
+
+	/* The frame has to be there before userspace can see the new head */
+	smp_wmb();
+	ctrl->head = head + frame_size;
+	spin_unlock_irqrestore(&emu->ring_lock, flags);
+
+	wake_up_interruptible(&emu->wait);
+	return 0;
+
+full:
+	ctrl->dropped++;
+	spin_unlock_irqrestore(&emu->ring_lock, flags);
+	return -ENOSPC;
+}
+
+static int alloc_gbuf_data(struct gbuf *gbuf, unsigned int size, gfp_t gfp_mask)
+{
+	gbuf->transfer_buffer = kmalloc(size, gfp_mask);
+	if (!gbuf->transfer_buffer)
+		return -ENOMEM;
+
+	gbuf->transfer_buffer_length = size;
+	gbuf->actual_length = size;
+	gbuf->hdpriv = hd_to_emu(gbuf->gmod->hd);
+
+	return 0;
+}
+
+static void free_gbuf_data(struct gbuf *gbuf)
+{
+	kfree(gbuf->transfer_buffer);
+}
+
+static int send_svc_msg(struct svc_msg *svc_msg, struct greybus_host_device *hd)
+{
+	size_t size = sizeof(svc_msg->header) +
+		      le16_to_cpu(svc_msg->header.payload_length);
+
+	return emu_queue_frame(hd_to_emu(hd), EMU_MSG_SVC, 0, svc_msg,
+			       min(size, sizeof(*svc_msg)));
+}
+
+static int submit_gbuf(struct gbuf *gbuf, struct greybus_host_device *hd,
+		       gfp_t gfp_mask)
+{
+	int retval;
+
+	retval = emu_queue_frame(hd_to_emu(hd), EMU_MSG_CPORT,
+				 gbuf->cport->number, gbuf->transfer_buffer,
+				 gbuf->transfer_buffer_length);
+	if (retval)
+		return retval;
+
+	/* Once it's in the ring, it's on the "wire" */
+	gbuf->status = 0;
+	greybus_gbuf_finished(gbuf);
+	return 0;
+}
+
+static struct greybus_host_driver emu_driver = {
+	.hd_priv_size		= sizeof(struct emu_hd),
+	.alloc_gbuf_data	= alloc_gbuf_data,
+	.free_gbuf_data		= free_gbuf_data,
+	.send_svc_msg		= send_svc_msg,
+	.submit_gbuf		= submit_gbuf,
+};
+
+/* Hand a frame from userspace to the core, like a real host would */
+static int emu_receive_frame(struct emu_hd *emu,
+			     struct emu_msg_header *header, u8 *data)
+{
+	struct greybus_host_device *hd = emu->hd;
+	size_t left = le16_to_cpu(header->size);
+	u16 cport = le16_to_cpu(header->cport);
+	size_t length;
+
+	switch (header->type) {
+	case EMU_MSG_PAD:
+		return 0;
+
+	case EMU_MSG_SVC:
+		if (left > EMU_SVC_MSG_SIZE)
+			return -EMSGSIZE;
+		return gb_new_ap_msg(data, left, hd);
+
+	case EMU_MSG_CPORT:
+		if (cport >= MAX_CPORTS)
+			return -EINVAL;
+		do {
+			length = min(left, hd->buffer_size_max);
+			greybus_cport_in_data(hd, cport, data, length);
+			data += length;
+			left -= length;
+		} while (length == hd->buffer_size_max);
+		return 0;
+
+	default:
+		return -EINVAL;
+	}
+}
+
+static ssize_t emu_write(struct file *file, const char __user *buf,
+			 size_t count, loff_t *ppos)
+{
+	struct emu_hd *emu = file->private_data;
+	struct emu_msg_header header;
+	size_t done = 0;
+	size_t size;
+	int retval = 0;
+
+	if (mutex_lock_interruptible(&emu->write_mutex))
+		return -ERESTARTSYS;
+
+	while (done + sizeof(header) <= count) {
+		if (copy_from_user(&header, buf + done, sizeof(header))) {
+			retval = -EFAULT;
+			break;
+		}
+
+		size = le16_to_cpu(header.size);
+		if (sizeof(header) + size > count - done) {
+			retval = -EINVAL;
+			break;
+		}
+
+		if (copy_from_user(emu->buffer, buf + done + sizeof(header),
+				   size)) {
+			retval = -EFAULT;
+			break;
+		}
+
+		retval = emu_receive_frame(emu, &header, emu->buffer);
+		if (retval)
+			break;
+
+		done += ALIGN(sizeof(header) + size, EMU_MSG_ALIGN);
+	}
+	mutex_unlock(&emu->write_mutex);
+
+	/* Tell userspace about the frames we took before something went wrong */
+	if (done)
+		return min(done, count);
+	return retval ? retval : -EINVAL;
+}
+
+static ssize_t emu_read(struct file *file, char __user *buf, size_t count,
+			loff_t *ppos)
+{
+	struct emu_hd *emu = file->private_data;
+	struct emu_ring_ctrl *ctrl = emu->ctrl;
+	struct emu_msg_header *header;
+	size_t done = 0;
+	size_t frame_size;
+	u32 offset;
+	u32 head;
+	u32 tail;
+	ssize_t retval = 0;
+
+	if (mutex_lock_interruptible(&emu->read_mutex))
+		return -ERESTARTSYS;
+
+retry:
+	if (!(file->f_flags & O_NONBLOCK)) {
+		retval = wait_event_interruptible(emu->wait,
+				ACCESS_ONCE(ctrl->head) != ACCESS_ONCE(ctrl->tail));
+		if (retval)
+			goto exit;
+	}
+
+	head = ACCESS_ONCE(ctrl->head);
+	/* Read the head before the frames it covers */
+	smp_rmb();
+	tail = ctrl->tail;
+
+	while (tail != head) {
+		offset = tail & (emu->ring_size - 1);
+		header = (struct emu_msg_header *)&emu->ring[offset];
+		frame_size = ALIGN(sizeof(*header) + le16_to_cpu(header->size),
+				   EMU_MSG_ALIGN);
+
+		/* Userspace can write to the ring too, don't trust it */
+		if (offset + frame_size > emu->ring_size) {
+			retval = -EIO;
+			break;
+		}
+
+		if (header->type != EMU_MSG_PAD) {
+			if (done + frame_size > count)
+				break;
+			if (copy_to_user(buf + done, header, frame_size)) {
+				retval = -EFAULT;
+				break;
+			}
+			done += frame_size;
+		}
+		tail += frame_size;
+	}
+
+	/* We are done with the frames before the producer can reuse the space */
+	smp_mb();
+	ctrl->tail = tail;
+
+	if (done) {
+		retval = done;
+	} else if (tail != head) {
+		if (!retval)
+			retval = -EMSGSIZE;
+	} else {
+		/* There was nothing but padding */
+		if (!(file->f_flags & O_NONBLOCK))
+			goto retry;
+		retval = -EAGAIN;
+	}
+exit:
+	mutex_unlock(&emu->read_mutex);
+	return retval;
+}
+
+static unsigned int emu_poll(struct file *file, poll_table *wait)
+{
+	struct emu_hd *emu = file->private_data;
+	unsigned int mask = POLLOUT | POLLWRNORM;
+
+	poll_wait(file, &emu->wait, wait);
+	if (ACCESS_ONCE(emu->ctrl->head) != ACCESS_ONCE(emu->ctrl->tail))
+		mask |= POLLIN | POLLRDNORM;
+
+	return mask;
+}
+
+static int emu_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	struct emu_hd *emu = file->private_data;
+
+	if (vma->vm_end - vma->vm_start > PAGE_SIZE + emu->ring_size)
+		return -EINVAL;
+
+	return remap_vmalloc_range(vma, emu->ctrl, vma->vm_pgoff);
+}
+
+static int emu_open(struct inode *inode, struct file *file)
+{
+	struct greybus_host_device *hd;
+	struct emu_hd *emu;
+	size_t size;
+	void *ring;
+
+	size = clamp_t(unsigned int, buffer_size, 64, GB_MESSAGE_SIZE_MAX);
+	hd = greybus_create_hd(&emu_driver, emu_misc.this_device, size);
+	if (!hd)
+		return -ENOMEM;
+
+	/* Frames carry whole messages, we split them ourselves */
+	hd->segmented = true;
+
+	emu = hd_to_emu(hd);
+	emu->hd = hd;
+	emu->ring_size = roundup_pow_of_two(max_t(unsigned int, ring_size,
+						  2 * (GB_MESSAGE_SIZE_MAX + 1)));
+	spin_lock_init(&emu->ring_lock);
+	init_waitqueue_head(&emu->wait);
+	mutex_init(&emu->read_mutex);
+	mutex_init(&emu->write_mutex);
+
+	ring = vmalloc_user(PAGE_SIZE + emu->ring_size);
+	if (!ring)
+		goto error_ring;
+	emu->ctrl = ring;
+	emu->ctrl->size = emu->ring_size;
+	emu->ring = ring + PAGE_SIZE;
+
+	emu->buffer = kmalloc(GB_MESSAGE_SIZE_MAX, GFP_KERNEL);
+	if (!emu->buffer)
+		goto error_buffer;
+
+	file->private_data = emu;
+	return nonseekable_open(inode, file);
+
+error_buffer:
+	vfree(ring);
+error_ring:
+	greybus_remove_hd(hd);
+	return -ENOMEM;
+}
+
+static int emu_release(struct inode *inode, struct file *file)
+{
+	struct emu_hd *emu = file->private_data;
+	struct emu_ring_ctrl *ctrl = emu->ctrl;
+	u8 *buffer = emu->buffer;
+
+	/*
+	 * That takes down the modules, which can send into the ring until
+	 * they are gone, and @emu goes with the host device.
+	 */
+	greybus_remove_hd(emu->hd);
+	kfree(buffer);
+	vfree(ctrl);
+	return 0;
+}
+
+static const struct file_operations emu_fops = {
+	.owner		= THIS_MODULE,
+	.open		= emu_open,
+	.release	= emu_release,
+	.read		= emu_read,
+	.write		= emu_write,
+	.poll		= emu_poll,
+	.mmap		= emu_mmap,
+	.llseek		= no_llseek,
+};
+
+static struct miscdevice emu_misc = {
+	.minor	= MISC_DYNAMIC_MINOR,
+	.name	= "gb_hd_emu",
+	.fops	= &emu_fops,
+};
+
+static int __init emu_init(void)
+{
+	return misc_register(&emu_misc);
+}
+
+static void __exit emu_exit(void)
+{
+	misc_deregister(&emu_misc);
+}
+
+module_init(emu_init);
+module_exit(emu_exit);
+
+MODULE_LICENSE("GPL");
+MODULE_AUTHOR("The Greybus Authors");
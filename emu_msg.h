@@ -0,0 +1,48 @@
+/*
+ * Greybus emulated host device message format.
+ *
+ * Everything that goes through /dev/gb_hd_emu is a stream of these frames,
+ * in both directions.  A write() can carry as many frames as wanted, a
+ * read() returns as many whole frames as fit in the buffer.
+ *
+ * Frames the AP sends are also visible through mmap(): the first page is a
+ * struct emu_ring_ctrl, followed by the ring of frames itself.  A consumer
+ * reads frames from tail up to head, and then moves tail forward.  Frames
+ * never wrap around the end of the ring, an EMU_MSG_PAD frame fills up the
+ * space at the end instead.
+ *
+ * Copyright 2026 The Greybus Authors
+ */
+
+#ifndef __EMU_MSG_H
+#define __EMU_MSG_H
+
+#pragma pack(push, 1)
+
+enum emu_msg_type {
+	EMU_MSG_PAD		= 0x00,	/* skip this frame */
+	EMU_MSG_SVC		= 0x01,	/* struct svc_msg to or from the SVC */
+	EMU_MSG_CPORT		= 0x02,	/* cport data to or from a module */
+};
+
+struct emu_msg_header {
+	__le16	size;		/* size of the data after the header */
+	__u8	type;		/* enum emu_msg_type */
+	__u8	reserved;
+	__le16	cport;		/* only for EMU_MSG_CPORT */
+	__le16	reserved2;
+};
+
+/* Frames start on this boundary */
+#define EMU_MSG_ALIGN		8
+
+struct emu_ring_ctrl {
+	__u32	head;		/* free running, written by the AP */
+	__u32	tail;		/* free running, written by the emulator */
+	__u32	size;		/* of the ring, a power of two */
+	__u32	dropped;	/* frames the AP could not fit in the ring */
+};
+
+#pragma pack(pop)
+
+#endif /* __EMU_MSG_H */
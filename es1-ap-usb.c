@@ -7,6 +7,8 @@
  */
 #include <linux/kernel.h>
 #include <linux/module.h>
+#include <linux/moduleparam.h>
+#include <linux/log2.h>
 #include <linux/slab.h>
 #include <linux/errno.h>
 #include <linux/usb.h>
@@ -16,6 +18,18 @@
 /* Memory sizes for the buffers sent to/from the ES1 controller */
 #define ES1_SVC_MSG_SIZE	2048
 #define ES1_GBUF_MSG_SIZE	PAGE_SIZE
+#define ES1_GBUF_MSG_SIZE_MAX	(64 * 1024)
+
+/*
+ * Size of the CPort IN buffers, including the leading cport number byte.
+ * The bulk IN endpoint is shared by all cports, so this is also the upper
+ * bound of the mtu any cport on this host can negotiate.  Bump it up (it is
+ * rounded to a power of two, up to ES1_GBUF_MSG_SIZE_MAX) for modules with
+ * bulk heavy cports so big messages take fewer transfers.
+ */
+static unsigned int cport_buffer_size = ES1_GBUF_MSG_SIZE;
+module_param(cport_buffer_size, uint, 0444);
+MODULE_PARM_DESC(cport_buffer_size, "size of the CPort IN buffers in bytes");
 
 
 static const struct usb_device_id id_table[] = {
@@ -50,9 +64,13 @@ MODULE_DEVICE_TABLE(usb, id_table);
  * @svc_urb: urb for SVC messages coming in on @svc_endpoint
  * @cport_in_urb: array of urbs for the CPort in messages
  * @cport_in_buffer: array of buffers for the @cport_in_urb urbs
+ * @cport_in_buffer_size: size of each of the @cport_in_buffer buffers
  * @cport_out_urb: array of urbs for the CPort out messages
  * @cport_out_urb_busy: array of flags to see if the @cport_out_urb is busy or
  *			not.
+ * @cport_out_urb_unlinking: how many kill_gbuf() calls are unlinking each
+ *			     @cport_out_urb, it can't be reused until they
+ *			     are done
  * @cport_out_urb_lock: locks the @cport_out_urb_busy "list"
  */
 struct es1_ap_dev {
@@ -70,8 +88,10 @@ struct es1_ap_dev {
 
 	struct urb *cport_in_urb[NUM_CPORT_IN_URB];
 	u8 *cport_in_buffer[NUM_CPORT_IN_URB];
+	size_t cport_in_buffer_size;
 	struct urb *cport_out_urb[NUM_CPORT_OUT_URB];
 	bool cport_out_urb_busy[NUM_CPORT_OUT_URB];
+	u8 cport_out_urb_unlinking[NUM_CPORT_OUT_URB];
 	spinlock_t cport_out_urb_lock;
 };
 
@@ -82,6 +102,31 @@ static inline struct es1_ap_dev *hd_to_es1(struct greybus_host_device *hd)
 
 static void cport_out_callback(struct urb *urb);
 
+/*
+ * A gbuf bigger than the host mtu goes out as more than one transfer, one
+ * after the other, with the same urb.  Every transfer needs the cport number
+ * in front of it, and for all but the first segment that is where the last
+ * byte of the previous segment lives.  So once the previous segment is sent,
+ * we save that byte here, put the cport number on top of it, and put it back
+ * when the segment is done.  No copies of the data are needed.
+ *
+ * This lives in front of the cport number byte of the gbuf buffer.
+ */
+struct es1_gbuf_segment {
+	u32 offset;	/* offset in the transfer buffer of the current segment */
+	u8 saved;	/* data byte hidden by the cport number */
+	bool killed;	/* don't send any more segments */
+	struct urb *urb;	/* while in flight, under cport_out_urb_lock */
+};
+
+static inline struct es1_gbuf_segment *gbuf_to_segment(struct gbuf *gbuf)
+{
+	u8 *transfer_buffer = gbuf->transfer_buffer;
+
+	return (struct es1_gbuf_segment *)
+		&transfer_buffer[-1 - sizeof(struct es1_gbuf_segment)];
+}
+
 /*
  * Allocate the actual buffer for this gbuf and device and cport
  *
@@ -95,19 +140,16 @@ static int alloc_gbuf_data(struct gbuf *gbuf, unsigned int size, gfp_t gfp_mask)
 	struct es1_ap_dev *es1 = hd_to_es1(gbuf->gmod->hd);
 	u8 *buffer;
 
-	if (size > ES1_GBUF_MSG_SIZE) {
-		pr_err("guf was asked to be bigger than %ld!\n",
-		       ES1_GBUF_MSG_SIZE);
-	}
-
 	/* For ES2 we need to figure out what cport is going to what endpoint,
 	 * but for ES1, it's so dirt simple, we don't have a choice...
 	 *
 	 * Also, do a "slow" allocation now, if we need speed, use a cache
 	 */
-	buffer = kmalloc(size + 1, gfp_mask);
+	buffer = kmalloc(sizeof(struct es1_gbuf_segment) + size + 1, gfp_mask);
 	if (!buffer)
 		return -ENOMEM;
+	memset(buffer, 0, sizeof(struct es1_gbuf_segment));
+	buffer += sizeof(struct es1_gbuf_segment);
 
 	/*
 	 * we will encode the cport number in the first byte of the buffer, so
@@ -133,12 +175,22 @@ static void free_gbuf_data(struct gbuf *gbuf)
 	transfer_buffer = gbuf->transfer_buffer;
 	/* Can be called with a NULL transfer_buffer on some error paths */
 	if (transfer_buffer) {
-		buffer = &transfer_buffer[-1];	/* yes, we mean -1 */
+		buffer = (u8 *)gbuf_to_segment(gbuf);
 		kfree(buffer);
 	}
 }
 
 #define ES1_TIMEOUT	500	/* 500 ms for the SVC to do something */
+
+/*
+ * What the bridge can do, answered to ES1_REQ_CAPABILITIES.  No ES1 firmware
+ * has this request yet, it's what we propose the firmware adds: one byte of
+ * capability bits, the ones it doesn't know about cleared.  Until then the
+ * request stalls, and the bridge is treated as not taking segments.
+ */
+#define ES1_REQ_CAPABILITIES	0x02	/* vendor request, one byte in */
+#define ES1_CAP_SEGMENTS	BIT(0)	/* splits and joins big messages */
+
 static int send_svc_msg(struct svc_msg *svc_msg, struct greybus_host_device *hd)
 {
 	struct es1_ap_dev *es1 = hd_to_es1(hd);
@@ -160,6 +212,35 @@ static int send_svc_msg(struct svc_msg *svc_msg, struct greybus_host_device *hd)
 	return 0;
 }
 
+/*
+ * Only a bridge that says it knows about segments gets messages bigger than
+ * a transfer, see greybus.h.  Older ones stall the request.
+ */
+static bool es1_segmented(struct es1_ap_dev *es1)
+{
+	bool segmented;
+	u8 *caps;
+	int retval;
+
+	/* Has to be DMA-able, so not on the stack */
+	caps = kmalloc(1, GFP_KERNEL);
+	if (!caps)
+		return false;
+
+	retval = usb_control_msg(es1->usb_dev,
+				 usb_rcvctrlpipe(es1->usb_dev,
+						 es1->control_endpoint),
+				 ES1_REQ_CAPABILITIES,
+				 USB_DIR_IN | USB_TYPE_VENDOR | USB_RECIP_INTERFACE,
+				 0x00, 0x00, caps, 1, ES1_TIMEOUT);
+	segmented = retval == 1 && (*caps & ES1_CAP_SEGMENTS);
+	kfree(caps);
+
+	dev_dbg(&es1->usb_intf->dev, "bridge %s segmented messages\n",
+		segmented ? "takes" : "doesn't take");
+	return segmented;
+}
+
 static struct urb *next_free_urb(struct es1_ap_dev *es1, gfp_t gfp_mask)
 {
 	struct urb *urb = NULL;
@@ -170,7 +251,8 @@ static struct urb *next_free_urb(struct es1_ap_dev *es1, gfp_t gfp_mask)
 
 	/* Look in our pool of allocated urbs first, as that's the "fastest" */
 	for (i = 0; i < NUM_CPORT_OUT_URB; ++i) {
-		if (es1->cport_out_urb_busy[i] == false) {
+		if (es1->cport_out_urb_busy[i] == false &&
+		    !es1->cport_out_urb_unlinking[i]) {
 			es1->cport_out_urb_busy[i] = true;
 			urb = es1->cport_out_urb[i];
 			break;
@@ -193,38 +275,133 @@ static struct urb *next_free_urb(struct es1_ap_dev *es1, gfp_t gfp_mask)
 	return urb;
 }
 
+static void free_urb(struct es1_ap_dev *es1, struct urb *urb)
+{
+	unsigned long flags;
+	int i;
+
+	/*
+	 * See if this was an urb in our pool, if so mark it "free", otherwise
+	 * we need to free it ourselves.
+	 */
+	spin_lock_irqsave(&es1->cport_out_urb_lock, flags);
+	for (i = 0; i < NUM_CPORT_OUT_URB; ++i) {
+		if (urb == es1->cport_out_urb[i]) {
+			es1->cport_out_urb_busy[i] = false;
+			urb = NULL;
+			break;
+		}
+	}
+	spin_unlock_irqrestore(&es1->cport_out_urb_lock, flags);
+
+	/* If urb is not NULL, then we need to free this urb */
+	usb_free_urb(urb);
+}
+
+/* Point the urb at the segment of the gbuf that starts at segment->offset */
+static void fill_segment_urb(struct es1_ap_dev *es1, struct urb *urb,
+			     struct gbuf *gbuf)
+{
+	struct es1_gbuf_segment *segment = gbuf_to_segment(gbuf);
+	struct usb_device *udev = es1->usb_dev;
+	u8 *transfer_buffer = gbuf->transfer_buffer;
+	u8 *buffer;
+	size_t length;
+
+	buffer = &transfer_buffer[segment->offset - 1];	/* yes, we mean -1 */
+	length = min_t(size_t, gbuf->transfer_buffer_length - segment->offset,
+		       es1->hd->buffer_size_max);
+
+	if (segment->offset)
+		segment->saved = buffer[0];
+	buffer[0] = gbuf->cport->number;
+
+	usb_fill_bulk_urb(urb, udev,
+			  usb_sndbulkpipe(udev, es1->cport_out_endpoint),
+			  buffer, length + 1, cport_out_callback, gbuf);
+}
+
 static int submit_gbuf(struct gbuf *gbuf, struct greybus_host_device *hd,
 		       gfp_t gfp_mask)
 {
 	struct es1_ap_dev *es1 = hd_to_es1(hd);
-	struct usb_device *udev = es1->usb_dev;
+	struct es1_gbuf_segment *segment = gbuf_to_segment(gbuf);
+	unsigned long flags;
 	int retval;
-	u8 *transfer_buffer;
-	u8 *buffer;
 	struct urb *urb;
 
-	transfer_buffer = gbuf->transfer_buffer;
-	buffer = &transfer_buffer[-1];	/* yes, we mean -1 */
-
 	/* Find a free urb */
 	urb = next_free_urb(es1, gfp_mask);
 	if (!urb)
 		return -ENOMEM;
 
-	usb_fill_bulk_urb(urb, udev,
-			  usb_sndbulkpipe(udev, es1->cport_out_endpoint),
-			  buffer, gbuf->transfer_buffer_length + 1,
-			  cport_out_callback, gbuf);
+	segment->offset = 0;
+	fill_segment_urb(es1, urb, gbuf);
+
+	spin_lock_irqsave(&es1->cport_out_urb_lock, flags);
+	segment->urb = urb;
+	spin_unlock_irqrestore(&es1->cport_out_urb_lock, flags);
+
 	retval = usb_submit_urb(urb, gfp_mask);
+	if (retval) {
+		spin_lock_irqsave(&es1->cport_out_urb_lock, flags);
+		segment->urb = NULL;
+		segment->killed = false;
+		spin_unlock_irqrestore(&es1->cport_out_urb_lock, flags);
+		free_urb(es1, urb);
+	}
 	return retval;
 }
 
+/*
+ * Unlink the urb of a gbuf, the gbuf completes with -ECONNRESET through
+ * cport_out_callback() like always.  The urb might complete on its own
+ * while we are at it, so it can't go back into the pool until we are done.
+ */
+static void kill_gbuf(struct gbuf *gbuf)
+{
+	struct es1_ap_dev *es1 = gbuf->hdpriv;
+	struct es1_gbuf_segment *segment = gbuf_to_segment(gbuf);
+	unsigned long flags;
+	struct urb *urb;
+	int i;
+
+	spin_lock_irqsave(&es1->cport_out_urb_lock, flags);
+	segment->killed = true;
+	urb = segment->urb;
+	if (!urb) {
+		spin_unlock_irqrestore(&es1->cport_out_urb_lock, flags);
+		return;
+	}
+	for (i = 0; i < NUM_CPORT_OUT_URB; ++i) {
+		if (urb == es1->cport_out_urb[i]) {
+			es1->cport_out_urb_unlinking[i]++;
+			break;
+		}
+	}
+	/* Not from the pool, so keep it from being freed under us */
+	if (i == NUM_CPORT_OUT_URB)
+		usb_get_urb(urb);
+	spin_unlock_irqrestore(&es1->cport_out_urb_lock, flags);
+
+	usb_unlink_urb(urb);
+
+	if (i == NUM_CPORT_OUT_URB) {
+		usb_free_urb(urb);
+		return;
+	}
+	spin_lock_irqsave(&es1->cport_out_urb_lock, flags);
+	es1->cport_out_urb_unlinking[i]--;
+	spin_unlock_irqrestore(&es1->cport_out_urb_lock, flags);
+}
+
 static struct greybus_host_driver es1_driver = {
 	.hd_priv_size		= sizeof(struct es1_ap_dev),
 	.alloc_gbuf_data	= alloc_gbuf_data,
 	.free_gbuf_data		= free_gbuf_data,
 	.send_svc_msg		= send_svc_msg,
 	.submit_gbuf		= submit_gbuf,
+	.kill_gbuf		= kill_gbuf,
 };
 
 /* Callback for when we get a SVC message */
@@ -290,8 +467,11 @@ static void cport_in_callback(struct urb *urb)
 		goto exit;
 	}
 
-	/* The size has to be more then just an "empty" transfer */
-	if (urb->actual_length <= 2) {
+	/*
+	 * We need at least the cport number, the data can be empty if this is
+	 * the end of a segmented message.
+	 */
+	if (urb->actual_length < 1) {
 		dev_err(dev, "%s: \"short\" cport in transfer of %d bytes?\n",
 			__func__, urb->actual_length);
 		goto exit;
@@ -321,9 +501,15 @@ static void cport_out_callback(struct urb *urb)
 	struct device *dev = &urb->dev->dev;
 	struct gbuf *gbuf = urb->context;
 	struct es1_ap_dev *es1 = gbuf->hdpriv;
-	unsigned long flags;
+	struct es1_gbuf_segment *segment = gbuf_to_segment(gbuf);
+	u8 *transfer_buffer = gbuf->transfer_buffer;
+	size_t sent = urb->transfer_buffer_length - 1;
 	int status = urb->status;
-	int i;
+	unsigned long flags;
+
+	/* Put back the data byte the cport number was covering up */
+	if (segment->offset)
+		transfer_buffer[segment->offset - 1] = segment->saved;
 
 	/* do we care about errors going back up? */
 	switch (status) {
@@ -343,26 +529,33 @@ static void cport_out_callback(struct urb *urb)
 		goto exit;
 	}
 
-	/* Tell the core the gbuf is properly sent */
-	greybus_gbuf_finished(gbuf);
+	/* A full segment means there is more of the gbuf to send */
+	if (es1->hd->segmented && sent == es1->hd->buffer_size_max) {
+		if (ACCESS_ONCE(segment->killed)) {
+			status = -ECONNRESET;
+			goto exit;
+		}
+		segment->offset += sent;
+		fill_segment_urb(es1, urb, gbuf);
+		status = usb_submit_urb(urb, GFP_ATOMIC);
+		if (!status)
+			return;
+		dev_err(dev, "%s: error %d in submitting segment\n",
+			__func__, status);
+		transfer_buffer[segment->offset - 1] = segment->saved;
+	}
 
 exit:
-	/*
-	 * See if this was an urb in our pool, if so mark it "free", otherwise
-	 * we need to free it ourselves.
-	 */
 	spin_lock_irqsave(&es1->cport_out_urb_lock, flags);
-	for (i = 0; i < NUM_CPORT_OUT_URB; ++i) {
-		if (urb == es1->cport_out_urb[i]) {
-			es1->cport_out_urb_busy[i] = false;
-			urb = NULL;
-			break;
-		}
-	}
+	segment->urb = NULL;
+	segment->killed = false;
 	spin_unlock_irqrestore(&es1->cport_out_urb_lock, flags);
 
-	/* If urb is not NULL, then we need to free this urb */
-	usb_free_urb(urb);
+	/* Tell the core the gbuf is done, one way or another */
+	gbuf->status = status;
+	greybus_gbuf_finished(gbuf);
+
+	free_urb(es1, urb);
 }
 
 /*
@@ -386,10 +579,20 @@ static int ap_probe(struct usb_interface *interface,
 	int retval = -ENOMEM;
 	int i;
 	u8 svc_interval = 0;
+	size_t cport_in_size;
 
 	udev = usb_get_dev(interface_to_usbdev(interface));
 
-	hd = greybus_create_hd(&es1_driver, &udev->dev);
+	/*
+	 * Everything we send or receive has the cport number in front of it,
+	 * so the host mtu is one byte less than the buffer.
+	 */
+	cport_in_size = roundup_pow_of_two(clamp_t(unsigned int,
+						   cport_buffer_size,
+						   ES1_GBUF_MSG_SIZE,
+						   ES1_GBUF_MSG_SIZE_MAX));
+
+	hd = greybus_create_hd(&es1_driver, &udev->dev, cport_in_size - 1);
 	if (!hd)
 		return -ENOMEM;
 
@@ -397,6 +600,7 @@ static int ap_probe(struct usb_interface *interface,
 	es1->hd = hd;
 	es1->usb_intf = interface;
 	es1->usb_dev = udev;
+	es1->cport_in_buffer_size = cport_in_size;
 	spin_lock_init(&es1->cport_out_urb_lock);
 	usb_set_intfdata(interface, es1);
 
@@ -432,6 +636,8 @@ static int ap_probe(struct usb_interface *interface,
 		goto error;
 	}
 
+	hd->segmented = es1_segmented(es1);
+
 	/* Create our buffer and URB to get SVC messages, and start it up */
 	es1->svc_buffer = kmalloc(ES1_SVC_MSG_SIZE, GFP_KERNEL);
 	if (!es1->svc_buffer)
@@ -457,13 +663,14 @@ static int ap_probe(struct usb_interface *interface,
 		urb = usb_alloc_urb(0, GFP_KERNEL);
 		if (!urb)
 			goto error_bulk_in_urb;
-		buffer = kmalloc(ES1_GBUF_MSG_SIZE, GFP_KERNEL);
+		buffer = kmalloc(es1->cport_in_buffer_size, GFP_KERNEL);
 		if (!buffer)
 			goto error_bulk_in_urb;
 
 		usb_fill_bulk_urb(urb, udev,
 				  usb_rcvbulkpipe(udev, es1->cport_in_endpoint),
-				  buffer, PAGE_SIZE, cport_in_callback, es1);
+				  buffer, es1->cport_in_buffer_size,
+				  cport_in_callback, es1);
 		es1->cport_in_urb[i] = urb;
 		es1->cport_in_buffer[i] = buffer;
 		retval = usb_submit_urb(urb, GFP_KERNEL);
@@ -508,36 +715,123 @@ error:
 static void ap_disconnect(struct usb_interface *interface)
 {
 	struct es1_ap_dev *es1;
+	struct usb_device *udev;
+	struct urb *cport_out_urb[NUM_CPORT_OUT_URB];
+	struct urb *cport_in_urb[NUM_CPORT_IN_URB];
+	u8 *cport_in_buffer[NUM_CPORT_IN_URB];
+	struct urb *svc_urb;
+	u8 *svc_buffer;
 	int i;
 
 	es1 = usb_get_intfdata(interface);
 	if (!es1)
 		return;
 
+	/*
+	 * No more hotplug events, and no more cport data for an hd that is
+	 * about to go away.
+	 */
+	usb_kill_urb(es1->svc_urb);
+	for (i = 0; i < NUM_CPORT_IN_URB; ++i)
+		usb_kill_urb(es1->cport_in_urb[i]);
+
+	/*
+	 * The modules still send to the bridge while they are torn down, so
+	 * the cport urbs have to outlive them.  es1 lives inside the hd, which
+	 * is gone once the modules are, so keep what we still have to free.
+	 */
+	udev = es1->usb_dev;
+	svc_urb = es1->svc_urb;
+	svc_buffer = es1->svc_buffer;
+	memcpy(cport_out_urb, es1->cport_out_urb, sizeof(cport_out_urb));
+	memcpy(cport_in_urb, es1->cport_in_urb, sizeof(cport_in_urb));
+	memcpy(cport_in_buffer, es1->cport_in_buffer, sizeof(cport_in_buffer));
+
+	greybus_remove_hd(es1->hd);
+	usb_set_intfdata(interface, NULL);
+
 	/* Tear down everything! */
 	for (i = 0; i < NUM_CPORT_OUT_URB; ++i) {
-		usb_kill_urb(es1->cport_out_urb[i]);
-		usb_free_urb(es1->cport_out_urb[i]);
+		usb_kill_urb(cport_out_urb[i]);
+		usb_free_urb(cport_out_urb[i]);
 	}
 
 	for (i = 0; i < NUM_CPORT_IN_URB; ++i) {
-		usb_kill_urb(es1->cport_in_urb[i]);
-		usb_free_urb(es1->cport_in_urb[i]);
-		kfree(es1->cport_in_buffer[i]);
+		usb_free_urb(cport_in_urb[i]);
+		kfree(cport_in_buffer[i]);
 	}
 
+	usb_free_urb(svc_urb);
+	kfree(svc_buffer);
+	usb_put_dev(udev);
+}
+
+/*
+ * The modules are suspended while cport data can still come in, so nothing
+ * they are waiting for is lost, but hotplug messages have to stop first so
+ * that a new module can't show up half way through.
+ */
+static int ap_suspend(struct usb_interface *interface, pm_message_t message)
+{
+	struct es1_ap_dev *es1 = usb_get_intfdata(interface);
+	int retval;
+	int i;
+
 	usb_kill_urb(es1->svc_urb);
-	usb_free_urb(es1->svc_urb);
-	usb_put_dev(es1->usb_dev);
-	kfree(es1->svc_buffer);
-	greybus_remove_hd(es1->hd);
-	usb_set_intfdata(interface, NULL);
+	gb_ap_flush();
+
+	retval = greybus_suspend_hd(es1->hd);
+	if (retval) {
+		if (usb_submit_urb(es1->svc_urb, GFP_NOIO))
+			dev_err(&interface->dev, "can't resubmit svc urb\n");
+		return retval;
+	}
+
+	for (i = 0; i < NUM_CPORT_IN_URB; ++i)
+		usb_kill_urb(es1->cport_in_urb[i]);
+	return 0;
+}
+
+/* The bridge kept its state, so everything just picks up where it was */
+static int ap_resume(struct usb_interface *interface)
+{
+	struct es1_ap_dev *es1 = usb_get_intfdata(interface);
+	int retval = 0;
+	int i;
+
+	for (i = 0; i < NUM_CPORT_IN_URB; ++i) {
+		retval = usb_submit_urb(es1->cport_in_urb[i], GFP_NOIO);
+		if (retval) {
+			dev_err(&interface->dev, "can't resubmit cport in urb %d: %d\n",
+				i, retval);
+			goto error;
+		}
+	}
+
+	/* A module that won't resume is still there, and can be unplugged */
+	if (greybus_resume_hd(es1->hd))
+		dev_err(&interface->dev, "not all modules resumed\n");
+
+	retval = usb_submit_urb(es1->svc_urb, GFP_NOIO);
+	if (retval) {
+		dev_err(&interface->dev, "can't resubmit svc urb: %d\n",
+			retval);
+		goto error;
+	}
+	return 0;
+
+error:
+	while (--i >= 0)
+		usb_kill_urb(es1->cport_in_urb[i]);
+	return retval;
 }
 
 static struct usb_driver es1_ap_driver = {
 	.name =		"es1_ap_driver",
 	.probe =	ap_probe,
 	.disconnect =	ap_disconnect,
+	.suspend =	ap_suspend,
+	.resume =	ap_resume,
 	.id_table =	id_table,
 };
 
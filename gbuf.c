@@ -15,7 +15,14 @@
 #include <linux/kref.h>
 #include <linux/device.h>
 #include <linux/slab.h>
+#include <linux/rcupdate.h>
 #include <linux/workqueue.h>
+#include <linux/mutex.h>
+#include <linux/mempool.h>
+#include <linux/vmalloc.h>
+#include <linux/timer.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
 
 #include "greybus.h"
 
@@ -39,8 +46,11 @@ static struct gbuf *__alloc_gbuf(struct greybus_module *gmod,
 		return NULL;
 
 	kref_init(&gbuf->kref);
+	/* The module has to stay around for as long as its gbufs do */
+	get_device(&gmod->dev);
 	gbuf->gmod = gmod;
 	gbuf->cport = cport;
+	INIT_LIST_HEAD(&gbuf->links);
 	INIT_WORK(&gbuf->event, cport_process_event);
 	gbuf->complete = complete;
 	gbuf->context = context;
@@ -54,7 +64,8 @@ static struct gbuf *__alloc_gbuf(struct greybus_module *gmod,
  * @gmod: greybus device that wants to allocate this
  * @cport: cport to send the data to
  * @complete: callback when the gbuf is finished with
- * @size: size of the buffer
+ * @size: size of the buffer, if it is bigger than the cport mtu the host
+ *	  controller will send it as more than one transfer
  * @gfp_mask: allocation mask
  * @context: context added to the gbuf by the driver
  *
@@ -73,6 +84,14 @@ struct gbuf *greybus_alloc_gbuf(struct greybus_module *gmod,
 	struct gbuf *gbuf;
 	int retval;
 
+	if (size > greybus_cport_message_size(gmod, cport)) {
+		dev_err(gmod->hd->parent,
+			"gbuf of %u bytes too big for cport %d (max %zu)\n",
+			size, cport->number,
+			greybus_cport_message_size(gmod, cport));
+		return NULL;
+	}
+
 	gbuf = __alloc_gbuf(gmod, cport, complete, gfp_mask, context);
 	if (!gbuf)
 		return NULL;
@@ -90,7 +109,58 @@ struct gbuf *greybus_alloc_gbuf(struct greybus_module *gmod,
 }
 EXPORT_SYMBOL_GPL(greybus_alloc_gbuf);
 
-static DEFINE_MUTEX(gbuf_mutex);
+/*
+ * State of a segmented message coming in on a cport.  @buffer is only set
+ * while we are in the middle of one, @timer throws it away if the rest of the
+ * message never shows up.
+ */
+struct gb_cport_reassembly {
+	spinlock_t lock;
+	u8 *buffer;
+	size_t length;
+	struct timer_list timer;
+};
+
+struct gb_cport_handler {
+	gbuf_complete_t handler;
+	struct gmod_cport cport;
+	struct greybus_module *gmod;
+	void *context;
+	bool atomic;		/* called from greybus_cport_in_data() */
+	struct greybus_host_device *hd;
+	atomic_t messages;
+	atomic_t queued;	/* IN gbufs still on the workqueue */
+	struct gb_cport_reassembly reassembly;
+};
+
+/*
+ * Segmented IN messages are put back together in buffers from a pool, big
+ * enough for any message, so that a burst of them can't fail because of
+ * memory fragmentation when we are in interrupt context.  That's a lot of
+ * memory to hold on to, so a host device only gets its pool once a cport
+ * handler is registered on it, and only if it takes segmented messages.
+ */
+#define GB_REASSEMBLY_POOL_SIZE		4
+#define GB_REASSEMBLY_TIMEOUT_MS	500
+
+/*
+ * Cport numbers only mean something on the host device they came in on, so
+ * every host device has its own handlers, reassembly pool and statistics.
+ * Nothing on the data path is shared between host devices, so any number
+ * of them can move data at the same time without getting in each other's
+ * way.
+ */
+struct gb_cport_handlers {
+	spinlock_t lock;	/* taken when handlers come and go */
+	struct mutex pool_mutex;	/* creating the reassembly pool */
+	mempool_t *reassembly_pool;
+	atomic_t reassembly_messages;
+	atomic_t reassembly_timeouts;
+	atomic_t reassembly_errors;
+	atomic_t unhandled;
+	struct dentry *dentry;
+	struct gb_cport_handler handler[MAX_CPORTS];
+};
 
 static void free_gbuf(struct kref *kref)
 {
@@ -99,39 +169,152 @@ static void free_gbuf(struct kref *kref)
 	/* If the direction is "out" then the host controller frees the data */
 	if (gbuf->direction == GBUF_DIRECTION_OUT) {
 		gbuf->gmod->hd->driver->free_gbuf_data(gbuf);
+	} else if (gbuf->transfer_flags & GBUF_POOL_BUFFER) {
+		mempool_free(gbuf->transfer_buffer,
+			     gbuf->gmod->hd->cport_handlers->reassembly_pool);
 	} else {
 		/* we "own" this in data, so free it ourselves */
 		kfree(gbuf->transfer_buffer);
 	}
 
+	put_device(&gbuf->gmod->dev);
 	kmem_cache_free(gbuf_head_cache, gbuf);
 }
 
 void greybus_free_gbuf(struct gbuf *gbuf)
 {
-	/* drop the reference count and get out of here */
-	kref_put_mutex(&gbuf->kref, free_gbuf, &gbuf_mutex);
+	/*
+	 * Drop the reference count and get out of here.  Atomic cport
+	 * handlers get and put gbufs in interrupt context, so no mutex.
+	 */
+	kref_put(&gbuf->kref, free_gbuf);
 }
 EXPORT_SYMBOL_GPL(greybus_free_gbuf);
 
 struct gbuf *greybus_get_gbuf(struct gbuf *gbuf)
 {
-	mutex_lock(&gbuf_mutex);
 	kref_get(&gbuf->kref);
-	mutex_unlock(&gbuf_mutex);
 	return gbuf;
 }
 EXPORT_SYMBOL_GPL(greybus_get_gbuf);
 
 int greybus_submit_gbuf(struct gbuf *gbuf, gfp_t gfp_mask)
 {
-	return gbuf->gmod->hd->driver->submit_gbuf(gbuf, gbuf->gmod->hd, gfp_mask);
+	struct greybus_module *gmod = gbuf->gmod;
+	struct greybus_host_device *hd = gmod->hd;
+	unsigned long flags;
+	int retval;
+
+	/* The gbuf can be completed and gone by the time submit returns */
+	gb_capture(hd, gbuf->cport->number, GB_CAPTURE_OUT, GB_CAPTURE_CPORT,
+		   gbuf->transfer_buffer, gbuf->transfer_buffer_length, 0);
+
+	/* Keep track of it, so it can be killed if the module goes away */
+	spin_lock_irqsave(&gmod->gbufs_lock, flags);
+	if (gmod->suspended) {
+		spin_unlock_irqrestore(&gmod->gbufs_lock, flags);
+		gb_capture(hd, gbuf->cport->number, GB_CAPTURE_OUT,
+			   GB_CAPTURE_DONE, NULL, 0, -EHOSTUNREACH);
+		return -EHOSTUNREACH;
+	}
+	gbuf->transfer_flags &= ~GBUF_KILLED;
+	list_add_tail(&gbuf->links, &gmod->gbufs);
+	spin_unlock_irqrestore(&gmod->gbufs_lock, flags);
+
+	retval = hd->driver->submit_gbuf(gbuf, hd, gfp_mask);
+	if (retval) {
+		spin_lock_irqsave(&gmod->gbufs_lock, flags);
+		list_del_init(&gbuf->links);
+		spin_unlock_irqrestore(&gmod->gbufs_lock, flags);
+		wake_up(&gmod->gbufs_wait);
+
+		gb_capture(hd, gbuf->cport->number, GB_CAPTURE_OUT,
+			   GB_CAPTURE_DONE, NULL, 0, retval);
+	}
+	return retval;
+}
+
+/*
+ * The host controller's kill_gbuf() can complete the gbuf right away, and
+ * completing takes gbufs_lock, so it's called without the lock, with a
+ * reference held to keep the gbuf around.
+ */
+static void kill_gbuf(struct gbuf *gbuf)
+{
+	gbuf->gmod->hd->driver->kill_gbuf(gbuf);
+	greybus_free_gbuf(gbuf);
 }
 
+/**
+ * greybus_kill_gbuf - cancel a submitted gbuf
+ *
+ * @gbuf: the gbuf, it still completes, with an error, like always
+ *
+ * Returns -ENOENT if it is not in flight, or -EOPNOTSUPP if the host
+ * controller can't cancel anything.
+ */
 int greybus_kill_gbuf(struct gbuf *gbuf)
 {
-	// FIXME - implement
-	return -ENOMEM;
+	struct greybus_module *gmod = gbuf->gmod;
+	unsigned long flags;
+	bool found = false;
+
+	if (!gmod->hd->driver->kill_gbuf)
+		return -EOPNOTSUPP;
+
+	spin_lock_irqsave(&gmod->gbufs_lock, flags);
+	if (!list_empty(&gbuf->links) &&
+	    !(gbuf->transfer_flags & GBUF_KILLED)) {
+		gbuf->transfer_flags |= GBUF_KILLED;
+		kref_get(&gbuf->kref);
+		found = true;
+	}
+	spin_unlock_irqrestore(&gmod->gbufs_lock, flags);
+
+	if (!found)
+		return -ENOENT;
+	kill_gbuf(gbuf);
+	return 0;
+}
+EXPORT_SYMBOL_GPL(greybus_kill_gbuf);
+
+/**
+ * greybus_kill_gbufs - cancel everything a module has in flight
+ *
+ * @gmod: the module
+ * @timeout: jiffies to wait for the host controller to give them all back
+ *
+ * Every gbuf still completes, with an error, before this returns, unless
+ * the host controller takes longer than @timeout to do so.
+ */
+int greybus_kill_gbufs(struct greybus_module *gmod, unsigned long timeout)
+{
+	struct gbuf *gbuf;
+	unsigned long flags;
+	bool found;
+
+	while (gmod->hd->driver->kill_gbuf) {
+		found = false;
+		spin_lock_irqsave(&gmod->gbufs_lock, flags);
+		list_for_each_entry(gbuf, &gmod->gbufs, links) {
+			if (gbuf->transfer_flags & GBUF_KILLED)
+				continue;
+			gbuf->transfer_flags |= GBUF_KILLED;
+			kref_get(&gbuf->kref);
+			found = true;
+			break;
+		}
+		spin_unlock_irqrestore(&gmod->gbufs_lock, flags);
+
+		if (!found)
+			break;
+		kill_gbuf(gbuf);
+	}
+
+	if (!wait_event_timeout(gmod->gbufs_wait, list_empty(&gmod->gbufs),
+				timeout))
+		return -ETIMEDOUT;
+	return 0;
 }
 
 static void cport_process_event(struct work_struct *work)
@@ -143,88 +326,427 @@ static void cport_process_event(struct work_struct *work)
 	greybus_put_gbuf(gbuf);
 }
 
-#define MAX_CPORTS	1024
-struct gb_cport_handler {
-	gbuf_complete_t handler;
-	struct gmod_cport cport;
-	struct greybus_module *gmod;
-	void *context;
-};
+/* Like cport_process_event(), for IN gbufs that went through the workqueue */
+static void cport_in_event(struct work_struct *work)
+{
+	struct gbuf *gbuf = container_of(work, struct gbuf, event);
+	struct gb_cport_handler *ch;
+
+	ch = container_of(gbuf->cport, struct gb_cport_handler, cport);
+	cport_process_event(work);
+	/* An atomic call after this one must see everything it did */
+	smp_mb__before_atomic_dec();
+	atomic_dec(&ch->queued);
+}
 
-static struct gb_cport_handler cport_handler[MAX_CPORTS];
-// FIXME - use a lock for this list of handlers, but really, for now we don't
-// need it, we don't have a dynamic system...
+/* The first handler on a host device that takes segments creates its pool */
+static int gb_reassembly_pool_create(struct greybus_host_device *hd)
+{
+	struct gb_cport_handlers *handlers = hd->cport_handlers;
+	int retval = 0;
+
+	if (!hd->segmented)
+		return 0;
+
+	mutex_lock(&handlers->pool_mutex);
+	if (!handlers->reassembly_pool) {
+		handlers->reassembly_pool =
+			mempool_create_kmalloc_pool(GB_REASSEMBLY_POOL_SIZE,
+						    GB_MESSAGE_SIZE_MAX);
+		if (!handlers->reassembly_pool)
+			retval = -ENOMEM;
+	}
+	mutex_unlock(&handlers->pool_mutex);
+	return retval;
+}
 
 int gb_register_cport_complete(struct greybus_module *gmod,
 			       gbuf_complete_t handler, int cport,
 			       void *context)
 {
-	if (cport_handler[cport].handler)
+	struct gb_cport_handlers *handlers = gmod->hd->cport_handlers;
+	struct gb_cport_handler *ch;
+	int retval;
+
+	if (cport < 0 || cport >= MAX_CPORTS)
 		return -EINVAL;
-	cport_handler[cport].context = context;
-	cport_handler[cport].gmod = gmod;
-	cport_handler[cport].cport.number = cport;
-	cport_handler[cport].handler = handler;
-	return 0;
+	ch = &handlers->handler[cport];
+
+	/* Published by the barrier below, before the handler is */
+	retval = gb_reassembly_pool_create(gmod->hd);
+	if (retval)
+		return retval;
+
+	/* Modules are added in parallel, so two could want the same cport */
+	spin_lock_irq(&handlers->lock);
+	if (ch->handler) {
+		retval = -EINVAL;
+		goto exit;
+	}
+	ch->context = context;
+	ch->gmod = gmod;
+	ch->cport.number = cport;
+	ch->atomic = false;
+	atomic_set(&ch->messages, 0);
+	/* greybus_cport_in_data() looks at the handler first, without a lock */
+	smp_wmb();
+	ch->handler = handler;
+exit:
+	spin_unlock_irq(&handlers->lock);
+	return retval;
+}
+
+/*
+ * Once this returns, greybus_cport_in_data() is done with the handler,
+ * atomic handlers have returned, and the gbufs it queued hold their own
+ * reference to the module.
+ */
+void gb_deregister_cport_complete(struct greybus_module *gmod, int cport)
+{
+	struct gb_cport_handlers *handlers = gmod->hd->cport_handlers;
+
+	if (cport < 0 || cport >= MAX_CPORTS)
+		return;
+
+	spin_lock_irq(&handlers->lock);
+	if (handlers->handler[cport].gmod == gmod)
+		handlers->handler[cport].handler = NULL;
+	spin_unlock_irq(&handlers->lock);
+	synchronize_rcu();
+}
+
+/**
+ * gb_cport_set_atomic - hand data to a cport handler as soon as it comes in
+ *
+ * @gmod: the module the handler was registered for
+ * @cport: the cport
+ * @atomic: call the handler straight from the host controller's completion,
+ *	    in interrupt context, instead of from a workqueue
+ *
+ * That saves a trip through the scheduler for every message, for handlers
+ * that care more about latency than anything else.  Until the messages
+ * that were already queued have been handled, new ones keep going through
+ * the workqueue, so the handler never sees them out of order and never
+ * runs in both places at once.
+ */
+int gb_cport_set_atomic(struct greybus_module *gmod, int cport, bool atomic)
+{
+	struct gb_cport_handlers *handlers = gmod->hd->cport_handlers;
+	int retval = 0;
+
+	if (cport < 0 || cport >= MAX_CPORTS)
+		return -EINVAL;
+
+	spin_lock_irq(&handlers->lock);
+	if (handlers->handler[cport].gmod == gmod &&
+	    handlers->handler[cport].handler)
+		handlers->handler[cport].atomic = atomic;
+	else
+		retval = -ENOENT;
+	spin_unlock_irq(&handlers->lock);
+	return retval;
+}
+
+/* Stop taking data for any of the cports of a module */
+void gb_deregister_cport_handlers(struct greybus_module *gmod)
+{
+	struct gb_cport_handlers *handlers = gmod->hd->cport_handlers;
+	int cport;
+
+	spin_lock_irq(&handlers->lock);
+	for (cport = 0; cport < MAX_CPORTS; ++cport)
+		if (handlers->handler[cport].gmod == gmod)
+			handlers->handler[cport].handler = NULL;
+	spin_unlock_irq(&handlers->lock);
+	synchronize_rcu();
+}
+
+static void cport_reassembly_timeout(unsigned long data)
+{
+	struct gb_cport_handler *ch = (struct gb_cport_handler *)data;
+	struct gb_cport_handlers *handlers = ch->hd->cport_handlers;
+	struct gb_cport_reassembly *r = &ch->reassembly;
+	unsigned long flags;
+
+	spin_lock_irqsave(&r->lock, flags);
+	if (r->buffer) {
+		mempool_free(r->buffer, handlers->reassembly_pool);
+		r->buffer = NULL;
+		atomic_inc(&handlers->reassembly_timeouts);
+		dev_err(ch->hd->parent,
+			"cport %d message timed out after %zu bytes\n",
+			ch->cport.number, r->length);
+	}
+	spin_unlock_irqrestore(&r->lock, flags);
 }
 
-void gb_deregister_cport_complete(int cport)
+/*
+ * Add a segment to the message being put together for this cport.  Returns
+ * the whole message, which now belongs to the caller, once the last segment
+ * has come in, otherwise NULL.
+ */
+static u8 *cport_reassemble(struct greybus_host_device *hd,
+			    struct gb_cport_handler *ch, u8 *data,
+			    size_t length, size_t *message_length)
 {
-	cport_handler[cport].handler = NULL;
+	struct gb_cport_handlers *handlers = hd->cport_handlers;
+	struct gb_cport_reassembly *r = &ch->reassembly;
+	unsigned long flags;
+	u8 *buffer = NULL;
+
+	spin_lock_irqsave(&r->lock, flags);
+	if (!r->buffer) {
+		r->buffer = mempool_alloc(handlers->reassembly_pool,
+					  GFP_ATOMIC);
+		if (!r->buffer) {
+			atomic_inc(&handlers->reassembly_errors);
+			goto exit;
+		}
+		r->length = 0;
+	}
+
+	if (r->length + length > GB_MESSAGE_SIZE_MAX) {
+		dev_err(hd->parent, "cport %d message too big, dropping it\n",
+			ch->cport.number);
+		del_timer(&r->timer);
+		mempool_free(r->buffer, handlers->reassembly_pool);
+		r->buffer = NULL;
+		atomic_inc(&handlers->reassembly_errors);
+		goto exit;
+	}
+
+	memcpy(&r->buffer[r->length], data, length);
+	r->length += length;
+
+	/* A full segment means there is more to come */
+	if (length >= hd->buffer_size_max) {
+		mod_timer(&r->timer,
+			  jiffies + msecs_to_jiffies(GB_REASSEMBLY_TIMEOUT_MS));
+		goto exit;
+	}
+
+	del_timer(&r->timer);
+	buffer = r->buffer;
+	*message_length = r->length;
+	r->buffer = NULL;
+	atomic_inc(&handlers->reassembly_messages);
+exit:
+	spin_unlock_irqrestore(&r->lock, flags);
+	return buffer;
 }
 
 void greybus_cport_in_data(struct greybus_host_device *hd, int cport, u8 *data,
 			   size_t length)
 {
 	struct gb_cport_handler *ch;
+	gbuf_complete_t handler;
 	struct gbuf *gbuf;
+	u8 *message = NULL;
+
+	gb_capture(hd, cport, GB_CAPTURE_IN, GB_CAPTURE_CPORT, data, length, 0);
 
 	/* first check to see if we have a cport handler for this cport */
-	ch = &cport_handler[cport];
-	if (!ch->handler) {
+	if (cport < 0 || cport >= MAX_CPORTS) {
+		dev_err(hd->parent, "Received data for invalid cport %d\n",
+			cport);
+		return;
+	}
+	ch = &hd->cport_handlers->handler[cport];
+
+	/*
+	 * Deregistering the handler waits for us to be done with it, atomic
+	 * handlers included, by which time a queued gbuf has its own
+	 * reference to the module.
+	 */
+	rcu_read_lock();
+	handler = ACCESS_ONCE(ch->handler);
+	if (!handler) {
+		atomic_inc(&hd->cport_handlers->unhandled);
 		/* Ugh, drop the data on the floor, after logging it... */
 		dev_err(hd->parent,
 			"Received data for cport %d, but no handler!\n",
 			cport);
-		return;
+		goto exit;
+	}
+	/* Its module and context were set before it */
+	smp_rmb();
+
+	/* Full segments, or the end of a segmented message, get put together */
+	if (hd->segmented &&
+	    (length >= hd->buffer_size_max || ch->reassembly.buffer)) {
+		message = cport_reassemble(hd, ch, data, length, &length);
+		if (!message)
+			goto exit;
 	}
 
-	gbuf = __alloc_gbuf(ch->gmod, &ch->cport, ch->handler, GFP_ATOMIC,
-			ch->context);
+	gbuf = __alloc_gbuf(ch->gmod, &ch->cport, handler, GFP_ATOMIC,
+			    ch->context);
 	if (!gbuf) {
 		/* Again, something bad went wrong, log it... */
 		pr_err("can't allocate gbuf???\n");
-		return;
+		if (message)
+			mempool_free(message,
+				     hd->cport_handlers->reassembly_pool);
+		goto exit;
 	}
 	gbuf->hdpriv = hd;
 	gbuf->direction = GBUF_DIRECTION_IN;
+	atomic_inc(&ch->messages);
 
-	/*
-	 * FIXME:
-	 * Very dumb copy data method for now, if this is slow (odds are it will
-	 * be, we should move to a model where the hd "owns" all buffers, but we
-	 * want something up and working first for now.
-	 */
-	gbuf->transfer_buffer = kmalloc(length, GFP_ATOMIC);
-	if (!gbuf->transfer_buffer) {
-		kfree(gbuf);
-		return;
+	if (message) {
+		gbuf->transfer_buffer = message;
+		gbuf->transfer_flags |= GBUF_POOL_BUFFER;
+	} else {
+		/*
+		 * FIXME:
+		 * Very dumb copy data method for now, if this is slow (odds are
+		 * it will be, we should move to a model where the hd "owns" all
+		 * buffers, but we want something up and working first for now.
+		 */
+		gbuf->transfer_buffer = kmalloc(length, GFP_ATOMIC);
+		if (!gbuf->transfer_buffer) {
+			put_device(&gbuf->gmod->dev);
+			kmem_cache_free(gbuf_head_cache, gbuf);
+			goto exit;
+		}
+		memcpy(gbuf->transfer_buffer, data, length);
 	}
-	memcpy(gbuf->transfer_buffer, data, length);
 	gbuf->transfer_buffer_length = length;
 	gbuf->actual_length = length;
 
-	queue_work(gbuf_workqueue, &gbuf->event);
+	/* Data for a cport comes in one at a time, so nothing else queues */
+	if (ch->atomic && !atomic_read(&ch->queued)) {
+		/* Pairs with the barrier in cport_in_event() */
+		smp_rmb();
+		cport_process_event(&gbuf->event);
+	} else {
+		atomic_inc(&ch->queued);
+		INIT_WORK(&gbuf->event, cport_in_event);
+		queue_work(gbuf_workqueue, &gbuf->event);
+	}
+
+exit:
+	rcu_read_unlock();
 }
 EXPORT_SYMBOL_GPL(greybus_cport_in_data);
 
 /* Can be called in interrupt context, do the work and get out of here */
 void greybus_gbuf_finished(struct gbuf *gbuf)
 {
+	struct greybus_module *gmod = gbuf->gmod;
+	unsigned long flags;
+
+	gb_capture(gmod->hd, gbuf->cport->number, GB_CAPTURE_OUT,
+		   GB_CAPTURE_DONE, NULL, gbuf->actual_length, gbuf->status);
+
+	spin_lock_irqsave(&gmod->gbufs_lock, flags);
+	list_del_init(&gbuf->links);
+	spin_unlock_irqrestore(&gmod->gbufs_lock, flags);
+	wake_up(&gmod->gbufs_wait);
+
 	queue_work(gbuf_workqueue, &gbuf->event);
 }
 EXPORT_SYMBOL_GPL(greybus_gbuf_finished);
 
+static int cports_show(struct seq_file *s, void *unused)
+{
+	struct greybus_host_device *hd = s->private;
+	struct gb_cport_handlers *handlers = hd->cport_handlers;
+	struct gb_cport_handler *ch;
+	int cport;
+
+	seq_printf(s, "unhandled: %d\n", atomic_read(&handlers->unhandled));
+	seq_printf(s, "reassembled: %d\n",
+		   atomic_read(&handlers->reassembly_messages));
+	seq_printf(s, "reassembly timeouts: %d\n",
+		   atomic_read(&handlers->reassembly_timeouts));
+	seq_printf(s, "reassembly errors: %d\n",
+		   atomic_read(&handlers->reassembly_errors));
+
+	seq_puts(s, "cport  module  messages\n");
+	spin_lock_irq(&handlers->lock);
+	for (cport = 0; cport < MAX_CPORTS; ++cport) {
+		ch = &handlers->handler[cport];
+		if (!ch->handler)
+			continue;
+		seq_printf(s, "%5d  %6d  %8d\n", cport, ch->gmod->module_number,
+			   atomic_read(&ch->messages));
+	}
+	spin_unlock_irq(&handlers->lock);
+	return 0;
+}
+
+static int cports_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, cports_show, inode->i_private);
+}
+
+static const struct file_operations cports_fops = {
+	.open		= cports_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
+int gb_cport_handlers_init(struct greybus_host_device *hd)
+{
+	struct gb_cport_handlers *handlers;
+	struct gb_cport_handler *ch;
+	int i;
+
+	/* Too big for kmalloc to be sure of, and never touched by hardware */
+	handlers = vzalloc(sizeof(*handlers));
+	if (!handlers)
+		return -ENOMEM;
+
+	spin_lock_init(&handlers->lock);
+	mutex_init(&handlers->pool_mutex);
+	for (i = 0; i < MAX_CPORTS; ++i) {
+		ch = &handlers->handler[i];
+		ch->hd = hd;
+		spin_lock_init(&ch->reassembly.lock);
+		setup_timer(&ch->reassembly.timer, cport_reassembly_timeout,
+			    (unsigned long)ch);
+	}
+
+	handlers->dentry = debugfs_create_file("cports", S_IRUGO, hd->dentry,
+					       hd, &cports_fops);
+	hd->cport_handlers = handlers;
+	return 0;
+}
+
+void gb_cport_handlers_exit(struct greybus_host_device *hd)
+{
+	struct gb_cport_handlers *handlers = hd->cport_handlers;
+	struct gb_cport_reassembly *r;
+	int i;
+
+	if (!handlers)
+		return;
+
+	debugfs_remove(handlers->dentry);
+
+	/* Anything still on its way to a handler may hold a pool buffer */
+	flush_workqueue(gbuf_workqueue);
+
+	for (i = 0; i < MAX_CPORTS; ++i) {
+		r = &handlers->handler[i].reassembly;
+		del_timer_sync(&r->timer);
+		if (r->buffer)
+			mempool_free(r->buffer, handlers->reassembly_pool);
+	}
+	if (handlers->reassembly_pool)
+		mempool_destroy(handlers->reassembly_pool);
+	vfree(handlers);
+	hd->cport_handlers = NULL;
+}
+
+/* Wait for every gbuf completion, and cport handler, that is queued to run */
+void gb_gbuf_flush(void)
+{
+	flush_workqueue(gbuf_workqueue);
+}
+
 int gb_gbuf_init(void)
 {
 	gbuf_workqueue = alloc_workqueue("greybus_gbuf", 0, 1);
@@ -92,7 +92,10 @@ void gb_gpio_disconnect(struct greybus_module *gmod)
 	int retval;
 
 	gb_gpio_dev = gmod->gb_gpio_dev;
+	if (!gb_gpio_dev)
+		return;
 
+	gmod->gb_gpio_dev = NULL;
 	retval = gpiochip_remove(&gb_gpio_dev->chip);
 	kfree(gb_gpio_dev);
 }
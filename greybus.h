@@ -14,6 +14,8 @@
 #include <linux/types.h>
 #include <linux/list.h>
 #include <linux/device.h>
+#include <linux/idr.h>
+#include <linux/wait.h>
 #include <linux/module.h>
 #include "greybus_id.h"
 #include "greybus_manifest.h"
@@ -70,7 +72,10 @@
     callback function to be called for when a gbuf is received from a specific
     cport and device.  That callback will be made in user context with a gbuf
     when it is received.  To stop receiving messages, call
-    gb_deregister_cport_complete() for a specific cport.
+    gb_deregister_cport_complete() for a specific cport.  Cport numbers are
+    only unique within a host device, each one keeps its own handlers.  A
+    handler that can run in interrupt context can ask, with
+    gb_cport_set_atomic(), to be called as soon as the data comes in.
 
 
   Greybus Host controller drivers need to provide
@@ -92,6 +97,16 @@
     the host controller function send_svc_msg is called
   Receive gbuf messages
     the host controller driver must call greybus_cport_in_data() with the data
+
+  If the host controller driver sets segmented in the host device, which it
+  only does if the other end of the link said it knows about them, messages
+  bigger than the host buffer_size_max are split into segments.  Every
+  segment but the last one is exactly buffer_size_max bytes big, the last
+  one is shorter (and empty if the message is an exact multiple of
+  buffer_size_max).  The host controller driver is responsible for sending
+  an OUT gbuf as segments, the core puts IN segments back together before
+  handing the message to the cport handler.  Without it every transfer is a
+  whole message, and no message can be bigger than buffer_size_max.
   Reveive SVC messages from the hardware
     The host controller driver must call gb_new_ap_msg
 
@@ -103,7 +118,7 @@ struct gbuf;
 
 struct gmod_cport {
 	u16	number;
-	u16	size;
+	u16	size;	/* largest message the module will take, 0 == any */
 	u8	speed;	// valid???
 	// FIXME, what else?
 };
@@ -111,7 +126,7 @@ struct gmod_cport {
 struct gmod_string {
 	u16	length;
 	u8	id;
-	u8	string[0];
+	u8	*string;	/* NUL terminated, after the module's cports */
 };
 
 typedef void (*gbuf_complete_t)(struct gbuf *gbuf);
@@ -135,12 +150,16 @@ struct gbuf {
 	void *context;
 	struct work_struct event;
 	gbuf_complete_t complete;
+
+	struct list_head links;		/* in gmod->gbufs while submitted */
 };
 
 /*
  * gbuf->transfer_flags
  */
 #define GBUF_FREE_BUFFER	BIT(0)	/* Free the transfer buffer with the gbuf */
+#define GBUF_POOL_BUFFER	BIT(1)	/* Transfer buffer is from the reassembly pool */
+#define GBUF_KILLED		BIT(2)	/* kill_gbuf() was called for this submission */
 
 /* For SP1 hardware, we are going to "hardcode" each device to have all logical
  * blocks in order to be able to address them as one unified "unit".  Then
@@ -158,9 +177,42 @@ struct gb_sdio_host;
 struct gb_tty;
 struct gb_usb_device;
 struct gb_battery;
+struct gb_capture;
+struct gb_cport_handlers;
+struct greybus_id_index;
 struct greybus_host_device;
 struct svc_msg;
 
+/*
+ * The stages of bringing up a module, from the SVC saying it's there until
+ * its sub devices are usable.  A stage the module didn't need stays 0.
+ */
+enum gb_hotplug_stage {
+	GB_HOTPLUG_RECEIVED,	/* gb_new_ap_msg() got the hotplug message */
+	GB_HOTPLUG_PROCESSED,	/* its lane got around to handling it */
+	GB_HOTPLUG_MANIFEST,	/* manifest parsed, or found in the cache */
+	GB_HOTPLUG_I2C,		/* a sub device was probed */
+	GB_HOTPLUG_GPIO,
+	GB_HOTPLUG_SDIO,
+	GB_HOTPLUG_UART,
+	GB_HOTPLUG_READY,	/* the module was added */
+	GB_HOTPLUG_STAGES,
+};
+
+struct gb_hotplug_timing {
+	s64 stage_ns[GB_HOTPLUG_STAGES];	/* ktime_get(), in ns */
+};
+
+/* A histogram of latencies, bucket n counts those under 2^n us */
+#define GB_LATENCY_BUCKETS	24
+
+struct gb_latency {
+	unsigned long count;
+	s64 total_ns;
+	s64 max_ns;
+	u32 buckets[GB_LATENCY_BUCKETS];
+};
+
 /* Greybus "Host driver" structure, needed by a host controller driver to be
  * able to handle both SVC control as well as "real" greybus messages
  */
@@ -173,51 +225,168 @@ struct greybus_host_driver {
 			    struct greybus_host_device *hd);
 	int (*submit_gbuf)(struct gbuf *gbuf, struct greybus_host_device *hd,
 			   gfp_t gfp_mask);
+	/* Optional, the gbuf still has to complete, with an error */
+	void (*kill_gbuf)(struct gbuf *gbuf);
 };
 
 struct greybus_host_device {
 	struct kref kref;
 	struct device *parent;
 	const struct greybus_host_driver *driver;
+	size_t buffer_size_max;	/* largest transfer the host can move */
+	bool segmented;		/* messages can take more than one transfer */
+	int id;
+	struct dentry *dentry;
+	struct gb_capture *capture;
+	struct gb_cport_handlers *cport_handlers;	/* see gbuf.c */
+
+	/* How long it took to enumerate the modules, see ap.c */
+	ktime_t created;
+	atomic_t hotplugs_pending;
+	s64 ready_ns;
+
+	/* Modules that are plugged into this host device, by module id */
+	struct idr modules;
+	struct mutex modules_lock;
+	bool removing;		/* no more SVC messages, see ap.c */
+
+	/* How long the last hotplug of every module id took, see core.c */
+	struct gb_hotplug_timing *hotplug_timing;
+
+	/* How long modules took to come and go */
+	spinlock_t latency_lock;
+	struct gb_latency plug_latency;
+	struct gb_latency unplug_latency;
+
+	/* How long modules took to suspend and resume, see core.c */
+	struct gb_latency suspend_latency;
+	struct gb_latency resume_latency;
+	s64 suspend_ns;			/* all modules, the last time */
+	s64 resume_ns;
 
 	/* Private data for the host driver */
 	unsigned long hd_priv[0] __attribute__ ((aligned(sizeof(s64))));
 };
 
 struct greybus_host_device *greybus_create_hd(struct greybus_host_driver *host_driver,
-					      struct device *parent);
+					      struct device *parent,
+					      size_t buffer_size_max);
 void greybus_remove_hd(struct greybus_host_device *hd);
+int greybus_suspend_hd(struct greybus_host_device *hd);
+int greybus_resume_hd(struct greybus_host_device *hd);
 void greybus_cport_in_data(struct greybus_host_device *hd, int cport, u8 *data,
 			   size_t length);
 void greybus_gbuf_finished(struct gbuf *gbuf);
 
+struct seq_file;
+void gb_hotplug_start(struct greybus_host_device *hd, u8 module_id,
+		      ktime_t received);
+void gb_latency_get(struct greybus_host_device *hd, struct gb_latency *plug,
+		    struct gb_latency *unplug);
+void gb_latency_sub(struct gb_latency *latency,
+		    const struct gb_latency *before);
+void gb_latency_show(struct seq_file *s, const char *name,
+		     const struct gb_latency *latency);
 
-/* Increase these values if needed */
-#define MAX_CPORTS_PER_MODULE	10
-#define MAX_STRINGS_PER_MODULE	10
 
-struct greybus_module {
-	struct device dev;
-	u16 module_number;
+/*
+ * What a module's manifest says.  Modules with identical manifests share
+ * one of these, so it never changes once it has been parsed.
+ */
+struct gb_manifest {
+	struct kref kref;
+	struct hlist_node node;		/* in the manifest cache */
+	struct list_head lru;
+	u32 hash;
+	u8 *raw;			/* the manifest, without its serial number */
+	size_t raw_size;
+
 	struct greybus_descriptor_function function;
+	u32 function_classes;		/* BIT(class) of every function */
 	struct greybus_descriptor_module_id module_id;
-	struct greybus_descriptor_serial_number serial_number;
 	int num_cports;
 	int num_strings;
-	struct gmod_cport *cport[MAX_CPORTS_PER_MODULE];
-	struct gmod_string *string[MAX_STRINGS_PER_MODULE];
+	struct gmod_cport *cport;	/* num_cports of them */
+	struct gmod_string *string;	/* num_strings of them */
+	int num_string_ids;
+	struct gmod_string **string_by_id;	/* NULL if no string has the id */
+};
+
+struct gb_manifest *gb_manifest_parse(struct device *parent, u8 *data,
+				      int size);
+struct gb_manifest *gb_manifest_get(struct device *parent, u8 *data, int size,
+			struct greybus_descriptor_serial_number *serial_number);
+void gb_manifest_put(struct gb_manifest *manifest);
+int gb_manifest_init(void);
+void gb_manifest_exit(void);
+
+struct greybus_module {
+	struct device dev;
+	u16 module_number;
+	struct gb_manifest *manifest;	/* shared, see manifest.c */
+	struct greybus_descriptor_serial_number serial_number;
 
 	struct greybus_host_device *hd;
 
+	/* gbufs submitted, but not completed yet */
+	spinlock_t gbufs_lock;
+	struct list_head gbufs;
+	wait_queue_head_t gbufs_wait;
+	bool suspended;		/* no gbufs can be submitted */
+
+	/* The last suspend and resume, see core.c */
+	int pm_status;
+	s64 suspend_ns;
+	s64 resume_ns;
+
 	struct gb_i2c_device *gb_i2c_dev;
 	struct gb_gpio_device *gb_gpio_dev;
 	struct gb_sdio_host *gb_sdio_host;
 	struct gb_tty *gb_tty;
 	struct gb_usb_device *gb_usb_dev;
+
+	/*
+	 * The battery comes and goes with the SVC's power messages, not the
+	 * manifest, so it has to be kept from showing up while the module
+	 * is going away, see battery-gb.c.
+	 */
+	struct mutex battery_lock;
+	bool removing;		/* no battery from here on */
 	struct gb_battery *gb_battery;
 };
 #define to_greybus_module(d) container_of(d, struct greybus_module, dev)
 
+/* Cport numbers a host device can have handlers for */
+#define MAX_CPORTS	1024
+
+/* Cport sizes in the manifest are 16 bits, so a message can't be any bigger */
+#define GB_MESSAGE_SIZE_MAX	U16_MAX
+
+/*
+ * The MTU of a cport is negotiated from what the module asked for in its
+ * manifest and what the host controller is able to transfer at once.  When
+ * messages are segmented a full transfer means more are coming, so the
+ * biggest message that goes in one is a byte shorter.
+ */
+static inline size_t greybus_cport_mtu(struct greybus_module *gmod,
+				       struct gmod_cport *cport)
+{
+	struct greybus_host_device *hd = gmod->hd;
+
+	return min_not_zero((size_t)cport->size,
+			    hd->buffer_size_max - (hd->segmented ? 1 : 0));
+}
+
+/* The largest message a cport can take, which may take more than one transfer */
+static inline size_t greybus_cport_message_size(struct greybus_module *gmod,
+						struct gmod_cport *cport)
+{
+	if (!gmod->hd->segmented)
+		return min_not_zero((size_t)cport->size,
+				    gmod->hd->buffer_size_max);
+	return cport->size ? cport->size : GB_MESSAGE_SIZE_MAX;
+}
+
 struct gbuf *greybus_alloc_gbuf(struct greybus_module *gmod,
 				struct gmod_cport *cport,
 				gbuf_complete_t complete,
@@ -230,6 +399,7 @@ struct gbuf *greybus_get_gbuf(struct gbuf *gbuf);
 
 int greybus_submit_gbuf(struct gbuf *gbuf, gfp_t mem_flags);
 int greybus_kill_gbuf(struct gbuf *gbuf);
+int greybus_kill_gbufs(struct greybus_module *gmod, unsigned long timeout);
 
 
 struct greybus_driver {
@@ -243,6 +413,7 @@ struct greybus_driver {
 	int (*resume)(struct greybus_module *gmod);
 
 	const struct greybus_module_id *id_table;
+	struct greybus_id_index *id_index;	/* id_table, hashed */
 
 	struct device_driver driver;
 };
@@ -259,6 +430,13 @@ static inline void *greybus_get_drvdata(struct greybus_module *gmod)
 }
 
 /* Don't call these directly, use the module_greybus_driver() macro instead */
+struct greybus_id_index *greybus_id_index_create(
+		const struct greybus_module_id *id_table);
+void greybus_id_index_destroy(struct greybus_id_index *index);
+const struct greybus_module_id *greybus_id_index_match(
+		const struct greybus_id_index *index, u16 vendor, u16 product,
+		u64 serial_number);
+
 int greybus_register_driver(struct greybus_driver *driver,
 			    struct module *module, const char *mod_name);
 void greybus_deregister(struct greybus_driver *driver);
@@ -282,26 +460,56 @@ int greybus_disabled(void);
 
 void greybus_remove_device(struct greybus_module *gmod);
 
-const u8 *greybus_string(struct greybus_module *gmod, int id);
+const u8 *greybus_string(struct greybus_module *gmod, int id,
+			 size_t *length);
+struct gmod_cport *greybus_cport(struct greybus_module *gmod, u16 number);
 
 /* Internal functions to gb module, move to internal .h file eventually. */
 
+struct greybus_module *gb_module_find(struct greybus_host_device *hd,
+				      u8 module_id);
 void gb_add_module(struct greybus_host_device *hd, u8 module_id,
-		   u8 *data, int size);
+		   struct gb_manifest *manifest,
+		   struct greybus_descriptor_serial_number *serial_number);
 void gb_remove_module(struct greybus_host_device *hd, u8 module_id);
 
 int gb_new_ap_msg(u8 *data, int length, struct greybus_host_device *hd);
+/* Needs svc_msg.h */
+#define GB_SVC_FUNCTIONS	(SVC_FUNCTION_SUSPEND + 1)
+int gb_svc_msg_check(struct device *parent, const u8 *data, size_t size);
+const char *gb_svc_function_name(u8 id);
+void gb_ap_flush(void);
+void gb_ap_stop(struct greybus_host_device *hd);
 int gb_ap_init(void);
 void gb_ap_exit(void);
 int gb_debugfs_init(void);
 void gb_debugfs_cleanup(void);
+struct dentry *gb_debugfs_get(void);
 int gb_gbuf_init(void);
 void gb_gbuf_exit(void);
+void gb_gbuf_flush(void);
+int gb_cport_handlers_init(struct greybus_host_device *hd);
+void gb_cport_handlers_exit(struct greybus_host_device *hd);
+
+/* What gb_capture() records */
+#define GB_CAPTURE_IN		0	/* module to AP */
+#define GB_CAPTURE_OUT		1	/* AP to module */
+
+#define GB_CAPTURE_CPORT	0	/* cport data */
+#define GB_CAPTURE_SVC		1	/* SVC message */
+#define GB_CAPTURE_DONE		2	/* an outgoing gbuf completed */
+
+int gb_capture_init(struct greybus_host_device *hd);
+void gb_capture_exit(struct greybus_host_device *hd);
+void gb_capture(struct greybus_host_device *hd, u16 cport, u8 direction,
+		u8 type, const void *data, size_t size, int status);
 
 int gb_register_cport_complete(struct greybus_module *gmod,
 			       gbuf_complete_t handler, int cport,
 			       void *context);
-void gb_deregister_cport_complete(int cport);
+void gb_deregister_cport_complete(struct greybus_module *gmod, int cport);
+int gb_cport_set_atomic(struct greybus_module *gmod, int cport, bool atomic);
+void gb_deregister_cport_handlers(struct greybus_module *gmod);
 
 extern const struct attribute_group *greybus_module_groups[];
 
@@ -312,14 +520,23 @@ extern const struct attribute_group *greybus_module_groups[];
  */
 int gb_i2c_probe(struct greybus_module *gmod, const struct greybus_module_id *id);
 void gb_i2c_disconnect(struct greybus_module *gmod);
+int gb_i2c_suspend(struct greybus_module *gmod);
+void gb_i2c_resume(struct greybus_module *gmod);
 int gb_gpio_probe(struct greybus_module *gmod, const struct greybus_module_id *id);
 void gb_gpio_disconnect(struct greybus_module *gmod);
 int gb_sdio_probe(struct greybus_module *gmod, const struct greybus_module_id *id);
 void gb_sdio_disconnect(struct greybus_module *gmod);
 int gb_tty_probe(struct greybus_module *gmod, const struct greybus_module_id *id);
 void gb_tty_disconnect(struct greybus_module *gmod);
+int gb_tty_suspend(struct greybus_module *gmod);
+void gb_tty_resume(struct greybus_module *gmod);
 int gb_battery_probe(struct greybus_module *gmod, const struct greybus_module_id *id);
 void gb_battery_disconnect(struct greybus_module *gmod);
+struct svc_function_power_battery_status;
+void gb_battery_status(struct greybus_module *gmod,
+		       struct svc_function_power_battery_status *status);
+int gb_svc_battery_status_request(struct greybus_host_device *hd,
+				  u8 module_id);
 
 int gb_tty_init(void);
 void gb_tty_exit(void);
@@ -9,12 +9,100 @@
 #include <linux/kernel.h>
 #include <linux/module.h>
 #include <linux/slab.h>
+#include <linux/completion.h>
 #include <linux/i2c.h>
 #include "greybus.h"
 
+/*
+ * Everything on the cport starts with this header.  The module answers each
+ * request with a message of the same type, with GB_I2C_MSG_RESPONSE set, and
+ * the same id.
+ */
+#pragma pack(push, 1)
+struct gb_i2c_msg_header {
+	__u8	type;		/* enum gb_i2c_msg_type */
+	__u8	id;
+	__le16	size;		/* of what follows the header */
+};
+
+/* Its answer to GB_I2C_MSG_FUNCTIONALITY, in the same bits as I2C_FUNC_* */
+struct gb_i2c_functionality {
+	__le32	functionality;
+};
+
+/*
+ * A whole i2c_msg array in one go: the ops, then what the ones that write
+ * have to write, one after the other.  Flags are the same bits as in
+ * struct i2c_msg.
+ */
+struct gb_i2c_transfer_op {
+	__le16	addr;
+	__le16	flags;
+	__le16	size;
+};
+
+struct gb_i2c_transfer_request {
+	__le16	op_count;
+	struct gb_i2c_transfer_op ops[0];
+};
+
+/* What the ops that read got, one after the other, if it all went well */
+struct gb_i2c_transfer_response {
+	__u8	status;		/* enum gb_i2c_status */
+	__u8	data[0];
+};
+#pragma pack(pop)
+
+enum gb_i2c_msg_type {
+	GB_I2C_MSG_INVALID	= 0x00,
+	GB_I2C_MSG_FUNCTIONALITY = 0x01,
+	GB_I2C_MSG_TRANSFER	= 0x02,
+	GB_I2C_MSG_RESPONSE	= 0x80,
+};
+
+enum gb_i2c_status {
+	GB_I2C_STATUS_SUCCESS	= 0x00,
+	GB_I2C_STATUS_NAK	= 0x01,	/* nobody at that address */
+	GB_I2C_STATUS_ARB_LOST	= 0x02,
+	GB_I2C_STATUS_TIMEOUT	= 0x03,
+	GB_I2C_STATUS_BUS_ERROR	= 0x04,
+};
+
+/* What we can pass on from the module, SMBus is done on top of plain i2c */
+#define GB_I2C_FUNC_MASK	(I2C_FUNC_I2C | I2C_FUNC_10BIT_ADDR | \
+				 I2C_FUNC_PROTOCOL_MANGLING | \
+				 I2C_FUNC_NOSTART | \
+				 I2C_FUNC_SMBUS_READ_BLOCK_DATA)
+
+/*
+ * A module that doesn't answer the functionality request doesn't talk the
+ * protocol, so it doesn't get an adapter, and it doesn't hold up probe long.
+ */
+#define GB_I2C_FUNC_TIMEOUT_MS		100
+
 struct gb_i2c_device {
 	struct i2c_adapter *adapter;
 	struct greybus_module *gmod;
+	struct gmod_cport *cport;
+	u32 functionality;	/* I2C_FUNC_* */
+
+	/*
+	 * The i2c core hands us one transfer at a time, so there is only ever
+	 * one request, in @request, waiting for its response.  @lock covers
+	 * the rest, the response comes in in interrupt context.
+	 */
+	struct gbuf *request;
+	size_t request_size;	/* the most @request can take */
+	spinlock_t lock;
+	u8 type;		/* of the request in flight */
+	u8 id;
+	bool pending;		/* still waiting for the response */
+	int result;
+	struct i2c_msg *msgs;	/* where the response's data goes */
+	int num;
+	struct completion response;
+	struct completion sent;	/* @request is back from the host */
+	bool suspended;		/* under the adapter lock, see gb_i2c_suspend() */
 };
 
 static const struct greybus_module_id id_table[] = {
@@ -22,66 +110,302 @@ static const struct greybus_module_id id_table[] = {
 	{ },	/* terminating NULL entry */
 };
 
-/* We BETTER be able to do SMBUS protocl calls, otherwise we are bit-banging the
- * slowest thing possible over the fastest bus possible, crazy...
- * FIXME - research this, for now just assume we can
+static int gb_i2c_status_errno(u8 status)
+{
+	switch (status) {
+	case GB_I2C_STATUS_NAK:
+		return -ENXIO;
+	case GB_I2C_STATUS_ARB_LOST:
+		return -EAGAIN;	/* the i2c core retries these */
+	case GB_I2C_STATUS_TIMEOUT:
+		return -ETIMEDOUT;
+	case GB_I2C_STATUS_BUS_ERROR:
+	default:
+		return -EIO;
+	}
+}
+
+/* Hand what the reads got to their i2c_msgs, called with the lock held */
+static int gb_i2c_transfer_response(struct gb_i2c_device *gb_i2c_dev,
+				    u8 *payload, size_t size)
+{
+	struct gb_i2c_transfer_response *response = (void *)payload;
+	struct i2c_msg *msg;
+	u8 *data;
+	size_t len;
+	int i;
+
+	if (size < sizeof(*response))
+		return -EPROTO;
+	if (response->status != GB_I2C_STATUS_SUCCESS)
+		return gb_i2c_status_errno(response->status);
+
+	data = response->data;
+	size -= sizeof(*response);
+	for (i = 0; i < gb_i2c_dev->num; ++i) {
+		msg = &gb_i2c_dev->msgs[i];
+		if (!(msg->flags & I2C_M_RD))
+			continue;
+
+		/* SMBus block reads, the first byte says how many follow */
+		len = msg->len;
+		if (msg->flags & I2C_M_RECV_LEN) {
+			if (!size || data[0] > I2C_SMBUS_BLOCK_MAX)
+				return -EPROTO;
+			len += data[0];
+		}
+		if (len > size)
+			return -EPROTO;
+
+		memcpy(msg->buf, data, len);
+		msg->len = len;
+		data += len;
+		size -= len;
+	}
+	return gb_i2c_dev->num;
+}
+
+/* Runs as soon as a response comes in, see gb_cport_set_atomic() */
+static void gb_i2c_response(struct gbuf *gbuf)
+{
+	struct gb_i2c_device *gb_i2c_dev = gbuf->context;
+	struct gb_i2c_msg_header *header = gbuf->transfer_buffer;
+	struct gb_i2c_functionality *functionality;
+	unsigned long flags;
+	size_t size;
+	u8 *payload;
+
+	if (gbuf->actual_length < sizeof(*header))
+		return;
+	size = le16_to_cpu(header->size);
+	if (size > gbuf->actual_length - sizeof(*header)) {
+		dev_err(&gb_i2c_dev->gmod->dev, "response of %u bytes says %zu\n",
+			gbuf->actual_length, size);
+		return;
+	}
+	payload = (u8 *)(header + 1);
+
+	spin_lock_irqsave(&gb_i2c_dev->lock, flags);
+	/* Anything else is an answer we already gave up waiting for */
+	if (!gb_i2c_dev->pending || header->id != gb_i2c_dev->id ||
+	    header->type != (gb_i2c_dev->type | GB_I2C_MSG_RESPONSE)) {
+		spin_unlock_irqrestore(&gb_i2c_dev->lock, flags);
+		return;
+	}
+
+	switch (gb_i2c_dev->type) {
+	case GB_I2C_MSG_FUNCTIONALITY:
+		functionality = (void *)payload;
+		if (size < sizeof(*functionality)) {
+			gb_i2c_dev->result = -EPROTO;
+			break;
+		}
+		gb_i2c_dev->functionality =
+			le32_to_cpu(functionality->functionality);
+		gb_i2c_dev->result = 0;
+		break;
+	case GB_I2C_MSG_TRANSFER:
+		gb_i2c_dev->result = gb_i2c_transfer_response(gb_i2c_dev,
+							      payload, size);
+		break;
+	}
+	gb_i2c_dev->pending = false;
+	complete(&gb_i2c_dev->response);
+	spin_unlock_irqrestore(&gb_i2c_dev->lock, flags);
+}
+
+static void gb_i2c_request_complete(struct gbuf *gbuf)
+{
+	struct gb_i2c_device *gb_i2c_dev = gbuf->context;
+	unsigned long flags;
+
+	/* No use waiting for the answer to something that never went out */
+	if (gbuf->status) {
+		spin_lock_irqsave(&gb_i2c_dev->lock, flags);
+		if (gb_i2c_dev->pending) {
+			gb_i2c_dev->result = gbuf->status;
+			gb_i2c_dev->pending = false;
+			complete(&gb_i2c_dev->response);
+		}
+		spin_unlock_irqrestore(&gb_i2c_dev->lock, flags);
+	}
+	complete(&gb_i2c_dev->sent);
+}
+
+/*
+ * Send what's in the request gbuf, @size bytes after the header, and wait
+ * up to @timeout for the response.  Returns whatever the response handler
+ * made of it.
  */
+static int gb_i2c_request(struct gb_i2c_device *gb_i2c_dev, u8 type,
+			  size_t size, struct i2c_msg *msgs, int num,
+			  unsigned long timeout)
+{
+	struct gbuf *gbuf = gb_i2c_dev->request;
+	struct gb_i2c_msg_header *header = gbuf->transfer_buffer;
+	struct greybus_module *gmod = gb_i2c_dev->gmod;
+	int retval;
+
+	header->type = type;
+	header->size = cpu_to_le16(size);
+	gbuf->transfer_buffer_length = sizeof(*header) + size;
+
+	spin_lock_irq(&gb_i2c_dev->lock);
+	header->id = ++gb_i2c_dev->id;
+	gb_i2c_dev->type = type;
+	gb_i2c_dev->msgs = msgs;
+	gb_i2c_dev->num = num;
+	gb_i2c_dev->result = -ETIMEDOUT;
+	gb_i2c_dev->pending = true;
+	/* A response that came in too late last time mustn't count */
+	init_completion(&gb_i2c_dev->response);
+	spin_unlock_irq(&gb_i2c_dev->lock);
+
+	/* Completing the gbuf drops a reference, keep ours */
+	greybus_get_gbuf(gbuf);
+	retval = greybus_submit_gbuf(gbuf, GFP_KERNEL);
+	if (retval) {
+		greybus_put_gbuf(gbuf);
+		spin_lock_irq(&gb_i2c_dev->lock);
+		gb_i2c_dev->pending = false;
+		spin_unlock_irq(&gb_i2c_dev->lock);
+		return retval;
+	}
+
+	wait_for_completion_timeout(&gb_i2c_dev->response, timeout);
+
+	spin_lock_irq(&gb_i2c_dev->lock);
+	gb_i2c_dev->pending = false;
+	retval = gb_i2c_dev->result;
+	spin_unlock_irq(&gb_i2c_dev->lock);
+
+	if (retval == -ETIMEDOUT)
+		dev_err(&gmod->dev, "no response to request type %d\n", type);
 
+	/* It goes out again next time, so it has to be back by then */
+	if (!try_wait_for_completion(&gb_i2c_dev->sent)) {
+		greybus_kill_gbuf(gbuf);
+		wait_for_completion(&gb_i2c_dev->sent);
+	}
+	return retval;
+}
 
-static s32 i2c_gb_access(struct i2c_adapter *adap, u16 addr,
-			 unsigned short flags, char read_write, u8 command,
-			 int size, union i2c_smbus_data *data)
+/*
+ * The whole array goes to the module in one request, and everything that
+ * was read comes back in one response, so a register read, or anything the
+ * i2c core makes out of an SMBus call, costs one round trip.
+ */
+static int i2c_gb_master_xfer(struct i2c_adapter *adap, struct i2c_msg *msgs,
+			      int num)
 {
-	struct gb_i2c_device *gb_i2c_dev;
-	struct greybus_module *gmod;
+	struct gb_i2c_device *gb_i2c_dev = i2c_get_adapdata(adap);
+	struct gb_i2c_msg_header *header = gb_i2c_dev->request->transfer_buffer;
+	struct gb_i2c_transfer_request *request = (void *)(header + 1);
+	struct gb_i2c_transfer_op *op;
+	size_t response_size;
+	size_t size;
+	u8 *data;
+	int i;
 
-	gb_i2c_dev = i2c_get_adapdata(adap);
-	gmod = gb_i2c_dev->gmod;
-
-	// FIXME - do the actual work of sending a i2c message here...
-	switch (size) {
-	case I2C_SMBUS_QUICK:
-	case I2C_SMBUS_BYTE:
-	case I2C_SMBUS_BYTE_DATA:
-	case I2C_SMBUS_WORD_DATA:
-	case I2C_SMBUS_PROC_CALL:
-	case I2C_SMBUS_BLOCK_DATA:
-	case I2C_SMBUS_I2C_BLOCK_BROKEN:
-	case I2C_SMBUS_BLOCK_PROC_CALL:
-	case I2C_SMBUS_I2C_BLOCK_DATA:
-	default:
-		dev_err(&gmod->dev, "Unsupported transaction %d\n", size);
+	/* The i2c core holds the adapter lock, so this can't change under us */
+	if (gb_i2c_dev->suspended)
+		return -ESHUTDOWN;
+
+	size = sizeof(*request) + num * sizeof(*op);
+	response_size = sizeof(struct gb_i2c_transfer_response);
+	for (i = 0; i < num; ++i) {
+		if (!(msgs[i].flags & I2C_M_RD))
+			size += msgs[i].len;
+		else if (msgs[i].flags & I2C_M_RECV_LEN)
+			response_size += msgs[i].len + I2C_SMBUS_BLOCK_MAX;
+		else
+			response_size += msgs[i].len;
+	}
+	if (sizeof(*header) + size > gb_i2c_dev->request_size ||
+	    sizeof(*header) + response_size >
+	    greybus_cport_message_size(gb_i2c_dev->gmod, gb_i2c_dev->cport)) {
+		dev_err(&gb_i2c_dev->gmod->dev,
+			"transfer of %d messages is too big\n", num);
 		return -EOPNOTSUPP;
 	}
 
-	return 0;
+	request->op_count = cpu_to_le16(num);
+	data = (u8 *)&request->ops[num];
+	for (i = 0; i < num; ++i) {
+		op = &request->ops[i];
+		op->addr = cpu_to_le16(msgs[i].addr);
+		op->flags = cpu_to_le16(msgs[i].flags);
+		op->size = cpu_to_le16(msgs[i].len);
+		if (!(msgs[i].flags & I2C_M_RD)) {
+			memcpy(data, msgs[i].buf, msgs[i].len);
+			data += msgs[i].len;
+		}
+	}
+
+	return gb_i2c_request(gb_i2c_dev, GB_I2C_MSG_TRANSFER, size, msgs, num,
+			      adap->timeout);
 }
 
 static u32 i2c_gb_func(struct i2c_adapter *adapter)
 {
-	// FIXME - someone figure out what we really can support, for now just guess...
-	return I2C_FUNC_SMBUS_QUICK |
-		I2C_FUNC_SMBUS_BYTE |
-		I2C_FUNC_SMBUS_BYTE_DATA |
-		I2C_FUNC_SMBUS_WORD_DATA |
-		I2C_FUNC_SMBUS_BLOCK_DATA |
-		I2C_FUNC_SMBUS_WRITE_I2C_BLOCK |
-		I2C_FUNC_SMBUS_PEC |
-		I2C_FUNC_SMBUS_READ_I2C_BLOCK;
+	struct gb_i2c_device *gb_i2c_dev = i2c_get_adapdata(adapter);
+
+	return gb_i2c_dev->functionality;
 }
 
-static const struct i2c_algorithm smbus_algorithm = {
-	.smbus_xfer	= i2c_gb_access,
+/* No smbus_xfer, the i2c core turns SMBus calls into master_xfer ones */
+static const struct i2c_algorithm i2c_gb_algorithm = {
+	.master_xfer	= i2c_gb_master_xfer,
 	.functionality	= i2c_gb_func,
 };
 
+/* Ask the module what it can do, before anyone gets to use the adapter */
+static int gb_i2c_functionality(struct gb_i2c_device *gb_i2c_dev)
+{
+	struct greybus_module *gmod = gb_i2c_dev->gmod;
+	int retval;
+
+	retval = gb_i2c_request(gb_i2c_dev, GB_I2C_MSG_FUNCTIONALITY, 0,
+				NULL, 0,
+				msecs_to_jiffies(GB_I2C_FUNC_TIMEOUT_MS));
+	if (retval) {
+		dev_err(&gmod->dev, "error %d asking what i2c it can do\n",
+			retval);
+		return retval;
+	}
+
+	gb_i2c_dev->functionality &= GB_I2C_FUNC_MASK;
+	if (!(gb_i2c_dev->functionality & I2C_FUNC_I2C)) {
+		dev_err(&gmod->dev, "module can't do plain i2c transfers\n");
+		return -ENODEV;
+	}
+	gb_i2c_dev->functionality |= I2C_FUNC_SMBUS_EMUL;
+	return 0;
+}
+
 int gb_i2c_probe(struct greybus_module *gmod,
 		 const struct greybus_module_id *id)
 {
 	struct gb_i2c_device *gb_i2c_dev;
 	struct i2c_adapter *adapter;
+	struct gmod_cport *cport;
+	size_t size;
 	int retval;
 
+	cport = greybus_cport(gmod, le16_to_cpu(gmod->manifest->function.cport));
+	if (!cport) {
+		dev_err(&gmod->dev, "no cport for i2c\n");
+		return -ENODEV;
+	}
+
+	size = greybus_cport_mtu(gmod, cport);
+	if (size < sizeof(struct gb_i2c_msg_header) +
+		   sizeof(struct gb_i2c_functionality)) {
+		dev_err(&gmod->dev, "cport %d mtu of %zu is too small\n",
+			cport->number, size);
+		return -EINVAL;
+	}
+
 	gb_i2c_dev = kzalloc(sizeof(*gb_i2c_dev), GFP_KERNEL);
 	if (!gb_i2c_dev)
 		return -ENOMEM;
@@ -91,24 +415,57 @@ int gb_i2c_probe(struct greybus_module *gmod,
 		return -ENOMEM;
 	}
 
+	gb_i2c_dev->gmod = gmod;
+	gb_i2c_dev->cport = cport;
+	gb_i2c_dev->adapter = adapter;
+	gb_i2c_dev->request_size = size;
+	spin_lock_init(&gb_i2c_dev->lock);
+	init_completion(&gb_i2c_dev->response);
+	init_completion(&gb_i2c_dev->sent);
+
 	i2c_set_adapdata(adapter, gb_i2c_dev);
 	adapter->owner = THIS_MODULE;
 	adapter->class = I2C_CLASS_HWMON | I2C_CLASS_SPD;
-	adapter->algo = &smbus_algorithm;
+	adapter->algo = &i2c_gb_algorithm;
 	adapter->dev.parent = &gmod->dev;
 	adapter->retries = 3;	/* we have to pick something... */
+	adapter->timeout = HZ;
 	snprintf(adapter->name, sizeof(adapter->name), "Greybus i2c adapter");
-	retval = i2c_add_adapter(adapter);
-	if (retval) {
-		dev_err(&gmod->dev, "Can not add SMBus adapter\n");
+
+	gb_i2c_dev->request = greybus_alloc_gbuf(gmod, cport,
+						 gb_i2c_request_complete,
+						 size, GFP_KERNEL, gb_i2c_dev);
+	if (!gb_i2c_dev->request) {
+		retval = -ENOMEM;
 		goto error;
 	}
 
-	gb_i2c_dev->gmod = gmod;
-	gb_i2c_dev->adapter = adapter;
+	retval = gb_register_cport_complete(gmod, gb_i2c_response,
+					    cport->number, gb_i2c_dev);
+	if (retval) {
+		dev_err(&gmod->dev, "cport %d is already taken\n",
+			cport->number);
+		goto error_gbuf;
+	}
+	/* All the response handler does is copy, and wake up the caller */
+	gb_cport_set_atomic(gmod, cport->number, true);
+
+	retval = gb_i2c_functionality(gb_i2c_dev);
+	if (retval)
+		goto error_cport;
+
+	retval = i2c_add_adapter(adapter);
+	if (retval) {
+		dev_err(&gmod->dev, "Can not add i2c adapter\n");
+		goto error_cport;
+	}
 
 	gmod->gb_i2c_dev = gb_i2c_dev;
 	return 0;
+error_cport:
+	gb_deregister_cport_complete(gmod, cport->number);
+error_gbuf:
+	greybus_free_gbuf(gb_i2c_dev->request);
 error:
 	kfree(adapter);
 	kfree(gb_i2c_dev);
@@ -120,11 +477,51 @@ void gb_i2c_disconnect(struct greybus_module *gmod)
 	struct gb_i2c_device *gb_i2c_dev;
 
 	gb_i2c_dev = gmod->gb_i2c_dev;
+	if (!gb_i2c_dev)
+		return;
+
+	gmod->gb_i2c_dev = NULL;
+
+	/*
+	 * Waits for the transfer in flight, which has its request back, and
+	 * still needs the response handler to get its answer.
+	 */
 	i2c_del_adapter(gb_i2c_dev->adapter);
+	gb_deregister_cport_complete(gmod, gb_i2c_dev->cport->number);
+	greybus_free_gbuf(gb_i2c_dev->request);
 	kfree(gb_i2c_dev->adapter);
 	kfree(gb_i2c_dev);
 }
 
+/*
+ * Taking the adapter lock waits for the transfer in flight, if there is one,
+ * and anything after it fails until the module is resumed.
+ */
+int gb_i2c_suspend(struct greybus_module *gmod)
+{
+	struct gb_i2c_device *gb_i2c_dev = gmod->gb_i2c_dev;
+
+	if (!gb_i2c_dev)
+		return 0;
+
+	i2c_lock_adapter(gb_i2c_dev->adapter);
+	gb_i2c_dev->suspended = true;
+	i2c_unlock_adapter(gb_i2c_dev->adapter);
+	return 0;
+}
+
+void gb_i2c_resume(struct greybus_module *gmod)
+{
+	struct gb_i2c_device *gb_i2c_dev = gmod->gb_i2c_dev;
+
+	if (!gb_i2c_dev)
+		return;
+
+	i2c_lock_adapter(gb_i2c_dev->adapter);
+	gb_i2c_dev->suspended = false;
+	i2c_unlock_adapter(gb_i2c_dev->adapter);
+}
+
 #if 0
 static struct greybus_driver i2c_gb_driver = {
 	.probe =	gb_i2c_probe,
@@ -0,0 +1,689 @@
+/*
+ * Greybus "loopback" host driver
+ *
+ * A software only host controller that sends every cport message right back
+ * to the same cport it was sent on, over a link that can be made as slow,
+ * laggy and lossy as needed.  SVC hotplug messages, with a made up manifest,
+ * can be injected through debugfs, so the core and the protocol drivers can
+ * be exercised, and benchmarked, without any hardware.
+ *
+ * Copyright 2026 The Greybus Authors
+ *
+ * Released under the GPLv2 only.
+ */
+#define pr_fmt(fmt) KBUILD_MODNAME ": " fmt
+
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/moduleparam.h>
+#include <linux/slab.h>
+#include <linux/errno.h>
+#include <linux/device.h>
+#include <linux/hrtimer.h>
+#include <linux/ktime.h>
+#include <linux/random.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/uaccess.h>
+#include "greybus.h"
+#include "svc_msg.h"
+
+/*
+ * The link model.  All of these can be changed on the fly through
+ * /sys/module/loopback_hd/parameters/ and take effect for the next message.
+ */
+static unsigned int buffer_size = PAGE_SIZE;
+module_param(buffer_size, uint, 0444);
+MODULE_PARM_DESC(buffer_size, "largest transfer on the link (host mtu) in bytes");
+
+static unsigned int bandwidth;
+module_param(bandwidth, uint, 0644);
+MODULE_PARM_DESC(bandwidth, "link bandwidth in bytes per second, 0 is unlimited");
+
+static unsigned int latency_us;
+module_param(latency_us, uint, 0644);
+MODULE_PARM_DESC(latency_us, "fixed latency added to every message in us");
+
+static unsigned int jitter_us;
+module_param(jitter_us, uint, 0644);
+MODULE_PARM_DESC(jitter_us, "random latency, up to this many us, added to every message");
+
+static unsigned int loss_ppm;
+module_param(loss_ppm, uint, 0644);
+MODULE_PARM_DESC(loss_ppm, "messages lost on the link, in parts per million");
+
+/* What the modules we make up look like */
+static unsigned int function_class = GREYBUS_FUNCTION_UART;
+module_param(function_class, uint, 0644);
+MODULE_PARM_DESC(function_class, "function class of injected modules");
+
+static unsigned int cport_base = 16;
+module_param(cport_base, uint, 0644);
+MODULE_PARM_DESC(cport_base, "cport of injected module N is cport_base + N");
+
+/*
+ * loopback_hd - loopback host controller
+ * @hd: pointer to our greybus_host_device structure
+ * @parent: the device everything hangs off of
+ * @lock: protects @busy_until, @last_delivery, @xfers and @stopped
+ * @busy_until: when the link is done sending what was already submitted
+ * @last_delivery: when the last submitted message will be delivered, jitter
+ *		   can not reorder messages on a link.
+ * @xfers: list of messages "on the wire", in the order they are delivered
+ * @timer: goes off when the first of @xfers is due.  Everything is
+ *	   delivered from it, one message at a time, so the core gets the
+ *	   data for a cport in order and never from two places at once.
+ * @stopped: the link is going away, nothing more gets on it
+ * @storm_mutex: one hotplug storm at a time, protects the storm results
+ * @root: our debugfs directory
+ */
+struct loopback_hd {
+	struct greybus_host_device *hd;
+	struct device *parent;
+
+	spinlock_t lock;
+	ktime_t busy_until;
+	ktime_t last_delivery;
+	struct list_head xfers;
+	struct hrtimer timer;
+	bool stopped;
+
+	atomic_long_t messages;
+	atomic_long_t bytes;
+	atomic_long_t lost;
+	atomic_long_t svc_messages;
+
+	struct mutex storm_mutex;
+	unsigned int storm_events;
+	s64 storm_ns;
+	struct gb_latency storm_plug;
+	struct gb_latency storm_unplug;
+
+	struct dentry *root;
+};
+
+/* One message "on the wire" */
+struct loopback_xfer {
+	struct list_head links;
+	ktime_t deliver;
+	struct gbuf *gbuf;
+	bool lost;
+	bool killed;
+};
+
+static struct loopback_hd *loopback;
+
+static inline struct loopback_hd *hd_to_loopback(struct greybus_host_device *hd)
+{
+	return (struct loopback_hd *)&hd->hd_priv;
+}
+
+static int alloc_gbuf_data(struct gbuf *gbuf, unsigned int size, gfp_t gfp_mask)
+{
+	gbuf->transfer_buffer = kmalloc(size, gfp_mask);
+	if (!gbuf->transfer_buffer)
+		return -ENOMEM;
+
+	gbuf->transfer_buffer_length = size;
+	gbuf->actual_length = size;
+	gbuf->hdpriv = hd_to_loopback(gbuf->gmod->hd);
+
+	return 0;
+}
+
+static void free_gbuf_data(struct gbuf *gbuf)
+{
+	kfree(gbuf->transfer_buffer);
+}
+
+static int send_svc_msg(struct svc_msg *svc_msg, struct greybus_host_device *hd)
+{
+	struct loopback_hd *lb = hd_to_loopback(hd);
+
+	/* The SVC is a very good listener, it never says anything back */
+	atomic_long_inc(&lb->svc_messages);
+	dev_dbg(lb->parent, "svc message function %d\n",
+		svc_msg->header.function_id);
+	return 0;
+}
+
+/* Set the timer for the next message that is due, with @lock held */
+static void loopback_arm(struct loopback_hd *lb)
+{
+	struct loopback_xfer *xfer;
+
+	if (list_empty(&lb->xfers))
+		return;
+	xfer = list_first_entry(&lb->xfers, struct loopback_xfer, links);
+	hrtimer_start(&lb->timer, xfer->deliver, HRTIMER_MODE_ABS);
+}
+
+/*
+ * The next message that is due, or one that was killed, which doesn't have
+ * to wait for its turn since nothing of it gets delivered.
+ */
+static struct loopback_xfer *loopback_next(struct loopback_hd *lb,
+					   ktime_t now)
+{
+	struct loopback_xfer *xfer;
+
+	list_for_each_entry(xfer, &lb->xfers, links) {
+		if (xfer->killed || ktime_compare(xfer->deliver, now) <= 0) {
+			list_del(&xfer->links);
+			return xfer;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * The message has made it to the other end of the link and back again, hand
+ * it to the core the same way a real host controller would, in segments.
+ */
+static void xfer_deliver(struct loopback_hd *lb, struct loopback_xfer *xfer)
+{
+	struct greybus_host_device *hd = lb->hd;
+	struct gbuf *gbuf = xfer->gbuf;
+	u8 *data = gbuf->transfer_buffer;
+	size_t left = gbuf->transfer_buffer_length;
+	size_t length;
+
+	if (xfer->killed) {
+		gbuf->status = -ESHUTDOWN;
+		greybus_gbuf_finished(gbuf);
+		kfree(xfer);
+		return;
+	}
+
+	if (!xfer->lost) {
+		do {
+			length = min(left, hd->buffer_size_max);
+			greybus_cport_in_data(hd, gbuf->cport->number, data,
+					      length);
+			data += length;
+			left -= length;
+		} while (length == hd->buffer_size_max);
+	}
+
+	gbuf->status = 0;
+	greybus_gbuf_finished(gbuf);
+	kfree(xfer);
+}
+
+static enum hrtimer_restart loopback_timer(struct hrtimer *timer)
+{
+	struct loopback_hd *lb = container_of(timer, struct loopback_hd,
+					      timer);
+	struct loopback_xfer *xfer;
+	unsigned long flags;
+
+	for (;;) {
+		spin_lock_irqsave(&lb->lock, flags);
+		xfer = loopback_next(lb, ktime_get());
+		if (!xfer) {
+			loopback_arm(lb);
+			spin_unlock_irqrestore(&lb->lock, flags);
+			break;
+		}
+		spin_unlock_irqrestore(&lb->lock, flags);
+
+		xfer_deliver(lb, xfer);
+	}
+
+	return HRTIMER_NORESTART;
+}
+
+static int submit_gbuf(struct gbuf *gbuf, struct greybus_host_device *hd,
+		       gfp_t gfp_mask)
+{
+	struct loopback_hd *lb = hd_to_loopback(hd);
+	struct loopback_xfer *xfer;
+	unsigned int rate = ACCESS_ONCE(bandwidth);
+	unsigned int jitter = ACCESS_ONCE(jitter_us);
+	unsigned int loss = ACCESS_ONCE(loss_ppm);
+	u64 delay_ns = 0;
+	ktime_t now;
+	ktime_t deliver;
+	unsigned long flags;
+
+	xfer = kzalloc(sizeof(*xfer), gfp_mask);
+	if (!xfer)
+		return -ENOMEM;
+
+	xfer->gbuf = gbuf;
+	xfer->lost = loss && prandom_u32_max(1000000) < loss;
+
+	atomic_long_inc(&lb->messages);
+	atomic_long_add(gbuf->transfer_buffer_length, &lb->bytes);
+	if (xfer->lost)
+		atomic_long_inc(&lb->lost);
+
+	/* How long the message takes to get through, and back again */
+	if (rate)
+		delay_ns = div_u64((u64)gbuf->transfer_buffer_length *
+				   NSEC_PER_SEC, rate);
+	if (jitter)
+		jitter = prandom_u32_max(jitter + 1);
+
+	now = ktime_get();
+	spin_lock_irqsave(&lb->lock, flags);
+	if (lb->stopped) {
+		spin_unlock_irqrestore(&lb->lock, flags);
+		kfree(xfer);
+		return -ESHUTDOWN;
+	}
+	if (ktime_compare(lb->busy_until, now) < 0)
+		lb->busy_until = now;
+	lb->busy_until = ktime_add_ns(lb->busy_until, delay_ns);
+
+	deliver = ktime_add_ns(lb->busy_until,
+			       (u64)(ACCESS_ONCE(latency_us) + jitter) *
+			       NSEC_PER_USEC);
+	if (ktime_compare(deliver, lb->last_delivery) < 0)
+		deliver = lb->last_delivery;
+	lb->last_delivery = deliver;
+	xfer->deliver = deliver;
+
+	/* Nothing is delivered before what's ahead of it on the link */
+	list_add_tail(&xfer->links, &lb->xfers);
+	if (list_is_singular(&lb->xfers))
+		loopback_arm(lb);
+	spin_unlock_irqrestore(&lb->lock, flags);
+
+	return 0;
+}
+
+/* Pull the message off the wire, it completes from the timer like always */
+static void kill_gbuf(struct gbuf *gbuf)
+{
+	struct loopback_hd *lb = gbuf->hdpriv;
+	struct loopback_xfer *xfer;
+	unsigned long flags;
+
+	spin_lock_irqsave(&lb->lock, flags);
+	list_for_each_entry(xfer, &lb->xfers, links) {
+		if (xfer->gbuf != gbuf)
+			continue;
+		xfer->killed = true;
+		hrtimer_start(&lb->timer, ktime_get(), HRTIMER_MODE_ABS);
+		break;
+	}
+	spin_unlock_irqrestore(&lb->lock, flags);
+}
+
+static struct greybus_host_driver loopback_driver = {
+	.hd_priv_size		= sizeof(struct loopback_hd),
+	.alloc_gbuf_data	= alloc_gbuf_data,
+	.free_gbuf_data		= free_gbuf_data,
+	.send_svc_msg		= send_svc_msg,
+	.submit_gbuf		= submit_gbuf,
+	.kill_gbuf		= kill_gbuf,
+};
+
+static void *add_descriptor(u8 **p, enum greybus_descriptor_type type,
+			    size_t size)
+{
+	struct greybus_descriptor_header *header;
+
+	header = (struct greybus_descriptor_header *)*p;
+	header->size = cpu_to_le16(sizeof(*header) + size);
+	header->type = cpu_to_le16(type);
+	*p += sizeof(*header) + size;
+
+	return header + 1;
+}
+
+/*
+ * Make up a manifest for a module with a single function and cport, and wrap
+ * it in a SVC hotplug message.  Returns the size of the message.
+ */
+static int build_hotplug_msg(u8 *buffer, u8 module_id)
+{
+	static const char product[] = "Loopback Module";
+	struct svc_msg *svc_msg = (struct svc_msg *)buffer;
+	struct greybus_manifest *manifest;
+	struct greybus_descriptor_function *function;
+	struct greybus_descriptor_module_id *id;
+	struct greybus_descriptor_serial_number *serial;
+	struct greybus_descriptor_string *string;
+	struct greybus_descriptor_cport *cport;
+	u16 cport_number = cport_base + module_id;
+	u8 *p;
+	int size;
+
+	manifest = (struct greybus_manifest *)svc_msg->hotplug.data;
+	p = (u8 *)manifest->descriptors;
+
+	function = add_descriptor(&p, GREYBUS_TYPE_FUNCTION, sizeof(*function));
+	function->number = cpu_to_le16(0);
+	function->cport = cpu_to_le16(cport_number);
+	function->class = function_class;
+
+	id = add_descriptor(&p, GREYBUS_TYPE_MODULE_ID, sizeof(*id));
+	id->vendor = cpu_to_le16(0xffff);
+	id->product = cpu_to_le16(0x0001);
+	id->version = cpu_to_le16(1);
+	id->product_stringid = 1;
+
+	serial = add_descriptor(&p, GREYBUS_TYPE_SERIAL_NUMBER, sizeof(*serial));
+	serial->serial_number = cpu_to_le64(module_id);
+
+	string = add_descriptor(&p, GREYBUS_TYPE_STRING,
+				sizeof(*string) + sizeof(product) - 1);
+	string->length = cpu_to_le16(sizeof(product) - 1);
+	string->id = 1;
+	memcpy(string->string, product, sizeof(product) - 1);
+
+	cport = add_descriptor(&p, GREYBUS_TYPE_CPORT, sizeof(*cport));
+	cport->number = cpu_to_le16(cport_number);
+	cport->size = cpu_to_le16(0);
+
+	size = p - (u8 *)manifest;
+	manifest->header.size = cpu_to_le16(size);
+	manifest->header.version_major = GREYBUS_VERSION_MAJOR;
+	manifest->header.version_minor = GREYBUS_VERSION_MINOR;
+
+	svc_msg->header.function_id = SVC_FUNCTION_HOTPLUG;
+	svc_msg->header.message_type = SVC_MSG_DATA;
+	svc_msg->header.payload_length =
+		cpu_to_le16(sizeof(struct svc_function_hotplug) + size);
+	svc_msg->hotplug.hotplug_event = SVC_HOTPLUG_EVENT;
+	svc_msg->hotplug.module_id = module_id;
+
+	return sizeof(svc_msg->header) + sizeof(struct svc_function_hotplug) +
+	       size;
+}
+
+static int inject_hotplug(struct loopback_hd *lb, u8 module_id, bool add)
+{
+	u8 buffer[256];
+	struct svc_msg *svc_msg = (struct svc_msg *)buffer;
+	int size;
+
+	memset(buffer, 0, sizeof(buffer));
+	if (add) {
+		size = build_hotplug_msg(buffer, module_id);
+	} else {
+		svc_msg->header.function_id = SVC_FUNCTION_HOTPLUG;
+		svc_msg->header.message_type = SVC_MSG_DATA;
+		svc_msg->header.payload_length =
+			cpu_to_le16(sizeof(struct svc_function_hotplug));
+		svc_msg->hotplug.hotplug_event = SVC_HOTUNPLUG_EVENT;
+		svc_msg->hotplug.module_id = module_id;
+		size = sizeof(svc_msg->header) +
+		       sizeof(struct svc_function_hotplug);
+	}
+
+	return gb_new_ap_msg(buffer, size, lb->hd);
+}
+
+static int inject_svc_hello(struct loopback_hd *lb)
+{
+	struct svc_msg svc_msg;
+
+	memset(&svc_msg, 0, sizeof(svc_msg));
+	svc_msg.header.function_id = SVC_FUNCTION_HANDSHAKE;
+	svc_msg.header.message_type = SVC_MSG_DATA;
+	svc_msg.header.payload_length =
+		cpu_to_le16(sizeof(struct svc_function_handshake));
+	svc_msg.handshake.version_major = GREYBUS_VERSION_MAJOR;
+	svc_msg.handshake.version_minor = GREYBUS_VERSION_MINOR;
+	svc_msg.handshake.handshake_type = SVC_HANDSHAKE_SVC_HELLO;
+
+	return gb_new_ap_msg((u8 *)&svc_msg, sizeof(svc_msg.header) +
+			     sizeof(struct svc_function_handshake), lb->hd);
+}
+
+static ssize_t hotplug_write(struct file *file, const char __user *ubuf,
+			     size_t count, loff_t *ppos, bool add)
+{
+	struct loopback_hd *lb = file->private_data;
+	char buf[8];
+	u8 module_id;
+	int retval;
+
+	if (count >= sizeof(buf))
+		return -EINVAL;
+	if (copy_from_user(buf, ubuf, count))
+		return -EFAULT;
+	buf[count] = '\0';
+
+	retval = kstrtou8(buf, 0, &module_id);
+	if (retval)
+		return retval;
+
+	retval = inject_hotplug(lb, module_id, add);
+	if (retval)
+		return retval;
+
+	return count;
+}
+
+static ssize_t hotplug_add_write(struct file *file, const char __user *ubuf,
+				 size_t count, loff_t *ppos)
+{
+	return hotplug_write(file, ubuf, count, ppos, true);
+}
+
+static ssize_t hotplug_remove_write(struct file *file, const char __user *ubuf,
+				    size_t count, loff_t *ppos)
+{
+	return hotplug_write(file, ubuf, count, ppos, false);
+}
+
+static const struct file_operations hotplug_fops = {
+	.open		= simple_open,
+	.write		= hotplug_add_write,
+};
+
+static const struct file_operations hotunplug_fops = {
+	.open		= simple_open,
+	.write		= hotplug_remove_write,
+};
+
+/*
+ * A hotplug storm: writing N to "storm" plugs in, and unplugs again, N
+ * modules, back to back, as fast as the messages can be made up.  Module ids
+ * go round from 0 to 255, so it's best done with nothing else plugged in.
+ * Reading "storm" gives how long it took for the core to get through all of
+ * them, and how long modules took to come and go while it did.
+ */
+#define STORM_MAX_MODULES	65536
+
+static ssize_t storm_write(struct file *file, const char __user *ubuf,
+			   size_t count, loff_t *ppos)
+{
+	struct seq_file *s = file->private_data;
+	struct loopback_hd *lb = s->private;
+	struct gb_latency plug, unplug;
+	unsigned int modules;
+	unsigned int i;
+	ktime_t start;
+	int retval;
+
+	retval = kstrtouint_from_user(ubuf, count, 0, &modules);
+	if (retval)
+		return retval;
+	if (!modules || modules > STORM_MAX_MODULES)
+		return -EINVAL;
+
+	mutex_lock(&lb->storm_mutex);
+
+	gb_ap_flush();
+	gb_latency_get(lb->hd, &plug, &unplug);
+	start = ktime_get();
+
+	for (i = 0; i < modules; ++i) {
+		retval = inject_hotplug(lb, i % (U8_MAX + 1), true);
+		if (retval)
+			break;
+		retval = inject_hotplug(lb, i % (U8_MAX + 1), false);
+		if (retval)
+			break;
+	}
+
+	/* Every message is queued by now, so this waits for all of them */
+	gb_ap_flush();
+
+	lb->storm_ns = ktime_to_ns(ktime_sub(ktime_get(), start));
+	lb->storm_events = 2 * i;
+	gb_latency_get(lb->hd, &lb->storm_plug, &lb->storm_unplug);
+	gb_latency_sub(&lb->storm_plug, &plug);
+	gb_latency_sub(&lb->storm_unplug, &unplug);
+
+	mutex_unlock(&lb->storm_mutex);
+
+	if (retval)
+		return retval;
+	return count;
+}
+
+static int storm_show(struct seq_file *s, void *unused)
+{
+	struct loopback_hd *lb = s->private;
+
+	mutex_lock(&lb->storm_mutex);
+	seq_printf(s, "events: %u\n", lb->storm_events);
+	seq_printf(s, "elapsed_us: %lld\n",
+		   div_s64(lb->storm_ns, NSEC_PER_USEC));
+	if (lb->storm_ns)
+		seq_printf(s, "events_per_sec: %llu\n",
+			   div64_u64((u64)lb->storm_events * NSEC_PER_SEC,
+				     lb->storm_ns));
+	gb_latency_show(s, "hotplug", &lb->storm_plug);
+	gb_latency_show(s, "unplug", &lb->storm_unplug);
+	mutex_unlock(&lb->storm_mutex);
+	return 0;
+}
+
+static int storm_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, storm_show, inode->i_private);
+}
+
+static const struct file_operations storm_fops = {
+	.open		= storm_open,
+	.read		= seq_read,
+	.write		= storm_write,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
+static int stats_show(struct seq_file *s, void *unused)
+{
+	struct loopback_hd *lb = s->private;
+
+	seq_printf(s, "messages: %ld\n", atomic_long_read(&lb->messages));
+	seq_printf(s, "bytes: %ld\n", atomic_long_read(&lb->bytes));
+	seq_printf(s, "lost: %ld\n", atomic_long_read(&lb->lost));
+	seq_printf(s, "svc messages: %ld\n",
+		   atomic_long_read(&lb->svc_messages));
+	return 0;
+}
+
+static int stats_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, stats_show, inode->i_private);
+}
+
+static const struct file_operations stats_fops = {
+	.open		= stats_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
+/*
+ * Take the link down, whatever is still on it never arrives, and anything
+ * submitted from here on, like what the modules send while they are torn
+ * down, is refused right away, so nothing is left on it once the host
+ * device is gone.
+ */
+static void loopback_stop(struct loopback_hd *lb)
+{
+	struct loopback_xfer *xfer;
+	unsigned long flags;
+
+	spin_lock_irqsave(&lb->lock, flags);
+	lb->stopped = true;
+	spin_unlock_irqrestore(&lb->lock, flags);
+
+	/* Nobody can set it again, everything left is on the list */
+	hrtimer_cancel(&lb->timer);
+
+	spin_lock_irqsave(&lb->lock, flags);
+	while (!list_empty(&lb->xfers)) {
+		xfer = list_first_entry(&lb->xfers, struct loopback_xfer, links);
+		list_del(&xfer->links);
+		spin_unlock_irqrestore(&lb->lock, flags);
+
+		xfer->killed = true;
+		xfer_deliver(lb, xfer);
+
+		spin_lock_irqsave(&lb->lock, flags);
+	}
+	spin_unlock_irqrestore(&lb->lock, flags);
+}
+
+static int __init loopback_init(void)
+{
+	struct loopback_hd *lb;
+	struct greybus_host_device *hd;
+	struct device *parent;
+	size_t size;
+
+	parent = root_device_register("gb_loopback");
+	if (IS_ERR(parent))
+		return PTR_ERR(parent);
+
+	size = clamp_t(unsigned int, buffer_size, 64, GB_MESSAGE_SIZE_MAX);
+	hd = greybus_create_hd(&loopback_driver, parent, size);
+	if (!hd) {
+		root_device_unregister(parent);
+		return -ENOMEM;
+	}
+
+	/* Both ends of the "link" are us, so big messages can be split */
+	hd->segmented = true;
+
+	lb = hd_to_loopback(hd);
+	lb->hd = hd;
+	lb->parent = parent;
+	spin_lock_init(&lb->lock);
+	INIT_LIST_HEAD(&lb->xfers);
+	hrtimer_init(&lb->timer, CLOCK_MONOTONIC, HRTIMER_MODE_ABS);
+	lb->timer.function = loopback_timer;
+	mutex_init(&lb->storm_mutex);
+
+	lb->root = debugfs_create_dir("loopback", gb_debugfs_get());
+	debugfs_create_file("hotplug", S_IWUSR, lb->root, lb, &hotplug_fops);
+	debugfs_create_file("hotunplug", S_IWUSR, lb->root, lb,
+			    &hotunplug_fops);
+	debugfs_create_file("stats", S_IRUGO, lb->root, lb, &stats_fops);
+	debugfs_create_file("storm", S_IRUGO | S_IWUSR, lb->root, lb,
+			    &storm_fops);
+
+	loopback = lb;
+
+	/* Say hello, like a SVC would when the link comes up */
+	inject_svc_hello(lb);
+
+	return 0;
+}
+
+static void __exit loopback_exit(void)
+{
+	struct loopback_hd *lb = loopback;
+	struct device *parent = lb->parent;
+
+	debugfs_remove_recursive(lb->root);
+	loopback_stop(lb);
+	greybus_remove_hd(lb->hd);
+	root_device_unregister(parent);
+}
+
+module_init(loopback_init);
+module_exit(loopback_exit);
+
+MODULE_LICENSE("GPL");
+MODULE_AUTHOR("The Greybus Authors");
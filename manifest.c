@@ -0,0 +1,233 @@
+/*
+ * Greybus manifest cache
+ *
+ * Modules of the same kind all send the same manifest, but for their serial
+ * number, and they get plugged in and out over and over, so rather than
+ * parsing it every time, what a manifest says is kept in a cache, keyed by
+ * a hash of its raw bytes, leaving out the serial number.  All modules
+ * of the same kind share the same, read-only, struct gb_manifest; only what
+ * is unique to a module, its serial number, lives in the module itself.
+ *
+ * Copyright 2014 Google Inc.
+ * Copyright 2026 The Greybus Authors
+ *
+ * Released under the GPLv2 only.
+ */
+
+#define pr_fmt(fmt) KBUILD_MODNAME ": " fmt
+
+#include <linux/types.h>
+#include <linux/kernel.h>
+#include <linux/slab.h>
+#include <linux/device.h>
+#include <linux/mutex.h>
+#include <linux/list.h>
+#include <linux/hashtable.h>
+#include <linux/jhash.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+
+#include "greybus.h"
+
+/*
+ * How many manifests the cache hangs on to, whether modules are using them
+ * or not.  Modules keep one that got pushed out until they are done with it.
+ */
+#define GB_MANIFEST_CACHE_SIZE	64
+
+static DEFINE_HASHTABLE(manifest_cache, 6);
+static LIST_HEAD(manifest_lru);
+static DEFINE_MUTEX(manifest_mutex);
+static unsigned int manifest_entries;
+static unsigned long manifest_hits;
+static unsigned long manifest_misses;
+static struct dentry *manifest_dentry;
+
+static void manifest_release(struct kref *kref)
+{
+	struct gb_manifest *manifest = container_of(kref, struct gb_manifest,
+						    kref);
+
+	kfree(manifest);
+}
+
+/* Called with manifest_mutex held */
+static void manifest_evict(struct gb_manifest *manifest)
+{
+	hash_del(&manifest->node);
+	list_del(&manifest->lru);
+	manifest_entries--;
+
+	/* Modules still using it keep it around until they are gone */
+	kref_put(&manifest->kref, manifest_release);
+}
+
+/*
+ * Find the serial number of a manifest, the only thing that's not the same
+ * for every module of its kind, and copy it out to @serial_number.  Returns
+ * where in the manifest it is, or 0 if there is none.  Nothing has been
+ * checked yet, so stop at anything that doesn't look right,
+ * gb_manifest_parse() complains about it.
+ */
+static int manifest_find_serial_number(const u8 *data, int size,
+			struct greybus_descriptor_serial_number *serial_number)
+{
+	const struct greybus_descriptor *desc;
+	int offset = sizeof(struct greybus_manifest_header);
+	u16 desc_size;
+
+	while (size - offset >= (int)sizeof(desc->header)) {
+		desc = (const struct greybus_descriptor *)(data + offset);
+		desc_size = le16_to_cpu(desc->header.size);
+		if (desc_size < sizeof(desc->header) ||
+		    size - offset < desc_size)
+			return 0;
+
+		if (le16_to_cpu(desc->header.type) ==
+		    GREYBUS_TYPE_SERIAL_NUMBER &&
+		    desc_size == sizeof(desc->header) +
+				 sizeof(desc->serial_number)) {
+			*serial_number = desc->serial_number;
+			return offset + sizeof(desc->header);
+		}
+
+		offset += desc_size;
+	}
+	return 0;
+}
+
+/* Does @manifest say the same as @data, but for the serial number at @skip */
+static bool manifest_same(const struct gb_manifest *manifest, u32 hash,
+			  const u8 *data, int size, int skip)
+{
+	int rest = skip + sizeof(struct greybus_descriptor_serial_number);
+
+	if (manifest->hash != hash || manifest->raw_size != size)
+		return false;
+	if (!skip)
+		return !memcmp(manifest->raw, data, size);
+	return !memcmp(manifest->raw, data, skip) &&
+	       !memcmp(manifest->raw + rest, data + rest, size - rest);
+}
+
+/**
+ * gb_manifest_get - find out what a manifest says
+ *
+ * @parent: device to complain about a broken manifest to
+ * @data: the raw manifest, as the module sent it
+ * @size: size of @data
+ * @serial_number: where the module's own serial number goes, it's not
+ *		   part of what modules share
+ *
+ * Returns a reference to the parsed manifest, which must not be changed,
+ * and is dropped with gb_manifest_put(), or NULL if the manifest is bad.
+ * @data is only looked at, and a manifest that is already in the cache
+ * costs no allocation at all.
+ */
+struct gb_manifest *gb_manifest_get(struct device *parent, u8 *data, int size,
+			struct greybus_descriptor_serial_number *serial_number)
+{
+	struct gb_manifest *manifest;
+	int skip;
+	int rest;
+	u32 hash;
+
+	/* Anything that's in the cache has already been checked */
+	if (size <= (int)sizeof(struct greybus_manifest_header))
+		return NULL;
+
+	/* Hash around the serial number, rather than a copy without it */
+	skip = manifest_find_serial_number(data, size, serial_number);
+	if (skip) {
+		rest = skip + sizeof(*serial_number);
+		hash = jhash(data, skip, 0);
+		hash = jhash(data + rest, size - rest, hash);
+	} else {
+		hash = jhash(data, size, 0);
+	}
+
+	mutex_lock(&manifest_mutex);
+	hash_for_each_possible(manifest_cache, manifest, node, hash) {
+		if (manifest_same(manifest, hash, data, size, skip)) {
+			manifest_hits++;
+			list_move(&manifest->lru, &manifest_lru);
+			kref_get(&manifest->kref);
+			goto exit;
+		}
+	}
+
+	manifest_misses++;
+	manifest = gb_manifest_parse(parent, data, size);
+	if (!manifest)
+		goto exit;
+
+	/* Its copy of the manifest is what every module of the kind has */
+	if (skip)
+		memset(manifest->raw + skip, 0, sizeof(*serial_number));
+
+	/* One reference for the cache, and one for the caller */
+	kref_init(&manifest->kref);
+	kref_get(&manifest->kref);
+	INIT_LIST_HEAD(&manifest->lru);
+	manifest->hash = hash;
+	hash_add(manifest_cache, &manifest->node, hash);
+	list_add(&manifest->lru, &manifest_lru);
+	if (++manifest_entries > GB_MANIFEST_CACHE_SIZE)
+		manifest_evict(list_last_entry(&manifest_lru,
+					       struct gb_manifest, lru));
+exit:
+	mutex_unlock(&manifest_mutex);
+	return manifest;
+}
+
+void gb_manifest_put(struct gb_manifest *manifest)
+{
+	kref_put(&manifest->kref, manifest_release);
+}
+
+static int manifest_cache_show(struct seq_file *s, void *unused)
+{
+	mutex_lock(&manifest_mutex);
+	seq_printf(s, "entries: %u\n", manifest_entries);
+	seq_printf(s, "hits: %lu\n", manifest_hits);
+	seq_printf(s, "misses: %lu\n", manifest_misses);
+	if (manifest_hits + manifest_misses)
+		seq_printf(s, "hit rate: %lu%%\n",
+			   manifest_hits * 100 /
+			   (manifest_hits + manifest_misses));
+	mutex_unlock(&manifest_mutex);
+	return 0;
+}
+
+static int manifest_cache_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, manifest_cache_show, NULL);
+}
+
+static const struct file_operations manifest_cache_fops = {
+	.open		= manifest_cache_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
+int gb_manifest_init(void)
+{
+	manifest_dentry = debugfs_create_file("manifest_cache", S_IRUGO,
+					      gb_debugfs_get(), NULL,
+					      &manifest_cache_fops);
+	return 0;
+}
+
+void gb_manifest_exit(void)
+{
+	struct gb_manifest *manifest;
+	struct gb_manifest *temp;
+
+	debugfs_remove(manifest_dentry);
+
+	mutex_lock(&manifest_mutex);
+	list_for_each_entry_safe(manifest, temp, &manifest_lru, lru)
+		manifest_evict(manifest);
+	mutex_unlock(&manifest_mutex);
+}
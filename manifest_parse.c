@@ -0,0 +1,267 @@
+/*
+ * Greybus manifest parsing
+ *
+ * Turning the raw manifest a module sends into a struct gb_manifest.  This
+ * only needs the manifest itself, so it also builds in userspace, where it
+ * gets fuzzed and benchmarked, see tools/.  The cache of parsed manifests
+ * is in manifest.c.
+ *
+ * Copyright 2014 Google Inc.
+ * Copyright 2026 The Greybus Authors
+ *
+ * Released under the GPLv2 only.
+ */
+
+#define pr_fmt(fmt) KBUILD_MODNAME ": " fmt
+
+#include <linux/types.h>
+#include <linux/kernel.h>
+#include <linux/slab.h>
+#include <linux/device.h>
+
+#include "greybus.h"
+
+/*
+ * What the first pass over a manifest finds out, so the second pass knows
+ * how much room everything is going to take.
+ */
+struct manifest_counts {
+	int num_cports;
+	int num_strings;
+	int num_string_ids;	/* highest string id + 1 */
+	size_t string_bytes;
+};
+
+/* Make sure a descriptor is sane, and count what it's going to need */
+static int count_descriptor(struct device *parent,
+			    struct greybus_descriptor *desc, size_t data_size,
+			    void *context)
+{
+	struct manifest_counts *counts = context;
+	size_t expected;
+
+	switch (le16_to_cpu(desc->header.type)) {
+	case GREYBUS_TYPE_FUNCTION:
+		expected = sizeof(desc->function);
+		break;
+
+	case GREYBUS_TYPE_MODULE_ID:
+		expected = sizeof(desc->module_id);
+		break;
+
+	case GREYBUS_TYPE_SERIAL_NUMBER:
+		expected = sizeof(desc->serial_number);
+		break;
+
+	case GREYBUS_TYPE_STRING:
+		if (data_size < sizeof(desc->string) ||
+		    le16_to_cpu(desc->string.length) >
+		    data_size - sizeof(desc->string)) {
+			dev_err(parent, "invalid string header size %zu\n",
+				data_size);
+			return -EINVAL;
+		}
+		counts->num_strings++;
+		counts->num_string_ids = max(counts->num_string_ids,
+					     desc->string.id + 1);
+		counts->string_bytes += le16_to_cpu(desc->string.length) + 1;
+		return 0;
+
+	case GREYBUS_TYPE_CPORT:
+		expected = sizeof(desc->cport);
+		counts->num_cports++;
+		break;
+
+	case GREYBUS_TYPE_INVALID:
+	default:
+		dev_err(parent, "invalid descriptor type %d\n",
+			desc->header.type);
+		return -EINVAL;
+	}
+
+	if (data_size != expected) {
+		dev_err(parent, "invalid descriptor %d size %zu\n",
+			le16_to_cpu(desc->header.type), data_size);
+		return -EINVAL;
+	}
+	return 0;
+}
+
+/*
+ * Walk the descriptors of a manifest, calling @fn for each one.  The first
+ * pass checks them all with count_descriptor(), so by the time we fill in a
+ * manifest, there is nothing left that can go wrong.
+ */
+static int for_each_descriptor(struct device *parent, u8 *data, int size,
+			       int (*fn)(struct device *parent,
+					 struct greybus_descriptor *desc,
+					 size_t data_size, void *context),
+			       void *context)
+{
+	struct greybus_descriptor *desc;
+	u16 desc_size;
+	int retval;
+
+	while (size > 0) {
+		if (size < sizeof(desc->header)) {
+			dev_err(parent, "remaining size %d too small\n", size);
+			return -EINVAL;
+		}
+		desc = (struct greybus_descriptor *)data;
+		desc_size = le16_to_cpu(desc->header.size);
+		if (desc_size < sizeof(desc->header) || size < desc_size) {
+			dev_err(parent, "descriptor size %d too big\n",
+				desc_size);
+			return -EINVAL;
+		}
+
+		retval = fn(parent, desc, desc_size - sizeof(desc->header),
+			    context);
+		if (retval)
+			return retval;
+
+		size -= desc_size;
+		data += desc_size;
+	}
+	return 0;
+}
+
+/* Where the second pass puts the strings of a manifest */
+struct manifest_fill {
+	struct gb_manifest *manifest;
+	u8 *string_data;
+};
+
+static int fill_descriptor(struct device *parent,
+			   struct greybus_descriptor *desc, size_t data_size,
+			   void *context)
+{
+	struct manifest_fill *fill = context;
+	struct gb_manifest *manifest = fill->manifest;
+	struct gmod_string *string;
+	struct gmod_cport *cport;
+	u16 length;
+
+	switch (le16_to_cpu(desc->header.type)) {
+	case GREYBUS_TYPE_FUNCTION:
+		memcpy(&manifest->function, &desc->function, data_size);
+		if (desc->function.class < 32)
+			manifest->function_classes |= BIT(desc->function.class);
+		break;
+
+	case GREYBUS_TYPE_MODULE_ID:
+		memcpy(&manifest->module_id, &desc->module_id, data_size);
+		break;
+
+	case GREYBUS_TYPE_SERIAL_NUMBER:
+		/* Every module has its own, see gb_manifest_get() */
+		break;
+
+	case GREYBUS_TYPE_STRING:
+		length = le16_to_cpu(desc->string.length);
+		string = &manifest->string[manifest->num_strings++];
+		string->length = length;
+		string->id = desc->string.id;
+		string->string = fill->string_data;
+		/* Like a walk of the strings would, the first one wins */
+		if (!manifest->string_by_id[string->id])
+			manifest->string_by_id[string->id] = string;
+		memcpy(fill->string_data, desc->string.string, length);
+		fill->string_data[length] = '\0';
+		fill->string_data += length + 1;
+		break;
+
+	case GREYBUS_TYPE_CPORT:
+		cport = &manifest->cport[manifest->num_cports++];
+		cport->number = le16_to_cpu(desc->cport.number);
+		cport->size = le16_to_cpu(desc->cport.size);
+		cport->speed = desc->cport.speed;
+		break;
+	}
+	return 0;
+}
+
+/**
+ * gb_manifest_parse - turn a raw manifest into a struct gb_manifest
+ *
+ * @parent: device to complain about a broken manifest to
+ * @data: the raw manifest, as the module sent it
+ * @size: size of @data
+ *
+ * Returns NULL if the manifest is bad.  Only the parsed fields are filled
+ * in, the caller owns the rest, and frees it all with a single kfree().
+ */
+struct gb_manifest *gb_manifest_parse(struct device *parent, u8 *data,
+				      int size)
+{
+	struct greybus_manifest *header = (struct greybus_manifest *)data;
+	struct manifest_counts counts = { };
+	struct manifest_fill fill;
+	struct gb_manifest *manifest;
+	u8 version_major;
+	u8 version_minor;
+	int retval;
+
+	/* we have to have at _least_ the manifest header */
+	if (size <= (int)sizeof(header->header))
+		return NULL;
+
+	if (le16_to_cpu(header->header.size) != size) {
+		dev_err(parent, "size != manifest header size, %d != %d\n",
+			size, le16_to_cpu(header->header.size));
+		return NULL;
+	}
+
+	version_major = header->header.version_major;
+	version_minor = header->header.version_minor;
+
+	/* Validate major/minor number */
+	if ((version_major != GREYBUS_VERSION_MAJOR) ||
+	    (version_minor != GREYBUS_VERSION_MINOR)) {
+		dev_err(parent,
+			"Invalid greybus versions, expected %d.%d, got %d.%d\n",
+			GREYBUS_VERSION_MAJOR, GREYBUS_VERSION_MINOR,
+			version_major, version_minor);
+		return NULL;
+	}
+
+	/* First make sure it all makes sense, and find out how big it is */
+	retval = for_each_descriptor(parent, data + sizeof(header->header),
+				     size - sizeof(header->header),
+				     count_descriptor, &counts);
+	if (retval)
+		return NULL;
+
+	/*
+	 * Then the strings, the strings by id, the cports, the string data,
+	 * and the raw manifest, for telling apart two manifests that hash the
+	 * same, all go in one place.  The strings and the index hold
+	 * pointers, so they go first, where they are aligned for it.
+	 */
+	manifest = kzalloc(sizeof(*manifest) +
+			   counts.num_strings * sizeof(*manifest->string) +
+			   counts.num_string_ids *
+			   sizeof(*manifest->string_by_id) +
+			   counts.num_cports * sizeof(*manifest->cport) +
+			   counts.string_bytes + size, GFP_KERNEL);
+	if (!manifest)
+		return NULL;
+
+	manifest->string = (struct gmod_string *)(manifest + 1);
+	manifest->string_by_id = (struct gmod_string **)
+				 (manifest->string + counts.num_strings);
+	manifest->num_string_ids = counts.num_string_ids;
+	manifest->cport = (struct gmod_cport *)
+			  (manifest->string_by_id + counts.num_string_ids);
+	fill.manifest = manifest;
+	fill.string_data = (u8 *)(manifest->cport + counts.num_cports);
+	for_each_descriptor(parent, data + sizeof(header->header),
+			    size - sizeof(header->header), fill_descriptor,
+			    &fill);
+
+	manifest->raw = fill.string_data;
+	manifest->raw_size = size;
+	memcpy(manifest->raw, data, size);
+
+	return manifest;
+}
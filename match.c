@@ -0,0 +1,178 @@
+/*
+ * Greybus driver id matching
+ *
+ * Rather than walking a driver's whole id_table every time a module shows
+ * up, the table is put into a hash when the driver is registered.  An entry
+ * only looks at the fields its match_flags name, so there are only eight
+ * ways an entry can match, and a module can be looked up with at most one
+ * hash lookup for each of the ways its driver's table actually uses.
+ *
+ * Copyright 2026 The Greybus Authors
+ *
+ * Released under the GPLv2 only.
+ */
+
+#define pr_fmt(fmt) KBUILD_MODNAME ": " fmt
+
+#include <linux/types.h>
+#include <linux/kernel.h>
+#include <linux/slab.h>
+#include <linux/log2.h>
+#include <linux/jhash.h>
+
+#include "greybus.h"
+
+#define GREYBUS_ID_MATCH_MASK	(GREYBUS_DEVICE_ID_MATCH_VENDOR |	\
+				 GREYBUS_DEVICE_ID_MATCH_PRODUCT |	\
+				 GREYBUS_DEVICE_ID_MATCH_SERIAL)
+
+struct greybus_id_entry {
+	struct greybus_id_entry *next;
+	const struct greybus_module_id *id;
+};
+
+struct greybus_id_index {
+	u8 flags_used;			/* bit n set if match_flags n is used */
+	u32 mask;			/* number of buckets - 1 */
+	struct greybus_id_entry **buckets;
+	struct greybus_id_entry entries[0];
+};
+
+static bool id_table_end(const struct greybus_module_id *id)
+{
+	return !(id->vendor || id->product || id->serial_number ||
+		 id->driver_info);
+}
+
+/* Hash only what @flags says should be compared */
+static u32 id_hash(u16 flags, u16 vendor, u16 product, u64 serial_number)
+{
+	if (!(flags & GREYBUS_DEVICE_ID_MATCH_VENDOR))
+		vendor = 0;
+	if (!(flags & GREYBUS_DEVICE_ID_MATCH_PRODUCT))
+		product = 0;
+	if (!(flags & GREYBUS_DEVICE_ID_MATCH_SERIAL))
+		serial_number = 0;
+
+	return jhash_3words((u32)vendor << 16 | product, (u32)serial_number,
+			    (u32)(serial_number >> 32), flags);
+}
+
+static bool id_equal(const struct greybus_module_id *id, u16 vendor,
+		     u16 product, u64 serial_number)
+{
+	if ((id->match_flags & GREYBUS_DEVICE_ID_MATCH_VENDOR) &&
+	    id->vendor != vendor)
+		return false;
+	if ((id->match_flags & GREYBUS_DEVICE_ID_MATCH_PRODUCT) &&
+	    id->product != product)
+		return false;
+	if ((id->match_flags & GREYBUS_DEVICE_ID_MATCH_SERIAL) &&
+	    id->serial_number != serial_number)
+		return false;
+	return true;
+}
+
+/**
+ * greybus_id_index_create - build the hash for a driver's id_table
+ *
+ * @id_table: the table, ending with an empty entry
+ *
+ * Returns NULL if there is no memory for it, or ERR_PTR(-ENOENT) if there
+ * is no table to begin with.
+ */
+struct greybus_id_index *greybus_id_index_create(
+		const struct greybus_module_id *id_table)
+{
+	const struct greybus_module_id *id;
+	struct greybus_id_index *index;
+	struct greybus_id_entry *entry;
+	unsigned int count = 0;
+	unsigned int buckets;
+	u16 flags;
+	u32 hash;
+
+	if (!id_table)
+		return ERR_PTR(-ENOENT);
+
+	for (id = id_table; !id_table_end(id); id++)
+		count++;
+
+	/* Keep the buckets about half full */
+	buckets = roundup_pow_of_two(max(2 * count, 1U));
+
+	index = kzalloc(sizeof(*index) + count * sizeof(*entry) +
+			buckets * sizeof(*index->buckets), GFP_KERNEL);
+	if (!index)
+		return NULL;
+
+	index->mask = buckets - 1;
+	index->buckets = (struct greybus_id_entry **)&index->entries[count];
+
+	/*
+	 * Add them in reverse, so that the first entry in the table is always
+	 * the first one found in its bucket, like a walk of the table would.
+	 */
+	while (count--) {
+		id = &id_table[count];
+		flags = id->match_flags & GREYBUS_ID_MATCH_MASK;
+		hash = id_hash(flags, id->vendor, id->product,
+			       id->serial_number);
+
+		entry = &index->entries[count];
+		entry->id = id;
+		entry->next = index->buckets[hash & index->mask];
+		index->buckets[hash & index->mask] = entry;
+		index->flags_used |= BIT(flags);
+	}
+
+	return index;
+}
+
+void greybus_id_index_destroy(struct greybus_id_index *index)
+{
+	if (!IS_ERR_OR_NULL(index))
+		kfree(index);
+}
+
+/**
+ * greybus_id_index_match - find the id table entry that matches a module
+ *
+ * @index: what greybus_id_index_create() made out of the id_table
+ * @vendor, @product, @serial_number: what the module says it is
+ *
+ * Returns the same entry a walk of the id_table would find first, or NULL.
+ */
+const struct greybus_module_id *greybus_id_index_match(
+		const struct greybus_id_index *index, u16 vendor, u16 product,
+		u64 serial_number)
+{
+	const struct greybus_module_id *match = NULL;
+	struct greybus_id_entry *entry;
+	u16 flags;
+	u32 hash;
+
+	if (IS_ERR_OR_NULL(index))
+		return NULL;
+
+	for (flags = 0; flags <= GREYBUS_ID_MATCH_MASK; flags++) {
+		if (!(index->flags_used & BIT(flags)))
+			continue;
+
+		hash = id_hash(flags, vendor, product, serial_number);
+		for (entry = index->buckets[hash & index->mask]; entry;
+		     entry = entry->next) {
+			if ((entry->id->match_flags & GREYBUS_ID_MATCH_MASK) ==
+			    flags &&
+			    id_equal(entry->id, vendor, product,
+				     serial_number)) {
+				/* The earliest entry in the table wins */
+				if (!match || entry->id < match)
+					match = entry->id;
+				break;
+			}
+		}
+	}
+
+	return match;
+}
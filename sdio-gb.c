@@ -71,6 +71,10 @@ void gb_sdio_disconnect(struct greybus_module *gmod)
 	struct gb_sdio_host *host;
 
 	host = gmod->gb_sdio_host;
+	if (!host)
+		return;
+
+	gmod->gb_sdio_host = NULL;
 	mmc = host->mmc;
 
 	mmc_remove_host(mmc);
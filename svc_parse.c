@@ -0,0 +1,147 @@
+/*
+ * Greybus SVC message checking
+ *
+ * Everything the SVC sends goes through here before any handler in ap.c
+ * gets to look at it.  Nothing in here needs more than the message itself,
+ * so it also builds in userspace, see tools/.
+ *
+ * Copyright 2014 Google Inc.
+ * Copyright 2026 The Greybus Authors
+ *
+ * Released under the GPLv2 only.
+ */
+
+#define pr_fmt(fmt) KBUILD_MODNAME ": " fmt
+
+#include <linux/types.h>
+#include <linux/kernel.h>
+#include <linux/device.h>
+#include "svc_msg.h"
+#include "greybus.h"
+
+/*
+ * How big the payload of every SVC function can be.  The sizes come straight
+ * from the structures in svc_msg.h, so every handler gets a message that is
+ * at least as big as the structure it looks at, and no handler has to check
+ * that for itself.
+ */
+struct svc_function_size {
+	const char *name;
+	u16 min_payload;
+	u16 max_payload;
+};
+
+#define SVC_FUNCTION_FIXED(_id, _name, _struct)				\
+	[_id] = {							\
+		.name		= _name,				\
+		.min_payload	= sizeof(_struct),			\
+		.max_payload	= sizeof(_struct),			\
+	}
+
+#define SVC_FUNCTION_VARIABLE(_id, _name, _struct)			\
+	[_id] = {							\
+		.name		= _name,				\
+		.min_payload	= sizeof(_struct),			\
+		.max_payload	= U16_MAX,				\
+	}
+
+static const struct svc_function_size svc_function_sizes[] = {
+	SVC_FUNCTION_FIXED(SVC_FUNCTION_HANDSHAKE, "handshake",
+			   struct svc_function_handshake),
+	SVC_FUNCTION_FIXED(SVC_FUNCTION_UNIPRO_NETWORK_MANAGEMENT, "management",
+			   struct svc_function_unipro_management),
+	SVC_FUNCTION_VARIABLE(SVC_FUNCTION_HOTPLUG, "hotplug",
+			      struct svc_function_hotplug),
+	SVC_FUNCTION_VARIABLE(SVC_FUNCTION_DDB, "ddb",
+			      struct svc_function_ddb),
+	/*
+	 * Only a battery status comes to the AP.  A battery status request,
+	 * just the power type and module id, goes the other way, so one
+	 * coming in is the wrong size, as svc_power() would refuse it anyway.
+	 */
+	SVC_FUNCTION_FIXED(SVC_FUNCTION_POWER, "power",
+			   struct svc_function_power),
+	SVC_FUNCTION_FIXED(SVC_FUNCTION_EPM, "epm",
+			   struct svc_function_epm),
+	SVC_FUNCTION_FIXED(SVC_FUNCTION_SUSPEND, "suspend",
+			   struct svc_function_suspend),
+};
+
+/* The sizes the "Greybus Application Protocol" document gives */
+static inline void svc_function_sizes_check(void)
+{
+	BUILD_BUG_ON(sizeof(struct svc_msg_header) != 4);
+	BUILD_BUG_ON(sizeof(struct svc_function_handshake) != 3);
+	BUILD_BUG_ON(sizeof(struct svc_function_unipro_management) != 5);
+	BUILD_BUG_ON(sizeof(struct svc_function_hotplug) != 2);
+	BUILD_BUG_ON(sizeof(struct svc_function_ddb) != 5);
+	BUILD_BUG_ON(sizeof(struct svc_function_power) != 7);
+	BUILD_BUG_ON(sizeof(struct svc_function_epm) != 2);
+	BUILD_BUG_ON(sizeof(struct svc_function_suspend) != 2);
+
+	/* Every function id needs an entry */
+	BUILD_BUG_ON(ARRAY_SIZE(svc_function_sizes) != GB_SVC_FUNCTIONS);
+}
+
+/* Returns NULL for a function id we don't know about */
+const char *gb_svc_function_name(u8 id)
+{
+	if (id >= ARRAY_SIZE(svc_function_sizes))
+		return NULL;
+	return svc_function_sizes[id].name;
+}
+
+/**
+ * gb_svc_msg_check - make sure a message from the SVC is what it says it is
+ *
+ * @parent: device to complain about a broken message to
+ * @data: the message, as the SVC sent it
+ * @size: size of @data
+ *
+ * Returns the payload length, -EINVAL if the header is broken, -ENOENT if
+ * the function is one we don't know, or -EMSGSIZE if the payload is the
+ * wrong size for the function.
+ */
+int gb_svc_msg_check(struct device *parent, const u8 *data, size_t size)
+{
+	const struct svc_msg_header *header = (const void *)data;
+	const struct svc_function_size *function;
+	u16 payload_length;
+
+	svc_function_sizes_check();
+
+	if (size < sizeof(*header)) {
+		dev_err(parent, "svc message too small, %zu bytes\n", size);
+		return -EINVAL;
+	}
+
+	/* Validate the message type */
+	if (header->message_type != SVC_MSG_DATA) {
+		dev_err(parent, "message type %d received?\n",
+			header->message_type);
+		return -EINVAL;
+	}
+
+	payload_length = le16_to_cpu(header->payload_length);
+	if (payload_length > size - sizeof(*header)) {
+		dev_err(parent, "svc payload length %d, but only %zu bytes\n",
+			payload_length, size - sizeof(*header));
+		return -EINVAL;
+	}
+
+	if (header->function_id >= ARRAY_SIZE(svc_function_sizes)) {
+		dev_err(parent, "received invalid SVC function ID %d\n",
+			header->function_id);
+		return -ENOENT;
+	}
+	function = &svc_function_sizes[header->function_id];
+
+	if (payload_length < function->min_payload ||
+	    payload_length > function->max_payload) {
+		dev_err(parent, "Illegal size of svc %s message %d\n",
+			function->name, payload_length);
+		return -EMSGSIZE;
+	}
+
+	return payload_length;
+}
@@ -27,7 +27,7 @@ static ssize_t function_##field##_show(struct device *dev,		\
 				       char *buf)			\
 {									\
 	struct greybus_module *gmod = to_greybus_module(dev);		\
-	return sprintf(buf, "%d\n", gmod->function.field);		\
+	return sprintf(buf, "%d\n", gmod->manifest->function.field);		\
 }									\
 static DEVICE_ATTR_RO(function_##field)
 
@@ -53,11 +53,11 @@ static umode_t function_attrs_are_visible(struct kobject *kobj,
 
 	// FIXME - make this a dynamic structure to "know" if it really is here
 	// or not easier?
-	if (gmod->function.number ||
-	    gmod->function.cport ||
-	    gmod->function.class ||
-	    gmod->function.subclass ||
-	    gmod->function.protocol)
+	if (gmod->manifest->function.number ||
+	    gmod->manifest->function.cport ||
+	    gmod->manifest->function.class ||
+	    gmod->manifest->function.subclass ||
+	    gmod->manifest->function.protocol)
 		return a->mode;
 	return 0;
 }
@@ -74,7 +74,7 @@ static ssize_t module_##field##_show(struct device *dev,		\
 				     char *buf)				\
 {									\
 	struct greybus_module *gmod = to_greybus_module(dev);		\
-	return sprintf(buf, "%x\n", gmod->module_id.field);		\
+	return sprintf(buf, "%x\n", gmod->manifest->module_id.field);		\
 }									\
 static DEVICE_ATTR_RO(module_##field)
 
@@ -82,14 +82,26 @@ greybus_module_attr(vendor);
 greybus_module_attr(product);
 greybus_module_attr(version);
 
+static ssize_t module_string_show(struct greybus_module *gmod, int id,
+				  char *buf)
+{
+	const u8 *string;
+	size_t length;
+
+	string = greybus_string(gmod, id, &length);
+	if (!string)
+		return 0;
+	return sprintf(buf, "%.*s", (int)length, string);
+}
+
 static ssize_t module_vendor_string_show(struct device *dev,
 					 struct device_attribute *attr,
 					 char *buf)
 {
 	struct greybus_module *gmod = to_greybus_module(dev);
 
-	return sprintf(buf, "%s",
-		       greybus_string(gmod, gmod->module_id.vendor_stringid));
+	return module_string_show(gmod,
+			gmod->manifest->module_id.vendor_stringid, buf);
 }
 static DEVICE_ATTR_RO(module_vendor_string);
 
@@ -99,8 +111,8 @@ static ssize_t module_product_string_show(struct device *dev,
 {
 	struct greybus_module *gmod = to_greybus_module(dev);
 
-	return sprintf(buf, "%s",
-		       greybus_string(gmod, gmod->module_id.product_stringid));
+	return module_string_show(gmod,
+			gmod->manifest->module_id.product_stringid, buf);
 }
 static DEVICE_ATTR_RO(module_product_string);
 
@@ -119,17 +131,17 @@ static umode_t module_attrs_are_visible(struct kobject *kobj,
 	struct greybus_module *gmod = to_greybus_module(kobj_to_dev(kobj));
 
 	if ((a == &dev_attr_module_vendor_string.attr) &&
-	    (gmod->module_id.vendor_stringid))
+	    (gmod->manifest->module_id.vendor_stringid))
 		return a->mode;
 	if ((a == &dev_attr_module_product_string.attr) &&
-	    (gmod->module_id.product_stringid))
+	    (gmod->manifest->module_id.product_stringid))
 		return a->mode;
 
 	// FIXME - make this a dynamic structure to "know" if it really is here
 	// or not easier?
-	if (gmod->module_id.vendor ||
-	    gmod->module_id.product ||
-	    gmod->module_id.version)
+	if (gmod->manifest->module_id.vendor ||
+	    gmod->manifest->module_id.product ||
+	    gmod->manifest->module_id.version)
 		return a->mode;
 	return 0;
 }
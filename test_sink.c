@@ -18,7 +18,7 @@ struct test_device {
 int gb_register_cport_complete(struct greybus_module *gmod,
 			       gbuf_complete_t handler, int cport,
 			       void *context);
-void gb_deregister_cport_complete(int cport);
+void gb_deregister_cport_complete(struct greybus_module *gmod, int cport);
 
 
 
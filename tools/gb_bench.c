@@ -0,0 +1,394 @@
+/*
+ * Greybus parser benchmark
+ *
+ * Runs the manifest parser, the SVC message checks, and the driver id
+ * matching from the kernel sources against made up input, and reports how
+ * fast they go, so a change that makes any of them slower shows up without
+ * having to plug in a single module.
+ *
+ *	gb_bench [-t seconds] [-w corpus_dir] [-v]
+ *
+ * -w also writes every input it makes up into corpus_dir, in the format
+ * gb_fuzz takes, as a seed corpus for fuzzing.
+ *
+ * Copyright 2026 The Greybus Authors
+ *
+ * Released under the GPLv2 only.
+ */
+
+#include <linux/types.h>
+#include <linux/kernel.h>
+#include <linux/slab.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "svc_msg.h"
+#include "greybus.h"
+#include "gb_fuzz.h"
+
+int kshim_verbose;
+
+static double min_seconds = 0.5;
+static const char *corpus_dir;
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Keep the compiler from throwing away results nobody looks at */
+static volatile unsigned long sink;
+
+static void write_seed(const char *name, u8 target, const u8 *data,
+		       size_t size)
+{
+	char path[4096];
+	FILE *file;
+
+	if (!corpus_dir)
+		return;
+
+	snprintf(path, sizeof(path), "%s/%s", corpus_dir, name);
+	file = fopen(path, "wb");
+	if (!file) {
+		perror(path);
+		exit(1);
+	}
+	fputc(target, file);
+	fwrite(data, 1, size, file);
+	fclose(file);
+}
+
+static void *add_descriptor(u8 **p, enum greybus_descriptor_type type,
+			    size_t size)
+{
+	struct greybus_descriptor_header *header;
+
+	header = (struct greybus_descriptor_header *)*p;
+	header->size = cpu_to_le16(sizeof(*header) + size);
+	header->type = cpu_to_le16(type);
+	*p += sizeof(*header) + size;
+	return header + 1;
+}
+
+/* What a made up manifest looks like */
+struct manifest_shape {
+	const char *name;
+	int num_cports;
+	int num_strings;
+	int string_length;
+};
+
+static const struct manifest_shape shapes[] = {
+	{ "tiny",	1,	1,	8 },
+	{ "typical",	4,	3,	24 },
+	{ "big",	32,	16,	64 },
+	{ "huge",	512,	128,	200 },
+};
+
+static size_t make_manifest(const struct manifest_shape *shape, u8 *buffer,
+			    size_t size, int *descriptors)
+{
+	struct greybus_manifest *manifest = (struct greybus_manifest *)buffer;
+	struct greybus_descriptor_function *function;
+	struct greybus_descriptor_module_id *id;
+	struct greybus_descriptor_serial_number *serial;
+	struct greybus_descriptor_string *string;
+	struct greybus_descriptor_cport *cport;
+	u8 *p = (u8 *)manifest->descriptors;
+	int i;
+
+	memset(buffer, 0, size);
+
+	function = add_descriptor(&p, GREYBUS_TYPE_FUNCTION, sizeof(*function));
+	function->class = GREYBUS_FUNCTION_UART;
+
+	id = add_descriptor(&p, GREYBUS_TYPE_MODULE_ID, sizeof(*id));
+	id->vendor = cpu_to_le16(0x42);
+	id->product = cpu_to_le16(0x43);
+	id->vendor_stringid = 1;
+	id->product_stringid = 2;
+
+	serial = add_descriptor(&p, GREYBUS_TYPE_SERIAL_NUMBER,
+				sizeof(*serial));
+	serial->serial_number = cpu_to_le64(0x1234567890ULL);
+
+	for (i = 0; i < shape->num_strings; ++i) {
+		string = add_descriptor(&p, GREYBUS_TYPE_STRING,
+					sizeof(*string) + shape->string_length);
+		string->length = cpu_to_le16(shape->string_length);
+		string->id = i + 1;
+		memset(string->string, 'a' + i % 26, shape->string_length);
+	}
+
+	for (i = 0; i < shape->num_cports; ++i) {
+		cport = add_descriptor(&p, GREYBUS_TYPE_CPORT, sizeof(*cport));
+		cport->number = cpu_to_le16(i);
+		cport->size = cpu_to_le16(64);
+	}
+
+	*descriptors = 3 + shape->num_strings + shape->num_cports;
+	manifest->header.size = cpu_to_le16(p - buffer);
+	manifest->header.version_major = GREYBUS_VERSION_MAJOR;
+	manifest->header.version_minor = GREYBUS_VERSION_MINOR;
+	return p - buffer;
+}
+
+static void bench_manifests(void)
+{
+	static u8 buffer[U16_MAX];
+	const struct manifest_shape *shape;
+	struct gb_manifest *manifest;
+	unsigned long count;
+	int descriptors;
+	size_t size;
+	double start;
+	double elapsed;
+	char name[64];
+	int i;
+
+	printf("%-10s %8s %6s %14s %12s %12s\n", "manifest", "bytes", "descs",
+	       "manifests/sec", "ns/manifest", "ns/desc");
+
+	for (i = 0; i < ARRAY_SIZE(shapes); ++i) {
+		shape = &shapes[i];
+		size = make_manifest(shape, buffer, sizeof(buffer),
+				     &descriptors);
+		snprintf(name, sizeof(name), "manifest-%s", shape->name);
+		write_seed(name, GB_FUZZ_MANIFEST, buffer, size);
+
+		/* Make sure it's good before timing it */
+		manifest = gb_manifest_parse(NULL, buffer, size);
+		if (!manifest || manifest->num_cports != shape->num_cports ||
+		    manifest->num_strings != shape->num_strings) {
+			fprintf(stderr, "%s manifest didn't parse\n",
+				shape->name);
+			exit(1);
+		}
+		kfree(manifest);
+
+		count = 0;
+		start = now();
+		do {
+			manifest = gb_manifest_parse(NULL, buffer, size);
+			sink += manifest->num_cports;
+			kfree(manifest);
+			count++;
+		} while ((count & 0xff) || now() - start < min_seconds);
+		elapsed = now() - start;
+
+		printf("%-10s %8zu %6d %14.0f %12.1f %12.2f\n", shape->name,
+		       size, descriptors, count / elapsed,
+		       elapsed * 1e9 / count,
+		       elapsed * 1e9 / count / descriptors);
+	}
+}
+
+static size_t make_svc_msg(u8 function_id, u8 *buffer, size_t size)
+{
+	struct svc_msg *svc_msg = (struct svc_msg *)buffer;
+	static const u16 payload[] = {
+		[SVC_FUNCTION_HANDSHAKE] =
+			sizeof(struct svc_function_handshake),
+		[SVC_FUNCTION_UNIPRO_NETWORK_MANAGEMENT] =
+			sizeof(struct svc_function_unipro_management),
+		[SVC_FUNCTION_HOTPLUG] =
+			sizeof(struct svc_function_hotplug) + 64,
+		[SVC_FUNCTION_DDB] = sizeof(struct svc_function_ddb),
+		[SVC_FUNCTION_POWER] = sizeof(struct svc_function_power),
+		[SVC_FUNCTION_EPM] = sizeof(struct svc_function_epm),
+		[SVC_FUNCTION_SUSPEND] = sizeof(struct svc_function_suspend),
+	};
+
+	memset(buffer, 0, size);
+	svc_msg->header.function_id = function_id;
+	svc_msg->header.message_type = SVC_MSG_DATA;
+	svc_msg->header.payload_length = cpu_to_le16(payload[function_id]);
+	return sizeof(svc_msg->header) + payload[function_id];
+}
+
+static void bench_svc(void)
+{
+	u8 buffer[256];
+	unsigned long count;
+	double start;
+	double elapsed;
+	char name[64];
+	size_t size;
+	u8 id;
+
+	printf("\n%-10s %8s %14s %12s\n", "svc", "bytes", "messages/sec",
+	       "ns/message");
+
+	for (id = 0; id < GB_SVC_FUNCTIONS; ++id) {
+		size = make_svc_msg(id, buffer, sizeof(buffer));
+		snprintf(name, sizeof(name), "svc-%s", gb_svc_function_name(id));
+		write_seed(name, GB_FUZZ_SVC, buffer, size);
+
+		if (gb_svc_msg_check(NULL, buffer, size) < 0) {
+			fprintf(stderr, "svc %s message didn't check out\n",
+				gb_svc_function_name(id));
+			exit(1);
+		}
+
+		count = 0;
+		start = now();
+		do {
+			sink += gb_svc_msg_check(NULL, buffer, size);
+			count++;
+		} while ((count & 0xffff) || now() - start < min_seconds);
+		elapsed = now() - start;
+
+		printf("%-10s %8zu %14.0f %12.2f\n", gb_svc_function_name(id),
+		       size, count / elapsed, elapsed * 1e9 / count);
+	}
+}
+
+/* What greybus_match_id() used to do, walk the whole table */
+static const struct greybus_module_id *walk_id_table(
+		const struct greybus_module_id *id, u16 vendor, u16 product,
+		u64 serial_number)
+{
+	for (; id->vendor || id->product || id->serial_number ||
+	       id->driver_info; id++) {
+		if ((id->match_flags & GREYBUS_DEVICE_ID_MATCH_VENDOR) &&
+		    id->vendor != vendor)
+			continue;
+		if ((id->match_flags & GREYBUS_DEVICE_ID_MATCH_PRODUCT) &&
+		    id->product != product)
+			continue;
+		if ((id->match_flags & GREYBUS_DEVICE_ID_MATCH_SERIAL) &&
+		    id->serial_number != serial_number)
+			continue;
+		return id;
+	}
+	return NULL;
+}
+
+/*
+ * An id table like a driver for a lot of different modules would have, most
+ * entries are a vendor and product, with some serial number quirks, and a
+ * catch-all for the vendor at the very end.
+ */
+static struct greybus_module_id *make_id_table(int entries)
+{
+	struct greybus_module_id *table;
+	int i;
+
+	table = calloc(entries + 2, sizeof(*table));
+	for (i = 0; i < entries; ++i) {
+		table[i].vendor = 0x42 + i % 7;
+		table[i].product = i;
+		table[i].match_flags = GREYBUS_DEVICE_ID_MATCH_DEVICE;
+		table[i].driver_info = i + 1;
+		if (i % 16 == 0) {
+			table[i].serial_number = 1000 + i;
+			table[i].match_flags = GREYBUS_DEVICE_ID_MATCH_SERIAL;
+		}
+	}
+	table[entries].vendor = 0x42;
+	table[entries].match_flags = GREYBUS_DEVICE_ID_MATCH_VENDOR;
+	table[entries].driver_info = entries + 1;
+	return table;
+}
+
+static void bench_match(void)
+{
+	static const int sizes[] = { 16, 256, 4096, 16384 };
+	struct greybus_id_index *index;
+	struct greybus_module_id *table;
+	const struct greybus_module_id *walked;
+	const struct greybus_module_id *found;
+	unsigned long count;
+	double start;
+	double walk_ns;
+	double index_ns;
+	u16 product;
+	int i;
+
+	printf("\n%-10s %14s %14s\n", "id table", "walk ns/match",
+	       "index ns/match");
+
+	for (i = 0; i < ARRAY_SIZE(sizes); ++i) {
+		table = make_id_table(sizes[i]);
+		index = greybus_id_index_create(table);
+		if (IS_ERR_OR_NULL(index)) {
+			fprintf(stderr, "can't index %d ids\n", sizes[i]);
+			exit(1);
+		}
+
+		/* The index has to find what the walk finds, every time */
+		for (product = 0; product < sizes[i] + 16; ++product) {
+			walked = walk_id_table(table, 0x42 + product % 7,
+					       product, 1000 + product);
+			found = greybus_id_index_match(index,
+						       0x42 + product % 7,
+						       product, 1000 + product);
+			if (walked != found) {
+				fprintf(stderr, "id %d: index found %td, walk found %td\n",
+					product, found ? found - table : -1,
+					walked ? walked - table : -1);
+				exit(1);
+			}
+		}
+
+		count = 0;
+		start = now();
+		do {
+			product = count % (sizes[i] + 16);
+			sink += (unsigned long)walk_id_table(table,
+					0x42 + product % 7, product, 0);
+			count++;
+		} while ((count & 0xff) || now() - start < min_seconds);
+		walk_ns = (now() - start) * 1e9 / count;
+
+		count = 0;
+		start = now();
+		do {
+			product = count % (sizes[i] + 16);
+			sink += (unsigned long)greybus_id_index_match(index,
+					0x42 + product % 7, product, 0);
+			count++;
+		} while ((count & 0xff) || now() - start < min_seconds);
+		index_ns = (now() - start) * 1e9 / count;
+
+		printf("%-10d %14.1f %14.1f\n", sizes[i], walk_ns, index_ns);
+
+		greybus_id_index_destroy(index);
+		free(table);
+	}
+}
+
+int main(int argc, char **argv)
+{
+	int opt;
+
+	while ((opt = getopt(argc, argv, "t:w:v")) != -1) {
+		switch (opt) {
+		case 't':
+			min_seconds = atof(optarg);
+			break;
+		case 'w':
+			corpus_dir = optarg;
+			mkdir(corpus_dir, 0755);
+			break;
+		case 'v':
+			kshim_verbose = 1;
+			break;
+		default:
+			fprintf(stderr,
+				"usage: %s [-t seconds] [-w corpus_dir] [-v]\n",
+				argv[0]);
+			return 1;
+		}
+	}
+
+	bench_manifests();
+	bench_svc();
+	bench_match();
+	return 0;
+}
@@ -0,0 +1,158 @@
+/*
+ * Greybus parser fuzzer
+ *
+ * Feeds whatever the fuzzer comes up with to the manifest parser and the
+ * SVC message checks from the kernel sources, and makes sure that what
+ * they accept really is sane.  Builds as a libFuzzer target by default:
+ *
+ *	make fuzz && ./gb_fuzz corpus
+ *
+ * or, with GB_FUZZ_STANDALONE, as a program that runs every file given to
+ * it, or stdin, once, which is what AFL wants and is handy for replaying a
+ * crash:
+ *
+ *	make fuzz-afl && afl-fuzz -i corpus -o findings -- ./gb_fuzz_afl
+ *
+ * "gb_bench -w corpus" writes out a seed corpus.
+ *
+ * Copyright 2026 The Greybus Authors
+ *
+ * Released under the GPLv2 only.
+ */
+
+#include <linux/types.h>
+#include <linux/kernel.h>
+#include <linux/slab.h>
+#include <limits.h>
+
+#include "svc_msg.h"
+#include "greybus.h"
+#include "gb_fuzz.h"
+
+int kshim_verbose;
+
+#define fuzz_assert(cond)						\
+	do {								\
+		if (!(cond)) {						\
+			fprintf(stderr, "%s:%d: %s\n", __FILE__,	\
+				__LINE__, #cond);			\
+			abort();					\
+		}							\
+	} while (0)
+
+static void fuzz_manifest(u8 *data, size_t size)
+{
+	struct gb_manifest *manifest;
+	struct gmod_string *string;
+	int i;
+
+	if (size > INT_MAX)
+		return;
+
+	manifest = gb_manifest_parse(NULL, data, size);
+	if (!manifest)
+		return;
+
+	/* Anything that parses has to say what the raw manifest says */
+	fuzz_assert(manifest->raw_size == size);
+	fuzz_assert(!memcmp(manifest->raw, data, size));
+	fuzz_assert(manifest->num_cports >= 0);
+	fuzz_assert(manifest->num_strings >= 0);
+
+	for (i = 0; i < manifest->num_strings; ++i) {
+		string = &manifest->string[i];
+		fuzz_assert(string->length < size);
+		fuzz_assert(string->string[string->length] == '\0');
+	}
+	fuzz_assert((void *)(manifest->string + manifest->num_strings) <=
+		    (void *)manifest->cport);
+
+	/* Every string can be found by its id, every id finds its string */
+	for (i = 0; i < manifest->num_strings; ++i) {
+		string = &manifest->string[i];
+		fuzz_assert(string->id < manifest->num_string_ids);
+		fuzz_assert(manifest->string_by_id[string->id]);
+	}
+	for (i = 0; i < manifest->num_string_ids; ++i)
+		fuzz_assert(!manifest->string_by_id[i] ||
+			    manifest->string_by_id[i]->id == i);
+
+	kfree(manifest);
+}
+
+static void fuzz_svc(u8 *data, size_t size)
+{
+	const struct svc_msg_header *header = (const void *)data;
+	int payload_length;
+
+	payload_length = gb_svc_msg_check(NULL, data, size);
+	if (payload_length < 0)
+		return;
+
+	/* What checks out has to fit in the message, with a known function */
+	fuzz_assert(size >= sizeof(*header));
+	fuzz_assert(payload_length <= size - sizeof(*header));
+	fuzz_assert(payload_length == le16_to_cpu(header->payload_length));
+	fuzz_assert(gb_svc_function_name(header->function_id));
+}
+
+int LLVMFuzzerTestOneInput(const u8 *data, size_t size)
+{
+	u8 target;
+	u8 *buffer;
+
+	if (!size)
+		return 0;
+	target = data[0];
+	data++;
+	size--;
+
+	/* A copy exactly as big as the input, so overruns get caught */
+	buffer = malloc(size ? size : 1);
+	if (!buffer)
+		return 0;
+	memcpy(buffer, data, size);
+
+	switch (target % GB_FUZZ_TARGETS) {
+	case GB_FUZZ_MANIFEST:
+		fuzz_manifest(buffer, size);
+		break;
+	case GB_FUZZ_SVC:
+		fuzz_svc(buffer, size);
+		break;
+	}
+
+	free(buffer);
+	return 0;
+}
+
+#ifdef GB_FUZZ_STANDALONE
+static int run_file(FILE *file)
+{
+	static u8 buffer[1 << 20];
+	size_t size;
+
+	size = fread(buffer, 1, sizeof(buffer), file);
+	return LLVMFuzzerTestOneInput(buffer, size);
+}
+
+int main(int argc, char **argv)
+{
+	FILE *file;
+	int i;
+
+	if (argc < 2)
+		return run_file(stdin);
+
+	for (i = 1; i < argc; ++i) {
+		file = fopen(argv[i], "rb");
+		if (!file) {
+			perror(argv[i]);
+			return 1;
+		}
+		run_file(file);
+		fclose(file);
+	}
+	return 0;
+}
+#endif
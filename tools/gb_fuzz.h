@@ -0,0 +1,21 @@
+/*
+ * Greybus parser fuzzing
+ *
+ * The first byte of every input says which parser the rest of it is for,
+ * so one corpus, and one fuzzer, covers all of them.
+ *
+ * Copyright 2026 The Greybus Authors
+ *
+ * Released under the GPLv2 only.
+ */
+
+#ifndef __GB_FUZZ_H
+#define __GB_FUZZ_H
+
+enum gb_fuzz_target {
+	GB_FUZZ_MANIFEST	= 0x00,	/* gb_manifest_parse() */
+	GB_FUZZ_SVC		= 0x01,	/* gb_svc_msg_check() */
+	GB_FUZZ_TARGETS,
+};
+
+#endif /* __GB_FUZZ_H */
@@ -0,0 +1,185 @@
+/*
+ * ttyGB open/close benchmark
+ *
+ * Opens and closes ttyGB ports from a number of threads at the same time,
+ * each thread going round a set of ports no other thread touches, so every
+ * open is a first open, and reports how many open/close pairs per second
+ * that came to, so contention on the minor lookup shows up as it not
+ * scaling with the threads.  There are never more threads than ports.  Plug
+ * in as many modules as there are ports to test first, for example with
+ * the loopback host:
+ *
+ *	for i in $(seq 0 63); do
+ *		echo $i > /sys/kernel/debug/greybus/loopback/hotplug
+ *	done
+ *	gb_tty_open -p 64
+ *
+ *	gb_tty_open [-p ports] [-t seconds] [-j threads]
+ *
+ * Without -j it runs with 1, 2, 4, ... threads, up to the number of cpus.
+ *
+ * Copyright 2026 The Greybus Authors
+ *
+ * Released under the GPLv2 only.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+static int ports = 16;
+static double seconds = 2.0;
+
+static volatile int stop;
+
+struct worker {
+	pthread_t thread;
+	unsigned int seed;
+	int first;		/* its ports are first, first + stride, ... */
+	int stride;
+	int count;
+	unsigned long opens;
+	unsigned long errors;
+};
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void *worker_run(void *data)
+{
+	struct worker *worker = data;
+	char path[64];
+	int port;
+	int fd;
+
+	while (!stop) {
+		port = worker->first +
+		       rand_r(&worker->seed) % worker->count * worker->stride;
+		snprintf(path, sizeof(path), "/dev/ttyGB%d", port);
+
+		fd = open(path, O_RDWR | O_NOCTTY | O_NONBLOCK);
+		if (fd < 0) {
+			worker->errors++;
+			continue;
+		}
+		close(fd);
+		worker->opens++;
+	}
+	return NULL;
+}
+
+static int run(int threads)
+{
+	struct worker *workers;
+	unsigned long opens = 0;
+	unsigned long errors = 0;
+	double start;
+	double elapsed;
+	int i;
+
+	if (threads > ports)
+		threads = ports;
+
+	workers = calloc(threads, sizeof(*workers));
+	if (!workers)
+		return -1;
+
+	stop = 0;
+	start = now();
+	for (i = 0; i < threads; ++i) {
+		workers[i].seed = i + 1;
+		workers[i].first = i;
+		workers[i].stride = threads;
+		workers[i].count = (ports - i + threads - 1) / threads;
+		if (pthread_create(&workers[i].thread, NULL, worker_run,
+				   &workers[i])) {
+			fprintf(stderr, "can't start thread %d\n", i);
+			stop = 1;
+			threads = i;
+			break;
+		}
+	}
+
+	usleep(seconds * 1e6);
+	stop = 1;
+
+	for (i = 0; i < threads; ++i) {
+		pthread_join(workers[i].thread, NULL);
+		opens += workers[i].opens;
+		errors += workers[i].errors;
+	}
+	elapsed = now() - start;
+
+	printf("%7d %12.0f %10.2f %8lu\n", threads, opens / elapsed,
+	       opens ? elapsed * threads * 1e6 / opens : 0.0, errors);
+	free(workers);
+	return opens ? 0 : -1;
+}
+
+int main(int argc, char *argv[])
+{
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	int threads = 0;
+	int retval = 0;
+	int opt;
+	int i;
+
+	while ((opt = getopt(argc, argv, "p:t:j:")) != -1) {
+		switch (opt) {
+		case 'p':
+			ports = atoi(optarg);
+			break;
+		case 't':
+			seconds = atof(optarg);
+			break;
+		case 'j':
+			threads = atoi(optarg);
+			break;
+		default:
+			fprintf(stderr,
+				"usage: %s [-p ports] [-t seconds] [-j threads]\n",
+				argv[0]);
+			return 1;
+		}
+	}
+	if (ports < 1) {
+		fprintf(stderr, "need at least one port\n");
+		return 1;
+	}
+
+	/* Make sure they are all there, or all we'd measure is errors */
+	for (i = 0; i < ports; ++i) {
+		char path[64];
+		int fd;
+
+		snprintf(path, sizeof(path), "/dev/ttyGB%d", i);
+		fd = open(path, O_RDWR | O_NOCTTY | O_NONBLOCK);
+		if (fd < 0) {
+			perror(path);
+			return 1;
+		}
+		close(fd);
+	}
+
+	printf("threads  open_close/s  us_per_op   errors\n");
+	if (threads > 0)
+		return run(threads) ? 1 : 0;
+
+	if (cpus > ports)
+		cpus = ports;
+	for (i = 1; i <= cpus; i *= 2)
+		retval |= run(i);
+	if (i / 2 != cpus)
+		retval |= run(cpus);
+	return retval ? 1 : 0;
+}
@@ -0,0 +1,213 @@
+/*
+ * ttyGB round trip latency benchmark
+ *
+ * Sends small messages on a ttyGB port, waits for each one to come back,
+ * and reports how long that took, once with the port batching writes for
+ * throughput and once in low latency mode.  The other end has to echo
+ * everything back, which is what a module on the loopback host does:
+ *
+ *	modprobe loopback-hd
+ *	echo 1 > /sys/kernel/debug/greybus/loopback/hotplug
+ *	gb_tty_rtt -d /dev/ttyGB0
+ *
+ *	gb_tty_rtt [-d device] [-n count] [-s size] [-m batch|low|both]
+ *
+ * Copyright 2026 The Greybus Authors
+ *
+ * Released under the GPLv2 only.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <linux/serial.h>
+
+#define MAX_SIZE	4096
+
+static const char *device = "/dev/ttyGB0";
+static int count = 1000;
+static int size = 16;
+
+static long long now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static int compare(const void *a, const void *b)
+{
+	long long x = *(const long long *)a;
+	long long y = *(const long long *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static int set_low_latency(int fd, int low_latency)
+{
+	struct serial_struct serial;
+
+	if (ioctl(fd, TIOCGSERIAL, &serial)) {
+		perror("TIOCGSERIAL");
+		return -1;
+	}
+	if (low_latency)
+		serial.flags |= ASYNC_LOW_LATENCY;
+	else
+		serial.flags &= ~ASYNC_LOW_LATENCY;
+	if (ioctl(fd, TIOCSSERIAL, &serial)) {
+		perror("TIOCSSERIAL");
+		return -1;
+	}
+	return 0;
+}
+
+/* Read exactly @length bytes, or give up after a second without any */
+static int read_all(int fd, unsigned char *buffer, int length)
+{
+	struct pollfd pfd = { .fd = fd, .events = POLLIN };
+	int done = 0;
+	int n;
+
+	while (done < length) {
+		n = poll(&pfd, 1, 1000);
+		if (n <= 0) {
+			fprintf(stderr, "%s: nothing came back after %d of %d bytes\n",
+				device, done, length);
+			return -1;
+		}
+		n = read(fd, buffer + done, length - done);
+		if (n < 0) {
+			if (errno == EAGAIN || errno == EINTR)
+				continue;
+			perror("read");
+			return -1;
+		}
+		done += n;
+	}
+	return 0;
+}
+
+static int run(int fd, const char *name, int low_latency)
+{
+	unsigned char out[MAX_SIZE];
+	unsigned char in[MAX_SIZE];
+	long long *rtt;
+	long long total = 0;
+	long long start;
+	int i;
+	int j;
+
+	if (set_low_latency(fd, low_latency))
+		return -1;
+	tcflush(fd, TCIOFLUSH);
+
+	rtt = calloc(count, sizeof(*rtt));
+	if (!rtt)
+		return -1;
+
+	for (i = 0; i < count; ++i) {
+		for (j = 0; j < size; ++j)
+			out[j] = i + j;
+
+		start = now_ns();
+		if (write(fd, out, size) != size) {
+			perror("write");
+			goto error;
+		}
+		if (read_all(fd, in, size))
+			goto error;
+		rtt[i] = now_ns() - start;
+
+		if (memcmp(out, in, size)) {
+			fprintf(stderr, "%s: message %d came back different\n",
+				device, i);
+			goto error;
+		}
+		total += rtt[i];
+	}
+
+	qsort(rtt, count, sizeof(*rtt), compare);
+	printf("%-6s %6d %5d %9.1f %9.1f %9.1f %9.1f %9.1f\n", name, count,
+	       size, total / 1000.0 / count, rtt[0] / 1000.0,
+	       rtt[count / 2] / 1000.0, rtt[count * 99 / 100] / 1000.0,
+	       rtt[count - 1] / 1000.0);
+	free(rtt);
+	return 0;
+
+error:
+	free(rtt);
+	return -1;
+}
+
+int main(int argc, char *argv[])
+{
+	const char *mode = "both";
+	struct termios tio;
+	int retval = 0;
+	int opt;
+	int fd;
+
+	while ((opt = getopt(argc, argv, "d:n:s:m:")) != -1) {
+		switch (opt) {
+		case 'd':
+			device = optarg;
+			break;
+		case 'n':
+			count = atoi(optarg);
+			break;
+		case 's':
+			size = atoi(optarg);
+			break;
+		case 'm':
+			mode = optarg;
+			break;
+		default:
+			fprintf(stderr,
+				"usage: %s [-d device] [-n count] [-s size] [-m batch|low|both]\n",
+				argv[0]);
+			return 1;
+		}
+	}
+	if (count < 1 || size < 1 || size > MAX_SIZE) {
+		fprintf(stderr, "count must be at least 1, size 1 to %d\n",
+			MAX_SIZE);
+		return 1;
+	}
+
+	fd = open(device, O_RDWR | O_NOCTTY | O_NONBLOCK);
+	if (fd < 0) {
+		perror(device);
+		return 1;
+	}
+
+	/* Bytes in, bytes out, nothing in between */
+	if (tcgetattr(fd, &tio)) {
+		perror("tcgetattr");
+		return 1;
+	}
+	cfmakeraw(&tio);
+	tio.c_cflag |= CLOCAL;
+	if (tcsetattr(fd, TCSANOW, &tio)) {
+		perror("tcsetattr");
+		return 1;
+	}
+
+	printf("mode    count  size    avg_us    min_us    p50_us    p99_us    max_us\n");
+	if (strcmp(mode, "low"))
+		retval |= run(fd, "batch", 0);
+	if (strcmp(mode, "batch"))
+		retval |= run(fd, "low", 1);
+
+	set_low_latency(fd, 0);
+	close(fd);
+	return retval ? 1 : 0;
+}
@@ -0,0 +1,164 @@
+/*
+ * Just enough of the kernel for the greybus parsers to build in userspace.
+ *
+ * Everything greybus.h needs is here, but only what the parsers actually
+ * call does anything, the rest are empty types so the structures that
+ * mention them still compile.
+ *
+ * Copyright 2026 The Greybus Authors
+ *
+ * Released under the GPLv2 only.
+ */
+
+#ifndef __KSHIM_H
+#define __KSHIM_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <endian.h>
+
+typedef uint8_t u8;
+typedef uint16_t u16;
+typedef uint32_t u32;
+typedef uint64_t u64;
+typedef int32_t s32;
+typedef int64_t s64;
+typedef uint8_t __u8;
+typedef uint16_t __u16;
+typedef uint32_t __u32;
+typedef uint64_t __u64;
+typedef int32_t __s32;
+typedef uint16_t __le16;
+typedef uint32_t __le32;
+typedef uint64_t __le64;
+typedef unsigned long kernel_ulong_t;
+typedef unsigned int gfp_t;
+typedef struct { int event; } pm_message_t;
+typedef s64 ktime_t;
+typedef struct { int counter; } atomic_t;
+typedef struct { int locked; } spinlock_t;
+typedef struct { int unused; } wait_queue_head_t;
+
+struct list_head { struct list_head *next, *prev; };
+struct hlist_node { struct hlist_node *next, **pprev; };
+struct kref { atomic_t refcount; };
+struct mutex { int unused; };
+struct idr { int unused; };
+struct work_struct { int unused; };
+struct module;
+struct dentry;
+struct attribute_group;
+struct device_driver { const char *name; };
+struct device { void *driver_data; };
+
+#define GFP_KERNEL		0
+#define GFP_ATOMIC		1
+#define THIS_MODULE		((struct module *)NULL)
+#define module_driver(__driver, __register, __unregister, ...)
+
+#define U16_MAX			((u16)~0U)
+#define BIT(nr)			(1UL << (nr))
+#define ARRAY_SIZE(arr)		(sizeof(arr) / sizeof((arr)[0]))
+#define BUILD_BUG_ON(cond)	((void)sizeof(char[1 - 2 * !!(cond)]))
+#define container_of(ptr, type, member) \
+	((type *)((char *)(ptr) - offsetof(type, member)))
+
+#define min(x, y)		((x) < (y) ? (x) : (y))
+#define max(x, y)		((x) > (y) ? (x) : (y))
+#define min_t(type, x, y)	min((type)(x), (type)(y))
+#define max_t(type, x, y)	max((type)(x), (type)(y))
+#define min_not_zero(x, y)	\
+	((x) == 0 ? (y) : ((y) == 0 ? (x) : min(x, y)))
+
+#define le16_to_cpu(x)		le16toh(x)
+#define le32_to_cpu(x)		le32toh(x)
+#define le64_to_cpu(x)		le64toh(x)
+#define cpu_to_le16(x)		htole16(x)
+#define cpu_to_le32(x)		htole32(x)
+#define cpu_to_le64(x)		htole64(x)
+
+#define MAX_ERRNO		4095
+#define IS_ERR_VALUE(x)		((unsigned long)(x) >= (unsigned long)-MAX_ERRNO)
+static inline void *ERR_PTR(long error) { return (void *)error; }
+static inline long PTR_ERR(const void *ptr) { return (long)ptr; }
+static inline bool IS_ERR(const void *ptr) { return IS_ERR_VALUE(ptr); }
+static inline bool IS_ERR_OR_NULL(const void *ptr)
+{
+	return !ptr || IS_ERR_VALUE(ptr);
+}
+
+static inline void *kzalloc(size_t size, gfp_t flags)
+{
+	return calloc(1, size);
+}
+
+static inline void *kmalloc(size_t size, gfp_t flags)
+{
+	return malloc(size);
+}
+
+static inline void kfree(const void *ptr)
+{
+	free((void *)ptr);
+}
+
+static inline unsigned long roundup_pow_of_two(unsigned long n)
+{
+	unsigned long power = 1;
+
+	while (power < n)
+		power <<= 1;
+	return power;
+}
+
+static inline void dev_set_drvdata(struct device *dev, void *data)
+{
+	dev->driver_data = data;
+}
+
+static inline void *dev_get_drvdata(const struct device *dev)
+{
+	return dev->driver_data;
+}
+
+/* Set to see what the parsers complain about, off so fuzzing stays quiet */
+extern int kshim_verbose;
+
+#define dev_err(dev, fmt, ...)						\
+	do {								\
+		if (kshim_verbose)					\
+			fprintf(stderr, fmt, ##__VA_ARGS__);		\
+	} while (0)
+#define pr_err(fmt, ...)	dev_err(NULL, fmt, ##__VA_ARGS__)
+
+/* The kernel's jhash_3words(), the one match.c uses */
+#define JHASH_INITVAL		0xdeadbeef
+
+static inline u32 rol32(u32 word, unsigned int shift)
+{
+	return (word << shift) | (word >> (32 - shift));
+}
+
+static inline u32 jhash_3words(u32 a, u32 b, u32 c, u32 initval)
+{
+	a += JHASH_INITVAL;
+	b += JHASH_INITVAL;
+	c += initval;
+
+	c ^= b; c -= rol32(b, 14);
+	a ^= c; a -= rol32(c, 11);
+	b ^= a; b -= rol32(a, 25);
+	c ^= b; c -= rol32(b, 16);
+	a ^= c; a -= rol32(c, 4);
+	b ^= a; b -= rol32(a, 14);
+	c ^= b; c -= rol32(b, 24);
+
+	return c;
+}
+
+#endif /* __KSHIM_H */
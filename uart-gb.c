@@ -18,6 +18,7 @@
 #include <linux/slab.h>
 #include <linux/uaccess.h>
 #include <linux/mutex.h>
+#include <linux/rcupdate.h>
 #include <linux/tty.h>
 #include <linux/serial.h>
 #include <linux/tty_driver.h>
@@ -26,27 +27,128 @@
 #include <linux/idr.h>
 #include <linux/fs.h>
 #include <linux/kdev_t.h>
+#include <linux/kfifo.h>
 #include "greybus.h"
 
 #define GB_NUM_MINORS	255	/* 255 is enough for anyone... */
 #define GB_NAME		"ttyGB"
 
+#define GB_TTY_WRITE_FIFO_SIZE	4096	/* must be a power of 2 */
+#define GB_TTY_WRITE_GBUFS	4	/* how many can be in flight at once */
+#define GB_TTY_READ_HELD_MAX	65536	/* bytes held on to while throttled */
+
+/*
+ * Every message on the UART cport starts with this header, and then has
+ * @size bytes of whatever @type says it is.
+ */
+#pragma pack(push, 1)
+struct gb_uart_msg_header {
+	__u8	type;		/* enum gb_uart_msg_type */
+	__u8	reserved;
+	__le16	size;
+};
+#pragma pack(pop)
+
+enum gb_uart_msg_type {
+	GB_UART_MSG_INVALID	= 0x00,
+	GB_UART_MSG_DATA	= 0x01,	/* bytes to send, or that came in */
+	GB_UART_MSG_LINE_CODING	= 0x02,	/* struct gb_uart_line_coding */
+	GB_UART_MSG_CONTROL	= 0x03,	/* struct gb_uart_control */
+	GB_UART_MSG_SERIAL_STATE = 0x04, /* struct gb_uart_serial_state */
+};
+
+#pragma pack(push, 1)
+struct gb_uart_line_coding {
+	__le32	rate;
+	__u8	format;		/* stop bits: 0 is 1, 1 is 1.5, 2 is 2 */
+	__u8	parity;		/* none, odd, even, mark, space */
+	__u8	data;		/* bits */
+};
+
+/* The lines the host sets */
+struct gb_uart_control {
+	__le16	control;
+};
+#define GB_UART_CTRL_DTR	BIT(0)
+#define GB_UART_CTRL_RTS	BIT(1)
+#define GB_UART_CTRL_BRK	BIT(2)	/* send a break until cleared */
+
+/* The lines the module sees, and the errors it had, whenever they change */
+struct gb_uart_serial_state {
+	__le16	state;
+};
+#pragma pack(pop)
+#define GB_UART_STATE_DCD	BIT(0)
+#define GB_UART_STATE_DSR	BIT(1)
+#define GB_UART_STATE_BRK	BIT(2)
+#define GB_UART_STATE_RI	BIT(3)
+#define GB_UART_STATE_FRAMING	BIT(4)
+#define GB_UART_STATE_PARITY	BIT(5)
+#define GB_UART_STATE_OVERRUN	BIT(6)
+
+/* Biggest message we send on our own, besides data */
+#define GB_UART_CTRL_MSG_SIZE	(sizeof(struct gb_uart_msg_header) + \
+				 sizeof(struct gb_uart_line_coding))
+
 struct gb_tty {
 	struct tty_port port;
 	struct greybus_module *gmod;
-	int cport;
+	struct gmod_cport *cport;
 	unsigned int minor;
 	unsigned char clocal;
-	unsigned int throttled:1;
+	unsigned int pushing:1;		/* see gb_tty_read_held() */
 	unsigned int throttle_req:1;
 	bool disconnected;
-	int writesize;		// FIXME - set this somehow.
+	bool low_latency;	/* see gb_tty_set_low_latency() */
+
+	/*
+	 * Throttling drops RTS, so the module stops sending.  What was
+	 * already on its way when it did is not thrown away, the gbufs it
+	 * came in are held on to, in order, in @read_held, and handed to the
+	 * tty when it unthrottles.  Only one caller at a time hands data to
+	 * the tty, whatever comes in meanwhile queues up behind it on
+	 * @read_held too.  @read_lock covers them, the throttle bits and
+	 * @iocount.
+	 */
 	spinlock_t read_lock;
+	struct list_head read_held;
+	size_t read_held_bytes;
+	u16 ctrlin;		/* GB_UART_STATE_*, the last the module said */
+
+	/*
+	 * Writes go into @write_fifo, and are sent from there in the gbufs
+	 * that are free, each one packed with as much as fits in one transfer
+	 * on the cport.  @write_lock covers all of it.
+	 */
 	spinlock_t write_lock;
+	struct kfifo write_fifo;
+	struct gbuf *write_gbufs[GB_TTY_WRITE_GBUFS];
+	unsigned long write_gbufs_free;
+	wait_queue_head_t write_wait;	/* for write_gbufs_free */
+	size_t write_size;	/* most bytes a gbuf can carry */
+	int tx_bytes;		/* in the gbufs that are in flight */
+	unsigned long tx_errors;
+	bool write_suspended;	/* the module is, writes wait in the fifo */
+
+	/*
+	 * Line coding and control line changes are only recorded here, and
+	 * @ctrl_work sends the latest of each when it gets to run, so a burst
+	 * of them turns into one message.  @ctrl_lock covers all of it.
+	 */
+	spinlock_t ctrl_lock;
+	struct gb_uart_line_coding line_coding;
+	u16 ctrlout;		/* GB_UART_CTRL_* */
+	bool rts_throttled;	/* RTS was dropped by gb_tty_throttle() */
+	bool line_coding_changed;
+	bool ctrlout_changed;
+	bool ctrl_busy;		/* @ctrl_gbuf is in flight */
+	struct gbuf *ctrl_gbuf;
+	struct work_struct ctrl_work;
+
 	struct async_icount iocount;
 	struct async_icount oldcount;
 	wait_queue_head_t wioctl;
-	struct mutex mutex;
+	struct rcu_head rcu;
 };
 
 static const struct greybus_module_id id_table[] = {
@@ -55,6 +157,14 @@ static const struct greybus_module_id id_table[] = {
 };
 
 static struct tty_driver *gb_tty_driver;
+
+/*
+ * Minors are only looked up under RCU, so opening ports doesn't take any
+ * lock at all, table_lock is just for adding and removing them.  A port is
+ * only freed, through RCU, once the last reference to it is gone, so one
+ * that is found is still there, but it might be on its way out, hence the
+ * tty_port_get() that fails once the port is done for.
+ */
 static DEFINE_IDR(tty_minors);
 static DEFINE_MUTEX(table_lock);
 
@@ -62,19 +172,18 @@ static struct gb_tty *get_gb_by_minor(unsigned minor)
 {
 	struct gb_tty *gb_tty;
 
-	mutex_lock(&table_lock);
+	rcu_read_lock();
 	gb_tty = idr_find(&tty_minors, minor);
-	if (gb_tty) {
-		mutex_lock(&gb_tty->mutex);
-		if (gb_tty->disconnected) {
-			mutex_unlock(&gb_tty->mutex);
-			gb_tty = NULL;
-		} else {
-			tty_port_get(&gb_tty->port);
-			mutex_unlock(&gb_tty->mutex);
-		}
+	if (gb_tty && !tty_port_get(&gb_tty->port))
+		gb_tty = NULL;
+	rcu_read_unlock();
+
+	/* Pairs with the barrier in gb_tty_disconnect() */
+	smp_rmb();
+	if (gb_tty && ACCESS_ONCE(gb_tty->disconnected)) {
+		tty_port_put(&gb_tty->port);
+		gb_tty = NULL;
 	}
-	mutex_unlock(&table_lock);
 	return gb_tty;
 }
 
@@ -90,13 +199,11 @@ static int alloc_minor(struct gb_tty *gb_tty)
 	return minor;
 }
 
+/* The port can still be open, but nobody new can find it */
 static void release_minor(struct gb_tty *gb_tty)
 {
-	int minor = gb_tty->minor;
-
-	gb_tty->minor = 0;	/* Maybe should use an invalid value instead */
 	mutex_lock(&table_lock);
-	idr_remove(&tty_minors, minor);
+	idr_remove(&tty_minors, gb_tty->minor);
 	mutex_unlock(&table_lock);
 }
 
@@ -148,63 +255,547 @@ static void gb_tty_hangup(struct tty_struct *tty)
 	tty_port_hangup(&gb_tty->port);
 }
 
+/*
+ * Send as much of the write fifo as there are free gbufs for.  Can be
+ * called from any context, the fifo is drained into the gbufs under the
+ * write lock, so nobody else can grab the same bytes.  Bytes only leave
+ * the fifo once the gbuf carrying them was submitted, whatever couldn't be
+ * sent goes out the next time this is called.
+ *
+ * Every gbuf in flight holds a reference to the port, its completion is
+ * the last to touch it.
+ */
+static void gb_tty_write_start(struct gb_tty *gb_tty)
+{
+	struct gb_uart_msg_header *header;
+	struct gbuf *gbuf;
+	unsigned long flags;
+	unsigned int count;
+	int retval;
+	int i;
+
+	spin_lock_irqsave(&gb_tty->write_lock, flags);
+	while (gb_tty->write_gbufs_free && !gb_tty->write_suspended &&
+	       !gb_tty->disconnected && !kfifo_is_empty(&gb_tty->write_fifo)) {
+		/*
+		 * Rather than sending a bit at a time, let the writes pile up
+		 * into a full gbuf while there is another one in flight,
+		 * unless we were asked to get everything out right away.
+		 */
+		if (!gb_tty->low_latency && gb_tty->tx_bytes &&
+		    kfifo_len(&gb_tty->write_fifo) < gb_tty->write_size)
+			break;
+
+		i = __ffs(gb_tty->write_gbufs_free);
+		gbuf = gb_tty->write_gbufs[i];
+
+		header = gbuf->transfer_buffer;
+		count = kfifo_out_peek(&gb_tty->write_fifo, (u8 *)(header + 1),
+				       gb_tty->write_size);
+		header->type = GB_UART_MSG_DATA;
+		header->reserved = 0;
+		header->size = cpu_to_le16(count);
+		gbuf->transfer_buffer_length = sizeof(*header) + count;
+
+		/* Completing the gbuf drops a reference, keep ours */
+		greybus_get_gbuf(gbuf);
+		tty_port_get(&gb_tty->port);
+		retval = greybus_submit_gbuf(gbuf, GFP_ATOMIC);
+		if (retval) {
+			/* The caller has a reference too, this isn't the last */
+			tty_port_put(&gb_tty->port);
+			greybus_put_gbuf(gbuf);
+			gb_tty->tx_errors++;
+			dev_err(&gb_tty->gmod->dev,
+				"error %d sending %u bytes, will retry\n",
+				retval, count);
+			break;
+		}
+
+		/* kfifo_skip() for @count bytes, they are on their way */
+		gb_tty->write_fifo.kfifo.out += count;
+		clear_bit(i, &gb_tty->write_gbufs_free);
+		gb_tty->tx_bytes += count;
+		gb_tty->iocount.tx += count;
+	}
+	spin_unlock_irqrestore(&gb_tty->write_lock, flags);
+}
+
+static void gb_tty_write_complete(struct gbuf *gbuf)
+{
+	struct gb_tty *gb_tty = gbuf->context;
+	unsigned long flags;
+	int i;
+
+	if (gbuf->status && gbuf->status != -ECONNRESET)
+		dev_err(&gb_tty->gmod->dev, "write error %d\n", gbuf->status);
+
+	spin_lock_irqsave(&gb_tty->write_lock, flags);
+	for (i = 0; i < GB_TTY_WRITE_GBUFS; ++i) {
+		if (gb_tty->write_gbufs[i] == gbuf) {
+			set_bit(i, &gb_tty->write_gbufs_free);
+			break;
+		}
+	}
+	gb_tty->tx_bytes -= gbuf->transfer_buffer_length -
+			    sizeof(struct gb_uart_msg_header);
+	spin_unlock_irqrestore(&gb_tty->write_lock, flags);
+	wake_up(&gb_tty->write_wait);
+
+	/*
+	 * Killed gbufs mean the module is going away or being suspended,
+	 * don't start more, resuming does.
+	 */
+	if (gbuf->status != -ECONNRESET)
+		gb_tty_write_start(gb_tty);
+
+	tty_port_tty_wakeup(&gb_tty->port);
+
+	/* Taken in gb_tty_write_start(), this can free the port */
+	tty_port_put(&gb_tty->port);
+}
+
 static int gb_tty_write(struct tty_struct *tty, const unsigned char *buf,
 			int count)
 {
-//	struct gb_tty *gb_tty = tty->driver_data;
+	struct gb_tty *gb_tty = tty->driver_data;
 
-	// FIXME - actually implement...
+	if (!count)
+		return 0;
 
-	return 0;
+	count = kfifo_in_spinlocked(&gb_tty->write_fifo, buf, count,
+				    &gb_tty->write_lock);
+	gb_tty_write_start(gb_tty);
+
+	return count;
 }
 
 static int gb_tty_write_room(struct tty_struct *tty)
 {
-//	struct gb_tty *gb_tty = tty->driver_data;
+	struct gb_tty *gb_tty = tty->driver_data;
+	unsigned long flags;
+	int room;
 
-	// FIXME - how much do we want to say we have room for?
-	return 0;
+	spin_lock_irqsave(&gb_tty->write_lock, flags);
+	room = kfifo_avail(&gb_tty->write_fifo);
+	spin_unlock_irqrestore(&gb_tty->write_lock, flags);
+
+	return room;
 }
 
 static int gb_tty_chars_in_buffer(struct tty_struct *tty)
 {
-//	struct gb_tty *gb_tty = tty->driver_data;
+	struct gb_tty *gb_tty = tty->driver_data;
+	unsigned long flags;
+	int chars;
 
-	// FIXME - how many left to send?
-	return 0;
+	spin_lock_irqsave(&gb_tty->write_lock, flags);
+	chars = kfifo_len(&gb_tty->write_fifo) + gb_tty->tx_bytes;
+	spin_unlock_irqrestore(&gb_tty->write_lock, flags);
+
+	return chars;
+}
+
+/*
+ * Send the latest line coding, or control lines, if they changed since they
+ * were last sent.  Only one of them is in flight at a time, whatever changes
+ * meanwhile goes out once it's back, see gb_tty_ctrl_complete().
+ */
+static void gb_tty_ctrl_work(struct work_struct *work)
+{
+	struct gb_tty *gb_tty = container_of(work, struct gb_tty, ctrl_work);
+	struct gbuf *gbuf = gb_tty->ctrl_gbuf;
+	struct gb_uart_msg_header *header = gbuf->transfer_buffer;
+	struct gb_uart_control *control;
+	u8 type;
+	int retval;
+
+	spin_lock_irq(&gb_tty->ctrl_lock);
+	if (gb_tty->ctrl_busy || gb_tty->disconnected) {
+		spin_unlock_irq(&gb_tty->ctrl_lock);
+		return;
+	}
+
+	if (gb_tty->line_coding_changed) {
+		type = GB_UART_MSG_LINE_CODING;
+		header->size = cpu_to_le16(sizeof(gb_tty->line_coding));
+		memcpy(header + 1, &gb_tty->line_coding,
+		       sizeof(gb_tty->line_coding));
+		gb_tty->line_coding_changed = false;
+	} else if (gb_tty->ctrlout_changed) {
+		type = GB_UART_MSG_CONTROL;
+		header->size = cpu_to_le16(sizeof(*control));
+		control = (struct gb_uart_control *)(header + 1);
+		control->control = cpu_to_le16(gb_tty->ctrlout);
+		gb_tty->ctrlout_changed = false;
+	} else {
+		spin_unlock_irq(&gb_tty->ctrl_lock);
+		return;
+	}
+	header->type = type;
+	header->reserved = 0;
+	gbuf->transfer_buffer_length = sizeof(*header) +
+				       le16_to_cpu(header->size);
+	gb_tty->ctrl_busy = true;
+	spin_unlock_irq(&gb_tty->ctrl_lock);
+
+	/* Completing the gbuf drops a reference, keep ours */
+	greybus_get_gbuf(gbuf);
+	tty_port_get(&gb_tty->port);
+	retval = greybus_submit_gbuf(gbuf, GFP_KERNEL);
+	if (!retval)
+		return;
+
+	/* Disconnect still has its reference, it cancels us first */
+	tty_port_put(&gb_tty->port);
+	greybus_put_gbuf(gbuf);
+	dev_err(&gb_tty->gmod->dev, "error %d sending message type %d\n",
+		retval, type);
+
+	/* Try again with the next change, or when the module is resumed */
+	spin_lock_irq(&gb_tty->ctrl_lock);
+	if (type == GB_UART_MSG_LINE_CODING)
+		gb_tty->line_coding_changed = true;
+	else
+		gb_tty->ctrlout_changed = true;
+	gb_tty->ctrl_busy = false;
+	spin_unlock_irq(&gb_tty->ctrl_lock);
+	wake_up(&gb_tty->write_wait);
+}
+
+static void gb_tty_ctrl_complete(struct gbuf *gbuf)
+{
+	struct gb_tty *gb_tty = gbuf->context;
+	unsigned long flags;
+
+	if (gbuf->status && gbuf->status != -ECONNRESET)
+		dev_err(&gb_tty->gmod->dev, "control message error %d\n",
+			gbuf->status);
+
+	/* Before it's not busy any more, so disconnect can cancel it */
+	spin_lock_irqsave(&gb_tty->ctrl_lock, flags);
+	if ((gb_tty->line_coding_changed || gb_tty->ctrlout_changed) &&
+	    gbuf->status != -ECONNRESET)
+		schedule_work(&gb_tty->ctrl_work);
+	gb_tty->ctrl_busy = false;
+	spin_unlock_irqrestore(&gb_tty->ctrl_lock, flags);
+	wake_up(&gb_tty->write_wait);
+
+	/* Taken in gb_tty_ctrl_work(), this can free the port */
+	tty_port_put(&gb_tty->port);
+}
+
+/* Change the control lines, the module hears about it from ctrl_work */
+static void gb_tty_set_ctrlout(struct gb_tty *gb_tty, u16 set, u16 clear)
+{
+	unsigned long flags;
+	u16 ctrlout;
+
+	spin_lock_irqsave(&gb_tty->ctrl_lock, flags);
+	/* Whoever set RTS last, unthrottling doesn't get to change it back */
+	if ((set | clear) & GB_UART_CTRL_RTS)
+		gb_tty->rts_throttled = false;
+	ctrlout = (gb_tty->ctrlout & ~clear) | set;
+	if (ctrlout != gb_tty->ctrlout) {
+		gb_tty->ctrlout = ctrlout;
+		gb_tty->ctrlout_changed = true;
+		if (!gb_tty->disconnected)
+			schedule_work(&gb_tty->ctrl_work);
+	}
+	spin_unlock_irqrestore(&gb_tty->ctrl_lock, flags);
 }
 
 static int gb_tty_break_ctl(struct tty_struct *tty, int state)
 {
-//	struct gb_tty *gb_tty = tty->driver_data;
+	struct gb_tty *gb_tty = tty->driver_data;
 
-	// FIXME - send a break, if asked to...
+	if (state)
+		gb_tty_set_ctrlout(gb_tty, GB_UART_CTRL_BRK, 0);
+	else
+		gb_tty_set_ctrlout(gb_tty, 0, GB_UART_CTRL_BRK);
 	return 0;
 }
 
 static void gb_tty_set_termios(struct tty_struct *tty, struct ktermios *old)
 {
-	// FIXME - is this it???
-	tty_termios_copy_hw(&tty->termios, old);
+	struct gb_tty *gb_tty = tty->driver_data;
+	struct ktermios *termios = &tty->termios;
+	struct gb_uart_line_coding line_coding;
+
+	line_coding.rate = cpu_to_le32(tty_get_baud_rate(tty));
+	line_coding.format = termios->c_cflag & CSTOPB ? 2 : 0;
+	line_coding.parity = termios->c_cflag & PARENB ?
+				(termios->c_cflag & PARODD ? 1 : 2) +
+				(termios->c_cflag & CMSPAR ? 2 : 0) : 0;
+	switch (termios->c_cflag & CSIZE) {
+	case CS5:
+		line_coding.data = 5;
+		break;
+	case CS6:
+		line_coding.data = 6;
+		break;
+	case CS7:
+		line_coding.data = 7;
+		break;
+	case CS8:
+	default:
+		line_coding.data = 8;
+		break;
+	}
+
+	gb_tty->clocal = ((termios->c_cflag & CLOCAL) != 0);
+
+	/* B0 means hang up, and coming back from it means pick up again */
+	if (C_BAUD(tty) == B0) {
+		line_coding.rate = gb_tty->line_coding.rate;
+		gb_tty_set_ctrlout(gb_tty, 0, GB_UART_CTRL_DTR);
+	} else if (old && (old->c_cflag & CBAUD) == B0) {
+		gb_tty_set_ctrlout(gb_tty, GB_UART_CTRL_DTR, 0);
+	}
+
+	spin_lock_irq(&gb_tty->ctrl_lock);
+	if (memcmp(&gb_tty->line_coding, &line_coding, sizeof(line_coding))) {
+		gb_tty->line_coding = line_coding;
+		gb_tty->line_coding_changed = true;
+		if (!gb_tty->disconnected)
+			schedule_work(&gb_tty->ctrl_work);
+	}
+	spin_unlock_irq(&gb_tty->ctrl_lock);
 }
 
+/* No round trip, the module tells us whenever its lines change */
 static int gb_tty_tiocmget(struct tty_struct *tty)
 {
-//	struct gb_tty *gb_tty = tty->driver_data;
+	struct gb_tty *gb_tty = tty->driver_data;
+	u16 ctrlout;
+	u16 ctrlin;
 
-	// FIXME - get some tiocms!
-	return 0;
+	spin_lock_irq(&gb_tty->ctrl_lock);
+	ctrlout = gb_tty->ctrlout;
+	spin_unlock_irq(&gb_tty->ctrl_lock);
+	spin_lock_irq(&gb_tty->read_lock);
+	ctrlin = gb_tty->ctrlin;
+	spin_unlock_irq(&gb_tty->read_lock);
+
+	return (ctrlout & GB_UART_CTRL_DTR ? TIOCM_DTR : 0) |
+	       (ctrlout & GB_UART_CTRL_RTS ? TIOCM_RTS : 0) |
+	       (ctrlin & GB_UART_STATE_DSR ? TIOCM_DSR : 0) |
+	       (ctrlin & GB_UART_STATE_RI ? TIOCM_RI : 0) |
+	       (ctrlin & GB_UART_STATE_DCD ? TIOCM_CD : 0) |
+	       TIOCM_CTS;
 }
 
 static int gb_tty_tiocmset(struct tty_struct *tty, unsigned int set,
 			   unsigned int clear)
 {
-//	struct gb_tty *gb_tty = tty->driver_data;
+	struct gb_tty *gb_tty = tty->driver_data;
 
-	// FIXME - set some tiocms!
+	gb_tty_set_ctrlout(gb_tty,
+			   (set & TIOCM_DTR ? GB_UART_CTRL_DTR : 0) |
+			   (set & TIOCM_RTS ? GB_UART_CTRL_RTS : 0),
+			   (clear & TIOCM_DTR ? GB_UART_CTRL_DTR : 0) |
+			   (clear & TIOCM_RTS ? GB_UART_CTRL_RTS : 0));
 	return 0;
 }
 
+/* What is in a message that came in, or NULL if it's broken */
+static u8 *gb_tty_read_msg(struct gb_tty *gb_tty, struct gbuf *gbuf,
+			   u8 *type, size_t *size)
+{
+	struct gb_uart_msg_header *header = gbuf->transfer_buffer;
+
+	if (gbuf->actual_length < sizeof(*header)) {
+		dev_err(&gb_tty->gmod->dev, "short message of %u bytes\n",
+			gbuf->actual_length);
+		return NULL;
+	}
+
+	*type = header->type;
+	*size = le16_to_cpu(header->size);
+	if (*size > gbuf->actual_length - sizeof(*header)) {
+		dev_err(&gb_tty->gmod->dev, "message of %zu bytes in %u\n",
+			*size, gbuf->actual_length);
+		return NULL;
+	}
+	return (u8 *)(header + 1);
+}
+
+/*
+ * Whatever doesn't fit in the flip buffer is an overrun.  In low latency
+ * mode this is called straight from the host controller's completion.
+ */
+static void gb_tty_read_push(struct gb_tty *gb_tty, u8 *data, size_t size)
+{
+	unsigned long flags;
+	int count;
+
+	count = tty_insert_flip_string(&gb_tty->port, data, size);
+	tty_flip_buffer_push(&gb_tty->port);
+
+	spin_lock_irqsave(&gb_tty->read_lock, flags);
+	gb_tty->iocount.rx += count;
+	if (count < size)
+		gb_tty->iocount.buf_overrun++;
+	spin_unlock_irqrestore(&gb_tty->read_lock, flags);
+}
+
+/*
+ * The module's lines changed, or it had errors.  Keep track of it for
+ * tiocmget, count it for TIOCGICOUNT, and wake up TIOCMIWAIT.
+ */
+static void gb_tty_serial_state(struct gb_tty *gb_tty, u8 *data, size_t size)
+{
+	struct gb_uart_serial_state *serial_state = (void *)data;
+	unsigned long flags;
+	u16 difference;
+	u16 state;
+
+	if (size < sizeof(*serial_state)) {
+		dev_err(&gb_tty->gmod->dev, "serial state of %zu bytes\n",
+			size);
+		return;
+	}
+	state = le16_to_cpu(serial_state->state);
+
+	spin_lock_irqsave(&gb_tty->read_lock, flags);
+	difference = gb_tty->ctrlin ^ state;
+	gb_tty->ctrlin = state;
+	if (difference & GB_UART_STATE_DSR)
+		gb_tty->iocount.dsr++;
+	if (difference & GB_UART_STATE_DCD)
+		gb_tty->iocount.dcd++;
+	if (state & GB_UART_STATE_BRK)
+		gb_tty->iocount.brk++;
+	if (state & GB_UART_STATE_RI)
+		gb_tty->iocount.rng++;
+	if (state & GB_UART_STATE_FRAMING)
+		gb_tty->iocount.frame++;
+	if (state & GB_UART_STATE_PARITY)
+		gb_tty->iocount.parity++;
+	if (state & GB_UART_STATE_OVERRUN)
+		gb_tty->iocount.overrun++;
+	spin_unlock_irqrestore(&gb_tty->read_lock, flags);
+
+	if (!gb_tty->clocal && (difference & GB_UART_STATE_DCD) &&
+	    !(state & GB_UART_STATE_DCD))
+		tty_port_tty_hangup(&gb_tty->port, false);
+
+	if (difference || (state & (GB_UART_STATE_BRK | GB_UART_STATE_RI)))
+		wake_up_all(&gb_tty->wioctl);
+}
+
+/*
+ * Called by whoever set @pushing, to hand what queued up on @read_held to
+ * the tty, until it is all gone or the tty throttles again, and then let
+ * go of @pushing.  A gbuf stays on the list until it has been pushed, so
+ * that data coming in meanwhile queues up behind it.
+ */
+static void gb_tty_read_held(struct gb_tty *gb_tty)
+{
+	struct gbuf *gbuf;
+	unsigned long flags;
+	size_t size;
+	u8 *data;
+	u8 type;
+
+	for (;;) {
+		spin_lock_irqsave(&gb_tty->read_lock, flags);
+		if (gb_tty->throttle_req || list_empty(&gb_tty->read_held)) {
+			gb_tty->pushing = 0;
+			spin_unlock_irqrestore(&gb_tty->read_lock, flags);
+			break;
+		}
+		gbuf = list_first_entry(&gb_tty->read_held, struct gbuf,
+					links);
+		spin_unlock_irqrestore(&gb_tty->read_lock, flags);
+
+		data = gb_tty_read_msg(gb_tty, gbuf, &type, &size);
+		gb_tty_read_push(gb_tty, data, size);
+
+		spin_lock_irqsave(&gb_tty->read_lock, flags);
+		list_del_init(&gbuf->links);
+		gb_tty->read_held_bytes -= size;
+		spin_unlock_irqrestore(&gb_tty->read_lock, flags);
+		greybus_put_gbuf(gbuf);
+	}
+}
+
+static void gb_tty_read_complete(struct gbuf *gbuf)
+{
+	struct gb_tty *gb_tty = gbuf->context;
+	unsigned long flags;
+	size_t size;
+	u8 *data;
+	u8 type;
+
+	data = gb_tty_read_msg(gb_tty, gbuf, &type, &size);
+	if (!data)
+		return;
+
+	if (type == GB_UART_MSG_SERIAL_STATE) {
+		gb_tty_serial_state(gb_tty, data, size);
+		return;
+	}
+	if (type != GB_UART_MSG_DATA || !size)
+		return;
+
+	/* Anything already held, or being pushed, has to go to the tty first */
+	spin_lock_irqsave(&gb_tty->read_lock, flags);
+	if (gb_tty->throttle_req || gb_tty->pushing ||
+	    !list_empty(&gb_tty->read_held)) {
+		if (gb_tty->read_held_bytes + size > GB_TTY_READ_HELD_MAX) {
+			gb_tty->iocount.buf_overrun++;
+		} else {
+			/* In gbufs are never submitted, so links is ours */
+			greybus_get_gbuf(gbuf);
+			list_add_tail(&gbuf->links, &gb_tty->read_held);
+			gb_tty->read_held_bytes += size;
+		}
+		spin_unlock_irqrestore(&gb_tty->read_lock, flags);
+		return;
+	}
+	gb_tty->pushing = 1;
+	spin_unlock_irqrestore(&gb_tty->read_lock, flags);
+
+	gb_tty_read_push(gb_tty, data, size);
+	gb_tty_read_held(gb_tty);
+}
+
+static void gb_tty_free_read_held(struct gb_tty *gb_tty)
+{
+	struct gbuf *gbuf;
+	struct gbuf *next;
+
+	list_for_each_entry_safe(gbuf, next, &gb_tty->read_held, links) {
+		list_del_init(&gbuf->links);
+		greybus_put_gbuf(gbuf);
+	}
+	gb_tty->read_held_bytes = 0;
+}
+
+/*
+ * Drop RTS so the module stops sending while the tty is throttled, and
+ * raise it again afterwards, unless someone else changed it meanwhile.
+ */
+static void gb_tty_throttle_rts(struct gb_tty *gb_tty, bool throttle)
+{
+	spin_lock_irq(&gb_tty->ctrl_lock);
+	if (throttle && (gb_tty->ctrlout & GB_UART_CTRL_RTS)) {
+		gb_tty->ctrlout &= ~GB_UART_CTRL_RTS;
+		gb_tty->rts_throttled = true;
+	} else if (!throttle && gb_tty->rts_throttled) {
+		gb_tty->ctrlout |= GB_UART_CTRL_RTS;
+		gb_tty->rts_throttled = false;
+	} else {
+		spin_unlock_irq(&gb_tty->ctrl_lock);
+		return;
+	}
+	gb_tty->ctrlout_changed = true;
+	if (!gb_tty->disconnected)
+		schedule_work(&gb_tty->ctrl_work);
+	spin_unlock_irq(&gb_tty->ctrl_lock);
+}
+
 static void gb_tty_throttle(struct tty_struct *tty)
 {
 	struct gb_tty *gb_tty = tty->driver_data;
@@ -212,22 +803,51 @@ static void gb_tty_throttle(struct tty_struct *tty)
 	spin_lock_irq(&gb_tty->read_lock);
 	gb_tty->throttle_req = 1;
 	spin_unlock_irq(&gb_tty->read_lock);
+
+	gb_tty_throttle_rts(gb_tty, true);
 }
 
 static void gb_tty_unthrottle(struct tty_struct *tty)
 {
 	struct gb_tty *gb_tty = tty->driver_data;
-	unsigned int was_throttled;
+	bool push;
 
+	/* If someone is pushing already, they see throttle_req go away */
 	spin_lock_irq(&gb_tty->read_lock);
-	was_throttled = gb_tty->throttled;
 	gb_tty->throttle_req = 0;
-	gb_tty->throttled = 0;
+	push = !gb_tty->pushing && !list_empty(&gb_tty->read_held);
+	if (push)
+		gb_tty->pushing = 1;
 	spin_unlock_irq(&gb_tty->read_lock);
 
-	if (was_throttled) {
-		// FIXME - send more data
-	}
+	if (push)
+		gb_tty_read_held(gb_tty);
+
+	gb_tty_throttle_rts(gb_tty, false);
+}
+
+/*
+ * Low latency mode hands data that comes in to the tty straight from the
+ * host controller's completion, without going through the greybus
+ * workqueue, and sends every write as soon as it is made.  Otherwise
+ * writes are batched up for throughput.
+ */
+static int gb_tty_set_low_latency(struct gb_tty *gb_tty, bool low_latency)
+{
+	int retval;
+
+	if (gb_tty->low_latency == low_latency)
+		return 0;
+
+	retval = gb_cport_set_atomic(gb_tty->gmod, gb_tty->cport->number,
+				     low_latency);
+	if (retval)
+		return retval;
+	gb_tty->low_latency = low_latency;
+
+	/* Whatever was waiting to be batched up can go now */
+	gb_tty_write_start(gb_tty);
+	return 0;
 }
 
 static int get_serial_info(struct gb_tty *gb_tty,
@@ -239,8 +859,8 @@ static int get_serial_info(struct gb_tty *gb_tty,
 		return -EINVAL;
 
 	memset(&tmp, 0, sizeof(tmp));
-	tmp.flags = ASYNC_LOW_LATENCY;
-	tmp.xmit_fifo_size = gb_tty->writesize;
+	tmp.flags = gb_tty->low_latency ? ASYNC_LOW_LATENCY : 0;
+	tmp.xmit_fifo_size = kfifo_size(&gb_tty->write_fifo);
 	tmp.baud_base = 0;	// FIXME
 	tmp.close_delay = gb_tty->port.close_delay / 10;
 	tmp.closing_wait = gb_tty->port.closing_wait == ASYNC_CLOSING_WAIT_NONE ?
@@ -268,15 +888,17 @@ static int set_serial_info(struct gb_tty *gb_tty,
 
 	mutex_lock(&gb_tty->port.mutex);
 	if (!capable(CAP_SYS_ADMIN)) {
+		/* Anybody can ask for low latency, like on other serial ports */
 		if ((close_delay != gb_tty->port.close_delay) ||
 		    (closing_wait != gb_tty->port.closing_wait))
 			retval = -EPERM;
-		else
-			retval = -EOPNOTSUPP;
 	} else {
 		gb_tty->port.close_delay = close_delay;
 		gb_tty->port.closing_wait = closing_wait;
 	}
+	if (!retval)
+		retval = gb_tty_set_low_latency(gb_tty,
+				new_serial.flags & ASYNC_LOW_LATENCY);
 	mutex_unlock(&gb_tty->port.mutex);
 	return retval;
 }
@@ -328,6 +950,10 @@ static int get_serial_usage(struct gb_tty *gb_tty,
 	int retval = 0;
 
 	memset(&icount, 0, sizeof(icount));
+	spin_lock_irq(&gb_tty->read_lock);
+	icount.rx = gb_tty->iocount.rx;
+	icount.tx = gb_tty->iocount.tx;
+	icount.buf_overrun = gb_tty->iocount.buf_overrun;
 	icount.dsr = gb_tty->iocount.dsr;
 	icount.rng = gb_tty->iocount.rng;
 	icount.dcd = gb_tty->iocount.dcd;
@@ -335,6 +961,7 @@ static int get_serial_usage(struct gb_tty *gb_tty,
 	icount.overrun = gb_tty->iocount.overrun;
 	icount.parity = gb_tty->iocount.parity;
 	icount.brk = gb_tty->iocount.brk;
+	spin_unlock_irq(&gb_tty->read_lock);
 
 	if (copy_to_user(count, &icount, sizeof(icount)) > 0)
 		retval = -EFAULT;
@@ -383,50 +1010,238 @@ static const struct tty_operations gb_ops = {
 	.tiocmset =		gb_tty_tiocmset,
 };
 
+static ssize_t low_latency_show(struct device *dev,
+				struct device_attribute *attr, char *buf)
+{
+	struct gb_tty *gb_tty = dev_get_drvdata(dev);
+
+	return sprintf(buf, "%d\n", gb_tty->low_latency);
+}
+
+static ssize_t low_latency_store(struct device *dev,
+				 struct device_attribute *attr,
+				 const char *buf, size_t count)
+{
+	struct gb_tty *gb_tty = dev_get_drvdata(dev);
+	bool low_latency;
+	int retval;
+
+	if (strtobool(buf, &low_latency))
+		return -EINVAL;
+
+	mutex_lock(&gb_tty->port.mutex);
+	retval = gb_tty_set_low_latency(gb_tty, low_latency);
+	mutex_unlock(&gb_tty->port.mutex);
+
+	return retval ? retval : count;
+}
+static DEVICE_ATTR_RW(low_latency);
+
+static struct attribute *gb_tty_attrs[] = {
+	&dev_attr_low_latency.attr,
+	NULL,
+};
+
+static const struct attribute_group gb_tty_attr_grp = {
+	.attrs =	gb_tty_attrs,
+};
+
+static const struct attribute_group *gb_tty_groups[] = {
+	&gb_tty_attr_grp,
+	NULL,
+};
+
+static void gb_tty_port_dtr_rts(struct tty_port *port, int raise)
+{
+	struct gb_tty *gb_tty = container_of(port, struct gb_tty, port);
+	unsigned long flags;
+
+	/*
+	 * set_termios() only sends the line coding when it changes, so a
+	 * module that's opened at the default one wouldn't hear it at all.
+	 */
+	if (raise) {
+		spin_lock_irqsave(&gb_tty->ctrl_lock, flags);
+		gb_tty->line_coding_changed = true;
+		if (!gb_tty->disconnected)
+			schedule_work(&gb_tty->ctrl_work);
+		spin_unlock_irqrestore(&gb_tty->ctrl_lock, flags);
+	}
+
+	if (raise)
+		gb_tty_set_ctrlout(gb_tty, GB_UART_CTRL_DTR | GB_UART_CTRL_RTS,
+				   0);
+	else
+		gb_tty_set_ctrlout(gb_tty, 0,
+				   GB_UART_CTRL_DTR | GB_UART_CTRL_RTS);
+}
+
+/* Whatever was not sent by the time the port is closed is thrown away */
+static void gb_tty_port_shutdown(struct tty_port *port)
+{
+	struct gb_tty *gb_tty = container_of(port, struct gb_tty, port);
+	unsigned long flags;
+
+	spin_lock_irqsave(&gb_tty->write_lock, flags);
+	kfifo_reset_out(&gb_tty->write_fifo);
+	spin_unlock_irqrestore(&gb_tty->write_lock, flags);
+}
+
+/* The last reference to the port is gone */
+static void gb_tty_port_destruct(struct tty_port *port)
+{
+	struct gb_tty *gb_tty = container_of(port, struct gb_tty, port);
+
+	kfifo_free(&gb_tty->write_fifo);
+
+	/* get_gb_by_minor() can still be looking at it */
+	kfree_rcu(gb_tty, rcu);
+}
+
+static const struct tty_port_operations gb_port_ops = {
+	.dtr_rts =		gb_tty_port_dtr_rts,
+	.shutdown =		gb_tty_port_shutdown,
+	.destruct =		gb_tty_port_destruct,
+};
+
+static void gb_tty_free_write_gbufs(struct gb_tty *gb_tty)
+{
+	int i;
+
+	for (i = 0; i < GB_TTY_WRITE_GBUFS; ++i) {
+		if (gb_tty->write_gbufs[i])
+			greybus_free_gbuf(gb_tty->write_gbufs[i]);
+		gb_tty->write_gbufs[i] = NULL;
+	}
+	gb_tty->write_gbufs_free = 0;
+
+	if (gb_tty->ctrl_gbuf)
+		greybus_free_gbuf(gb_tty->ctrl_gbuf);
+	gb_tty->ctrl_gbuf = NULL;
+}
+
+/*
+ * The gbufs for writes are allocated up front, big enough for one transfer
+ * on the cport, and used over and over again.
+ */
+static int gb_tty_alloc_write_gbufs(struct gb_tty *gb_tty)
+{
+	struct greybus_module *gmod = gb_tty->gmod;
+	size_t size = greybus_cport_mtu(gmod, gb_tty->cport);
+	int i;
+
+	if (size <= sizeof(struct gb_uart_msg_header)) {
+		dev_err(&gmod->dev, "cport %d mtu of %zu is too small\n",
+			gb_tty->cport->number, size);
+		return -EINVAL;
+	}
+	gb_tty->write_size = size - sizeof(struct gb_uart_msg_header);
+
+	if (kfifo_alloc(&gb_tty->write_fifo, GB_TTY_WRITE_FIFO_SIZE,
+			GFP_KERNEL))
+		return -ENOMEM;
+
+	for (i = 0; i < GB_TTY_WRITE_GBUFS; ++i) {
+		gb_tty->write_gbufs[i] = greybus_alloc_gbuf(gmod, gb_tty->cport,
+							    gb_tty_write_complete,
+							    size, GFP_KERNEL,
+							    gb_tty);
+		if (!gb_tty->write_gbufs[i]) {
+			gb_tty_free_write_gbufs(gb_tty);
+			return -ENOMEM;
+		}
+		set_bit(i, &gb_tty->write_gbufs_free);
+	}
+
+	/* Line coding and control lines have one of their own */
+	gb_tty->ctrl_gbuf = greybus_alloc_gbuf(gmod, gb_tty->cport,
+					       gb_tty_ctrl_complete,
+					       GB_UART_CTRL_MSG_SIZE,
+					       GFP_KERNEL, gb_tty);
+	if (!gb_tty->ctrl_gbuf) {
+		gb_tty_free_write_gbufs(gb_tty);
+		return -ENOMEM;
+	}
+	return 0;
+}
 
 int gb_tty_probe(struct greybus_module *gmod,
 		 const struct greybus_module_id *id)
 {
 	struct gb_tty *gb_tty;
 	struct device *tty_dev;
+	struct gmod_cport *cport;
 	int retval;
 	int minor;
 
+	cport = greybus_cport(gmod, le16_to_cpu(gmod->manifest->function.cport));
+	if (!cport) {
+		dev_err(&gmod->dev, "no cport for the UART\n");
+		return -ENODEV;
+	}
+
 	gb_tty = kzalloc(sizeof(*gb_tty), GFP_KERNEL);
 	if (!gb_tty)
 		return -ENOMEM;
 
+	gb_tty->gmod = gmod;
+	gb_tty->cport = cport;
+	tty_port_init(&gb_tty->port);
+	gb_tty->port.ops = &gb_port_ops;
+	spin_lock_init(&gb_tty->write_lock);
+	spin_lock_init(&gb_tty->read_lock);
+	INIT_LIST_HEAD(&gb_tty->read_held);
+	init_waitqueue_head(&gb_tty->wioctl);
+	init_waitqueue_head(&gb_tty->write_wait);
+	spin_lock_init(&gb_tty->ctrl_lock);
+	INIT_WORK(&gb_tty->ctrl_work, gb_tty_ctrl_work);
+	/* What tty_std_termios says, the module hears it when DTR goes up */
+	gb_tty->line_coding.rate = cpu_to_le32(9600);
+	gb_tty->line_coding.data = 8;
+
+	/* Lookups can find it from here on, so it has to be all set up */
 	minor = alloc_minor(gb_tty);
 	if (minor < 0) {
 		if (minor == -ENOSPC) {
 			dev_err(&gmod->dev, "no more free minor numbers\n");
-			return -ENODEV;
+			retval = -ENODEV;
+		} else {
+			retval = minor;
 		}
-		return minor;
+		goto error_minor;
 	}
 
-	gb_tty->minor = minor;
-	gb_tty->gmod = gmod;
-	spin_lock_init(&gb_tty->write_lock);
-	spin_lock_init(&gb_tty->read_lock);
-	init_waitqueue_head(&gb_tty->wioctl);
-	mutex_init(&gb_tty->mutex);
-
-	/* FIXME - allocate gb buffers */
+	retval = gb_tty_alloc_write_gbufs(gb_tty);
+	if (retval)
+		goto error_gbufs;
 
 	gmod->gb_tty = gb_tty;
 
-	tty_dev = tty_port_register_device(&gb_tty->port, gb_tty_driver, minor,
-					   &gmod->dev);
+	tty_dev = tty_port_register_device_attr(&gb_tty->port, gb_tty_driver,
+						minor, &gmod->dev, gb_tty,
+						gb_tty_groups);
 	if (IS_ERR(tty_dev)) {
 		retval = PTR_ERR(tty_dev);
 		goto error;
 	}
 
+	retval = gb_register_cport_complete(gmod, gb_tty_read_complete,
+					    cport->number, gb_tty);
+	if (retval) {
+		dev_err(&gmod->dev, "cport %d is already taken\n",
+			cport->number);
+		tty_unregister_device(gb_tty_driver, minor);
+		goto error;
+	}
+
 	return 0;
 error:
 	gmod->gb_tty = NULL;
+error_gbufs:
+	gb_tty_free_write_gbufs(gb_tty);
 	release_minor(gb_tty);
+error_minor:
+	tty_port_put(&gb_tty->port);
 	return retval;
 }
 
@@ -438,27 +1253,81 @@ void gb_tty_disconnect(struct greybus_module *gmod)
 	if (!gb_tty)
 		return;
 
-	mutex_lock(&gb_tty->mutex);
+	gb_deregister_cport_complete(gmod, gb_tty->cport->number);
+
+	/*
+	 * Nobody can open it from here on, see get_gb_by_minor(), and
+	 * gb_tty_write_start() doesn't send anything more.
+	 */
+	spin_lock_irq(&gb_tty->write_lock);
 	gb_tty->disconnected = true;
+	spin_unlock_irq(&gb_tty->write_lock);
+	smp_wmb();
 
 	wake_up_all(&gb_tty->wioctl);
 	gmod->gb_tty = NULL;
-	mutex_unlock(&gb_tty->mutex);
 
 	tty = tty_port_tty_get(&gb_tty->port);
 	if (tty) {
 		tty_vhangup(tty);
 		tty_kref_put(tty);
 	}
-	/* FIXME - stop all traffic */
+
+	/*
+	 * The core already cancelled whatever was in flight, but the gbufs
+	 * only come back to us once their completion has run.  Those hold
+	 * a reference to the port, so it's safe to give up on one that is
+	 * stuck.
+	 */
+	if (!wait_event_timeout(gb_tty->write_wait, gb_tty->write_gbufs_free ==
+				BIT(GB_TTY_WRITE_GBUFS) - 1 &&
+				!gb_tty->ctrl_busy, HZ))
+		dev_err(&gmod->dev, "tty gbufs still busy\n");
+	cancel_work_sync(&gb_tty->ctrl_work);
 
 	tty_unregister_device(gb_tty_driver, gb_tty->minor);
+	release_minor(gb_tty);
 
-	/* FIXME - free transmit / recieve buffers */
+	gb_tty_free_write_gbufs(gb_tty);
+	gb_tty_free_read_held(gb_tty);
 
+	/* It's freed once whoever still has it open closes it */
 	tty_port_put(&gb_tty->port);
+}
+
+/* Whatever is written while the module is suspended waits in the fifo */
+int gb_tty_suspend(struct greybus_module *gmod)
+{
+	struct gb_tty *gb_tty = gmod->gb_tty;
+
+	if (!gb_tty)
+		return 0;
+
+	spin_lock_irq(&gb_tty->write_lock);
+	gb_tty->write_suspended = true;
+	spin_unlock_irq(&gb_tty->write_lock);
+	return 0;
+}
+
+void gb_tty_resume(struct greybus_module *gmod)
+{
+	struct gb_tty *gb_tty = gmod->gb_tty;
+
+	if (!gb_tty)
+		return;
+
+	spin_lock_irq(&gb_tty->write_lock);
+	gb_tty->write_suspended = false;
+	spin_unlock_irq(&gb_tty->write_lock);
+
+	/* Control messages that failed while suspended go out now */
+	spin_lock_irq(&gb_tty->ctrl_lock);
+	if (gb_tty->line_coding_changed || gb_tty->ctrlout_changed)
+		schedule_work(&gb_tty->ctrl_work);
+	spin_unlock_irq(&gb_tty->ctrl_lock);
 
-	kfree(gb_tty);
+	gb_tty_write_start(gb_tty);
+	tty_port_tty_wakeup(&gb_tty->port);
 }
 
 #if 0